@@ -4,6 +4,7 @@
 #include "pclink.h"
 #include "raw-serial.h"
 #include "sdl-ps2.h"
+#include "speed.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -65,6 +66,23 @@ static struct k_info _keymap[RETROK_LAST];
 
 static struct retro_framebuffer _framebuffer;
 
+static struct Speed _speed;
+static retro_perf_get_time_usec_t _time_usec_cb;
+
+static const struct retro_variable _variables[] = {
+	{ "oberon_speed", "Emulation speed; 1x|2x|4x|8x|16x|max" },
+	{ NULL, NULL },
+};
+
+static void _update_variables(void)
+{
+	struct retro_variable var = { "oberon_speed", NULL };
+	if (_environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value) {
+		if (!speed_parse(&_speed, var.value))
+			_speed.target_hz = CPU_HZ;
+	}
+}
+
 void _keyboard_cb(bool down, unsigned keycode,
                   uint32_t character, uint16_t key_modifiers)
 {
@@ -137,7 +155,9 @@ void _keyboard_cb(bool down, unsigned keycode,
 }
 
 void retro_set_environment(retro_environment_t cb) {
-	_environ_cb = cb; }
+	_environ_cb = cb;
+	_environ_cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void *)_variables);
+}
 
 void retro_set_video_refresh(retro_video_refresh_t cb) {
 	_video_cb = cb; }
@@ -155,11 +175,17 @@ void retro_init(void)
 {
 	_risc = risc_new();
 	risc_set_serial(_risc, &pclink);
+	speed_init(&_speed, CPU_HZ);
 
 	struct retro_log_callback log_callback;
 	_log_cb = _environ_cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &log_callback)
 		? log_callback.log
 		: dummy_log;
+
+	struct retro_perf_callback perf_callback;
+	_time_usec_cb = _environ_cb(RETRO_ENVIRONMENT_GET_PERF_INTERFACE, &perf_callback)
+		? perf_callback.get_time_usec
+		: NULL;
 }
 
 void retro_deinit(void)
@@ -195,14 +221,14 @@ bool retro_load_game(const struct retro_game_info *game)
 	}
 
 	if (game->path)
-		_spi_disk = disk_new(game->path);
+		_spi_disk = disk_new(game->path, NULL);
 	if (!_spi_disk) {
 		_log_cb(RETRO_LOG_ERROR, "failed to load disk image\n");
 		return false;
 	}
 
 	risc_set_spi(_risc, 1, _spi_disk);
-	risc_set_serial(_risc, raw_serial_new("/dev/null", "/dev/null"));
+	risc_set_serial(_risc, raw_serial_new("/dev/null", "/dev/null", false));
 
 	enum retro_pixel_format pf = RETRO_PIXEL_FORMAT_RGB565;
 	_environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pf);
@@ -231,6 +257,7 @@ bool retro_load_game(const struct retro_game_info *game)
 	_ms_counter = 1;
 	_mouse_x = 0;
 	_mouse_y = _framebuffer.height;
+	_update_variables();
 
 	return true;
 }
@@ -255,7 +282,7 @@ bool retro_load_game_special(
 void retro_unload_game(void)
 {
 	if (!_risc && _spi_disk) {
-		free(_spi_disk);
+		disk_free(_spi_disk);
 		_spi_disk = NULL;
 	}
 }
@@ -267,6 +294,10 @@ size_t retro_get_memory_size(unsigned id) { return 0; }
 
 void retro_run(void)
 {
+	bool updated = false;
+	if (_environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+		_update_variables();
+
 	_input_poll_cb();
 
 	int mx = _mouse_x + _input_state_cb(
@@ -287,7 +318,18 @@ void retro_run(void)
 
 	risc_set_time(_risc, _ms_counter);
 	_ms_counter += 1000 / FPS;
-	risc_run(_risc, CPU_HZ / FPS);
+	// Without a timer we can't measure the host, so stick to the target.
+	// With one, leave half of the frame to the frontend.
+	uint32_t budget = speed_budget(&_speed, FPS, 1000000 / FPS / 2);
+	if (_time_usec_cb) {
+		retro_time_t start = _time_usec_cb();
+		int ran = risc_run(_risc, (int)(budget > INT32_MAX ? INT32_MAX : budget));
+		speed_measure(&_speed, (uint64_t)ran, (uint64_t)(_time_usec_cb() - start));
+	} else {
+		if (_speed.target_hz == 0)
+			budget = CPU_HZ / FPS;
+		risc_run(_risc, (int)budget);
+	}
 
  	struct Damage damage = risc_get_framebuffer_damage(_risc);
 	if (damage.y1 <= damage.y2) {
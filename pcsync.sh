@@ -0,0 +1,47 @@
+#!/bin/sh
+if [ $# -ne 1 ] || [ ! -d "$1" ]; then
+  echo "Usage: $0 directory"
+  echo "Triggers receive into the Oberon system of the files in directory"
+  echo "that changed since the last sync, and waits until they are sent."
+  echo "(Start PCLink first in Oberon, by middle-click or Alt on PCLink1.Run)"
+  exit 1
+fi
+dir=${1%/}
+sums="$dir/.pcsync"
+stamp="$dir/.pcsync-stamp"
+
+# Files not modified since the last sync are skipped, the others only
+# if their checksum changed.
+touch "$stamp.new"
+: > "$sums.new"
+list=
+for f in "$dir"/*; do
+  name=${f##*/}
+  case "$name" in
+    [A-Za-z]*) ;;
+    *) continue ;;
+  esac
+  case "$name" in
+    *[!A-Za-z0-9.]*) continue ;;
+  esac
+  [ -f "$f" ] || continue
+  sum=$(cksum < "$f")
+  echo "$sum $name" >> "$sums.new"
+  if [ -f "$stamp" ] && [ ! "$f" -nt "$stamp" ]; then
+    continue
+  fi
+  if [ -f "$sums" ] && grep -qxF "$sum $name" "$sums"; then
+    continue
+  fi
+  list="$list$f
+"
+done
+
+if [ -n "$list" ]; then
+  while [ -e PCLink.REC ]; do sleep 0.1; done
+  printf '%s' "$list" > PCLink.REC.tmp && mv PCLink.REC.tmp PCLink.REC
+  printf '%s' "$list"
+  while [ -e PCLink.REC ]; do sleep 0.1; done
+fi
+mv "$sums.new" "$sums"
+mv "$stamp.new" "$stamp"
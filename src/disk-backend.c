@@ -0,0 +1,301 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_MMAP
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk-backend.h"
+
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SECTOR_SIZE 512
+
+void disk_bytes_to_words(const uint8_t *bytes, uint32_t *words, uint32_t nwords) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(words, bytes, nwords * 4);
+#else
+  for (uint32_t i = 0; i < nwords; i++) {
+    words[i] = (uint32_t)bytes[i*4+0]
+      | ((uint32_t)bytes[i*4+1] << 8)
+      | ((uint32_t)bytes[i*4+2] << 16)
+      | ((uint32_t)bytes[i*4+3] << 24);
+  }
+#endif
+}
+
+void disk_words_to_bytes(const uint32_t *words, uint8_t *bytes, uint32_t nwords) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(bytes, words, nwords * 4);
+#else
+  for (uint32_t i = 0; i < nwords; i++) {
+    bytes[i*4+0] = (uint8_t)(words[i]      );
+    bytes[i*4+1] = (uint8_t)(words[i] >>  8);
+    bytes[i*4+2] = (uint8_t)(words[i] >> 16);
+    bytes[i*4+3] = (uint8_t)(words[i] >> 24);
+  }
+#endif
+}
+
+
+// Backends to finish at exit
+
+static struct DiskAtExit *at_exit;
+static pthread_mutex_t at_exit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The emulator can end through exit() from anywhere; don't lose the
+// guest's writes when it does.
+static void finish_all(void) {
+  pthread_mutex_lock(&at_exit_lock);
+  for (struct DiskAtExit *e = at_exit; e; e = e->next) {
+    e->finish(e->backend);
+  }
+  pthread_mutex_unlock(&at_exit_lock);
+}
+
+void disk_finish_at_exit(struct DiskAtExit *entry, struct DiskBackend *backend,
+                         void (*finish)(struct DiskBackend *)) {
+  static bool registered = false;
+  entry->backend = backend;
+  entry->finish = finish;
+  pthread_mutex_lock(&at_exit_lock);
+  entry->next = at_exit;
+  at_exit = entry;
+  if (!registered) {
+    atexit(finish_all);
+    registered = true;
+  }
+  pthread_mutex_unlock(&at_exit_lock);
+}
+
+void disk_forget_at_exit(struct DiskAtExit *entry) {
+  pthread_mutex_lock(&at_exit_lock);
+  struct DiskAtExit **p = &at_exit;
+  while (*p != entry) {
+    p = &(*p)->next;
+  }
+  *p = entry->next;
+  pthread_mutex_unlock(&at_exit_lock);
+}
+
+
+// stdio backend
+
+struct StdioDisk {
+  struct DiskBackend backend;
+  FILE *file;
+};
+
+static void stdio_read(struct DiskBackend *backend, uint32_t secnum, uint32_t *buf, uint32_t count) {
+  struct StdioDisk *disk = (struct StdioDisk *)backend;
+  bool ok = fseek(disk->file, (long)secnum * SECTOR_SIZE, SEEK_SET) == 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t bytes[SECTOR_SIZE] = { 0 };
+    if (ok) {
+      ok = fread(bytes, SECTOR_SIZE, 1, disk->file) == 1;
+    }
+    disk_bytes_to_words(bytes, &buf[i * 128], 128);
+  }
+}
+
+static void stdio_write(struct DiskBackend *backend, uint32_t secnum, const uint32_t *buf, uint32_t count) {
+  struct StdioDisk *disk = (struct StdioDisk *)backend;
+  if (fseek(disk->file, (long)secnum * SECTOR_SIZE, SEEK_SET) != 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t bytes[SECTOR_SIZE];
+    disk_words_to_bytes(&buf[i * 128], bytes, 128);
+    fwrite(bytes, SECTOR_SIZE, 1, disk->file);
+  }
+}
+
+static void stdio_flush(struct DiskBackend *backend, bool durable) {
+  struct StdioDisk *disk = (struct StdioDisk *)backend;
+  fflush(disk->file);
+#ifdef HAVE_MMAP
+  if (durable) {
+    fsync(fileno(disk->file));
+  }
+#endif
+}
+
+static void stdio_close(struct DiskBackend *backend) {
+  struct StdioDisk *disk = (struct StdioDisk *)backend;
+  stdio_flush(backend, true);
+  fclose(disk->file);
+  free(disk);
+}
+
+struct DiskBackend *disk_stdio_open(const char *filename) {
+  FILE *file = fopen(filename, "rb+");
+  if (file == NULL) {
+    return NULL;
+  }
+  struct StdioDisk *disk = calloc(1, sizeof(*disk));
+  if (disk == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  disk->backend = (struct DiskBackend){
+    .read = stdio_read,
+    .write = stdio_write,
+    .flush = stdio_flush,
+    .close = stdio_close
+  };
+  disk->file = file;
+  return &disk->backend;
+}
+
+
+// mmap backend
+
+#ifdef HAVE_MMAP
+
+// Writes past the end grow the image, but not beyond this.
+#define MAX_IMAGE_SIZE ((uint64_t)1 << 32)
+// The mapping grows in steps of this, so appending isn't a remap per
+// sector.  Only the part up to the end of the file is ever touched.
+#define MAP_STEP ((uint64_t)64 << 20)
+
+struct MmapDisk {
+  struct DiskBackend backend;
+  int fd;
+  uint8_t *map;  // NULL while nothing is mapped
+  uint64_t map_size;
+  uint64_t size;  // of the image
+  enum DiskMsync msync;
+  long page_size;
+};
+
+// Makes the image at least size bytes long.  On failure the image and
+// the old mapping are left as they were.
+static bool mmap_grow(struct MmapDisk *disk, uint64_t size) {
+  if (size > disk->map_size) {
+    uint64_t map_size = (size + MAP_STEP - 1) / MAP_STEP * MAP_STEP;
+    if (map_size > MAX_IMAGE_SIZE) {
+      map_size = size;
+    }
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    if (disk->map) {
+      munmap(disk->map, disk->map_size);
+    }
+    disk->map = map;
+    disk->map_size = map_size;
+  }
+  struct stat st;
+  if (fstat(disk->fd, &st) != 0 ||
+      ((uint64_t)st.st_size < size && ftruncate(disk->fd, (off_t)size) != 0)) {
+    return false;
+  }
+  if (size > disk->size) {
+    disk->size = size;
+  }
+  return true;
+}
+
+static void mmap_read(struct DiskBackend *backend, uint32_t secnum, uint32_t *buf, uint32_t count) {
+  struct MmapDisk *disk = (struct MmapDisk *)backend;
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t offset = ((uint64_t)secnum + i) * SECTOR_SIZE;
+    if (offset + SECTOR_SIZE <= disk->size) {
+      disk_bytes_to_words(disk->map + offset, &buf[i * 128], 128);
+    } else {
+      uint8_t bytes[SECTOR_SIZE] = { 0 };
+      if (offset < disk->size) {
+        memcpy(bytes, disk->map + offset, disk->size - offset);
+      }
+      disk_bytes_to_words(bytes, &buf[i * 128], 128);
+    }
+  }
+}
+
+static void mmap_write(struct DiskBackend *backend, uint32_t secnum, const uint32_t *buf, uint32_t count) {
+  struct MmapDisk *disk = (struct MmapDisk *)backend;
+  uint64_t start = (uint64_t)secnum * SECTOR_SIZE;
+  uint64_t end = start + (uint64_t)count * SECTOR_SIZE;
+  if (end > disk->size) {
+    if (end > MAX_IMAGE_SIZE || !mmap_grow(disk, end)) {
+      fprintf(stderr, "Can't grow disk image to %llu bytes: %s\n",
+              (unsigned long long)end, strerror(errno));
+      return;
+    }
+  }
+  disk_words_to_bytes(buf, disk->map + start, count * 128);
+  if (disk->msync != DISK_MSYNC_NONE) {
+    uint64_t page = start - start % (uint64_t)disk->page_size;
+    msync(disk->map + page, end - page, disk->msync == DISK_MSYNC_SYNC ? MS_SYNC : MS_ASYNC);
+  }
+}
+
+static void mmap_flush(struct DiskBackend *backend, bool durable) {
+  struct MmapDisk *disk = (struct MmapDisk *)backend;
+  if (disk->map) {
+    msync(disk->map, disk->size, durable ? MS_SYNC : MS_ASYNC);
+  }
+}
+
+static void mmap_close(struct DiskBackend *backend) {
+  struct MmapDisk *disk = (struct MmapDisk *)backend;
+  mmap_flush(backend, true);
+  if (disk->map) {
+    munmap(disk->map, disk->map_size);
+  }
+  close(disk->fd);
+  free(disk);
+}
+
+struct DiskBackend *disk_mmap_open(const char *filename, enum DiskMsync msync) {
+  int fd = open(filename, O_RDWR);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = ENOTSUP;
+    return NULL;
+  }
+  struct MmapDisk *disk = calloc(1, sizeof(*disk));
+  if (disk == NULL) {
+    close(fd);
+    return NULL;
+  }
+  disk->backend = (struct DiskBackend){
+    .read = mmap_read,
+    .write = mmap_write,
+    .flush = mmap_flush,
+    .close = mmap_close
+  };
+  disk->fd = fd;
+  disk->msync = msync;
+  disk->page_size = sysconf(_SC_PAGESIZE);
+  if (st.st_size > 0 && !mmap_grow(disk, (uint64_t)st.st_size)) {
+    int err = errno;
+    close(fd);
+    free(disk);
+    errno = err;
+    return NULL;
+  }
+  return &disk->backend;
+}
+
+#else  // HAVE_MMAP
+
+struct DiskBackend *disk_mmap_open(const char *filename, enum DiskMsync msync) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+#endif  // HAVE_MMAP
@@ -0,0 +1,106 @@
+#ifndef DISK_BACKEND_H
+#define DISK_BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Storage behind the emulated SD card.  Sectors are 512 bytes; buffers
+// hold them as 128 words in host byte order, the way the SPI protocol
+// hands them over (the image itself is little endian).  Sectors past
+// the end of the image read as zeros.
+struct DiskBackend {
+  void (*read)(struct DiskBackend *, uint32_t secnum, uint32_t *buf, uint32_t count);
+  void (*write)(struct DiskBackend *, uint32_t secnum, const uint32_t *buf, uint32_t count);
+  // Push written sectors towards the image; with durable set, don't
+  // return before they are on stable storage.
+  void (*flush)(struct DiskBackend *, bool durable);
+  // Flushes (durably) and frees the backend.
+  void (*close)(struct DiskBackend *);
+};
+
+enum DiskMsync {
+  DISK_MSYNC_NONE,   // leave write-back to the kernel, sync at exit
+  DISK_MSYNC_ASYNC,  // schedule write-back after every guest write
+  DISK_MSYNC_SYNC,   // wait for write-back after every guest write
+};
+
+// fread/fwrite on a stdio stream.
+struct DiskBackend *disk_stdio_open(const char *filename);
+
+// The whole image mapped with MAP_SHARED; sector transfers are memory
+// copies.  Returns NULL (with errno set) if the platform or file
+// doesn't support it.
+struct DiskBackend *disk_mmap_open(const char *filename, enum DiskMsync msync);
+
+// Copy-on-write overlay on top of a read-only base image.  The file
+// starts with a header
+//   "RISCOVL3", u32 sectors covered, u32 sectors stored,
+//   u32 length of the base image path, u64 size and u64 FNV-1a hash of
+//   the base image, u32 1 while a commit into the base is in progress,
+//   u64 size and u64 hash the base will have after it, the path itself
+// (relative paths are relative to the overlay's directory), then, on
+// the next 512-byte boundary, a u32 per covered sector holding 0 if
+// the sector comes from the base or 1 + its index in the data area,
+// which starts on the boundary after the table.  All little endian.
+#define DISK_OVERLAY_MAGIC "RISCOVL3"
+
+bool disk_overlay_probe(const char *filename);
+struct DiskBackend *disk_overlay_open(const char *filename);
+
+// Compressed image, in chunks that are decompressed on demand into a
+// small LRU cache and recompressed when they are evicted or flushed.
+// The file starts with a header
+//   "RISCLZ01", u32 sectors per chunk, u32 number of chunks,
+//   u32 size of the uncompressed image in sectors,
+// followed at offset 32 by an index of {u64 offset, u32 length,
+// u32 space} per chunk.  Length 0 means the chunk is all zeros, a full
+// chunk length that it is stored uncompressed, otherwise it is
+// compressed with the codec in lz.c.  Space is the room reserved for
+// the chunk at offset.  All little endian.
+#define DISK_LZ_MAGIC "RISCLZ01"
+#define DISK_LZ_CHUNK_SECTORS 64
+
+bool disk_lz_probe(const char *filename);
+struct DiskBackend *disk_lz_open(const char *filename);
+// Creates an empty (all zero) compressed image of num_sectors sectors,
+// of which image_sectors are considered the image proper.
+bool disk_lz_create(const char *filename, uint32_t image_sectors, uint32_t num_sectors);
+
+// The whole image loaded into memory.  With save set, a modified image
+// is written back on close to a temporary file that is then renamed
+// over the original, so the image is either entirely old or entirely
+// new; otherwise changes are discarded.
+struct DiskBackend *disk_ram_open(const char *filename, bool save);
+
+enum DiskCachePolicy {
+  DISK_CACHE_WRITETHROUGH,  // every write reaches the backend before returning
+  DISK_CACHE_PERIODIC,      // written back by a background thread every interval
+  DISK_CACHE_EXIT,          // kept in memory until exit (or too many are dirty)
+};
+
+// Write-back sector cache in front of another backend, which it takes
+// ownership of.  Dirty sectors are held in memory and written back in
+// runs of consecutive sectors by a background thread.  With fsync set,
+// every write-back (every write in write-through mode) is made durable.
+// Dirty sectors are also written back if the process calls exit().
+struct DiskBackend *disk_cache_open(struct DiskBackend *inner, enum DiskCachePolicy policy,
+                                    uint32_t interval_ms, bool fsync);
+
+// Backends that keep the guest's writes in memory register here, with
+// an entry they embed, to have finish called on them if the process
+// calls exit(); they must forget the entry before they are freed.
+struct DiskAtExit {
+  struct DiskBackend *backend;
+  void (*finish)(struct DiskBackend *);
+  struct DiskAtExit *next;
+};
+
+void disk_finish_at_exit(struct DiskAtExit *entry, struct DiskBackend *backend,
+                         void (*finish)(struct DiskBackend *));
+void disk_forget_at_exit(struct DiskAtExit *entry);
+
+// Conversion between image bytes and sector words.
+void disk_bytes_to_words(const uint8_t *bytes, uint32_t *words, uint32_t nwords);
+void disk_words_to_bytes(const uint32_t *words, uint8_t *bytes, uint32_t nwords);
+
+#endif  // DISK_BACKEND_H
@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "disk-backend.h"
+
+#define BUCKETS 4096
+#define FLUSH_DIRTY 16384  // start writing back at this many dirty sectors (8 MB)
+#define MAX_DIRTY 32768    // and make the guest wait beyond this
+#define MAX_RUN 256        // sectors per backend write
+
+struct CacheEntry {
+  struct CacheEntry *next;
+  uint32_t secnum;
+  uint32_t gen;  // bumped on every write, so a write-back knows if it's stale
+  uint32_t data[128];
+};
+
+struct DiskCache {
+  struct DiskBackend backend;
+  struct DiskBackend *inner;
+  enum DiskCachePolicy policy;
+  uint32_t interval_ms;
+  bool fsync;
+
+  // Lock order: writeback_lock (one write-back at a time, so an older
+  // snapshot can't overwrite a newer one), lock (the table), inner_lock
+  // (the inner backend).
+  pthread_mutex_t writeback_lock;
+  pthread_mutex_t lock;
+  pthread_mutex_t inner_lock;
+  pthread_cond_t wake;     // to the writer thread
+  pthread_cond_t drained;  // from the writer thread
+  struct CacheEntry *buckets[BUCKETS];
+  uint32_t count;
+  uint32_t gen;
+  bool flush_now;
+  bool stop;
+  bool has_thread;
+  pthread_t thread;
+  uint32_t run[MAX_RUN * 128];  // write_back() staging, under writeback_lock
+
+  struct DiskAtExit at_exit;
+};
+
+// Snapshot of a dirty sector taken for write-back.
+struct Dirty {
+  uint32_t secnum;
+  uint32_t gen;
+  uint32_t *data;
+};
+
+static struct CacheEntry **lookup(struct DiskCache *cache, uint32_t secnum) {
+  struct CacheEntry **p = &cache->buckets[secnum % BUCKETS];
+  while (*p && (*p)->secnum != secnum) {
+    p = &(*p)->next;
+  }
+  return p;
+}
+
+static int compare_dirty(const void *a, const void *b) {
+  uint32_t x = ((const struct Dirty *)a)->secnum, y = ((const struct Dirty *)b)->secnum;
+  return (x > y) - (x < y);
+}
+
+// Write back everything that is dirty right now.  The table isn't
+// locked while the backend is busy, so the guest can keep writing.
+static void write_back(struct DiskCache *cache) {
+  pthread_mutex_lock(&cache->writeback_lock);
+  pthread_mutex_lock(&cache->lock);
+  uint32_t n = cache->count;
+  struct Dirty *dirty = n ? malloc(n * sizeof(*dirty)) : NULL;
+  uint32_t *words = n ? malloc((size_t)n * 512) : NULL;
+  if (dirty == NULL || words == NULL) {
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&cache->writeback_lock);
+    free(dirty);
+    free(words);
+    return;
+  }
+  uint32_t i = 0;
+  for (int b = 0; b < BUCKETS; b++) {
+    for (struct CacheEntry *e = cache->buckets[b]; e; e = e->next) {
+      dirty[i] = (struct Dirty){ .secnum = e->secnum, .gen = e->gen, .data = &words[i * 128] };
+      memcpy(dirty[i].data, e->data, 512);
+      i++;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  qsort(dirty, n, sizeof(*dirty), compare_dirty);
+  uint32_t *run = cache->run;
+  for (i = 0; i < n; ) {
+    uint32_t len = 0;
+    do {
+      memcpy(&run[len * 128], dirty[i + len].data, 512);
+      len++;
+    } while (i + len < n && len < MAX_RUN && dirty[i + len].secnum == dirty[i].secnum + len);
+    // One run at a time, so a guest read waits for at most one run
+    pthread_mutex_lock(&cache->inner_lock);
+    cache->inner->write(cache->inner, dirty[i].secnum, run, len);
+    pthread_mutex_unlock(&cache->inner_lock);
+    i += len;
+  }
+  pthread_mutex_lock(&cache->inner_lock);
+  cache->inner->flush(cache->inner, cache->fsync);
+  pthread_mutex_unlock(&cache->inner_lock);
+
+  pthread_mutex_lock(&cache->lock);
+  for (i = 0; i < n; i++) {
+    struct CacheEntry **p = lookup(cache, dirty[i].secnum);
+    if (*p && (*p)->gen == dirty[i].gen) {
+      struct CacheEntry *e = *p;
+      *p = e->next;
+      free(e);
+      cache->count--;
+    }
+  }
+  pthread_cond_broadcast(&cache->drained);
+  pthread_mutex_unlock(&cache->lock);
+  pthread_mutex_unlock(&cache->writeback_lock);
+  free(dirty);
+  free(words);
+}
+
+static void *writer_thread(void *arg) {
+  struct DiskCache *cache = arg;
+  pthread_mutex_lock(&cache->lock);
+  while (!cache->stop) {
+    if (cache->policy == DISK_CACHE_PERIODIC && !cache->flush_now) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += cache->interval_ms / 1000;
+      deadline.tv_nsec += (long)(cache->interval_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&cache->wake, &cache->lock, &deadline);
+    } else if (!cache->flush_now) {
+      pthread_cond_wait(&cache->wake, &cache->lock);
+    }
+    if (cache->stop) {
+      break;
+    }
+    cache->flush_now = false;
+    if (cache->count > 0) {
+      pthread_mutex_unlock(&cache->lock);
+      write_back(cache);
+      pthread_mutex_lock(&cache->lock);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+static void cache_read(struct DiskBackend *backend, uint32_t secnum, uint32_t *buf, uint32_t count) {
+  struct DiskCache *cache = (struct DiskCache *)backend;
+  pthread_mutex_lock(&cache->lock);
+  uint32_t i = 0;
+  while (i < count) {
+    struct CacheEntry *e = *lookup(cache, secnum + i);
+    if (e) {
+      memcpy(&buf[i * 128], e->data, 512);
+      i++;
+      continue;
+    }
+    // Read the run of sectors that aren't cached in one go.  The
+    // backend has their current contents: only the guest adds entries,
+    // and a write-back drops them only after writing them.  So the
+    // table can be unlocked meanwhile and the write-back can go on.
+    uint32_t len = 1;
+    while (i + len < count && *lookup(cache, secnum + i + len) == NULL) {
+      len++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_lock(&cache->inner_lock);
+    cache->inner->read(cache->inner, secnum + i, &buf[i * 128], len);
+    pthread_mutex_unlock(&cache->inner_lock);
+    pthread_mutex_lock(&cache->lock);
+    i += len;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static void cache_write(struct DiskBackend *backend, uint32_t secnum, const uint32_t *buf, uint32_t count) {
+  struct DiskCache *cache = (struct DiskCache *)backend;
+  if (cache->policy == DISK_CACHE_WRITETHROUGH) {
+    pthread_mutex_lock(&cache->inner_lock);
+    cache->inner->write(cache->inner, secnum, buf, count);
+    if (cache->fsync) {
+      cache->inner->flush(cache->inner, true);
+    }
+    pthread_mutex_unlock(&cache->inner_lock);
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  while (cache->count >= MAX_DIRTY) {
+    cache->flush_now = true;
+    pthread_cond_signal(&cache->wake);
+    pthread_cond_wait(&cache->drained, &cache->lock);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    struct CacheEntry **p = lookup(cache, secnum + i);
+    if (*p == NULL) {
+      *p = malloc(sizeof(**p));
+      if (*p == NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        abort();
+      }
+      (*p)->next = NULL;
+      (*p)->secnum = secnum + i;
+      cache->count++;
+    }
+    memcpy((*p)->data, &buf[i * 128], 512);
+    (*p)->gen = ++cache->gen;
+  }
+  if (cache->count >= FLUSH_DIRTY) {
+    cache->flush_now = true;
+    pthread_cond_signal(&cache->wake);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static void cache_flush(struct DiskBackend *backend, bool durable) {
+  struct DiskCache *cache = (struct DiskCache *)backend;
+  write_back(cache);
+  if (durable && !cache->fsync) {
+    pthread_mutex_lock(&cache->inner_lock);
+    cache->inner->flush(cache->inner, true);
+    pthread_mutex_unlock(&cache->inner_lock);
+  }
+}
+
+static void cache_close(struct DiskBackend *backend) {
+  struct DiskCache *cache = (struct DiskCache *)backend;
+  if (cache->has_thread) {
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = true;
+    pthread_cond_signal(&cache->wake);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->thread, NULL);
+  }
+  disk_forget_at_exit(&cache->at_exit);
+  write_back(cache);
+  cache->inner->close(cache->inner);
+  pthread_mutex_destroy(&cache->writeback_lock);
+  pthread_mutex_destroy(&cache->lock);
+  pthread_mutex_destroy(&cache->inner_lock);
+  pthread_cond_destroy(&cache->wake);
+  pthread_cond_destroy(&cache->drained);
+  free(cache);
+}
+
+static void cache_finish(struct DiskBackend *backend) {
+  cache_flush(backend, true);
+}
+
+struct DiskBackend *disk_cache_open(struct DiskBackend *inner, enum DiskCachePolicy policy,
+                                    uint32_t interval_ms, bool fsync) {
+  struct DiskCache *cache = calloc(1, sizeof(*cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->backend = (struct DiskBackend){
+    .read = cache_read,
+    .write = cache_write,
+    .flush = cache_flush,
+    .close = cache_close
+  };
+  cache->inner = inner;
+  cache->policy = policy;
+  cache->interval_ms = interval_ms ? interval_ms : 1000;
+  cache->fsync = fsync;
+  pthread_mutex_init(&cache->writeback_lock, NULL);
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_mutex_init(&cache->inner_lock, NULL);
+  pthread_cond_init(&cache->wake, NULL);
+  pthread_cond_init(&cache->drained, NULL);
+  if (policy != DISK_CACHE_WRITETHROUGH) {
+    cache->has_thread = pthread_create(&cache->thread, NULL, writer_thread, cache) == 0;
+    if (!cache->has_thread) {
+      cache->policy = DISK_CACHE_WRITETHROUGH;
+    }
+  }
+  disk_finish_at_exit(&cache->at_exit, &cache->backend, cache_finish);
+  return &cache->backend;
+}
@@ -0,0 +1,411 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_FSYNC
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk-backend.h"
+#include "lz.h"
+
+#ifdef HAVE_FSYNC
+#include <unistd.h>
+#endif
+
+#define SECTOR_SIZE 512
+#define HEADER_SIZE 32
+#define INDEX_ENTRY 16
+#define CACHE_CHUNKS 16
+#define SPACE_UNIT 4096
+
+struct LzIndex {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t space;
+};
+
+// Space that no chunk uses any more
+struct LzSpace {
+  uint64_t offset;
+  uint32_t space;
+};
+
+struct LzSlot {
+  uint32_t chunk;
+  bool used;
+  bool dirty;
+  uint64_t last_use;
+  uint8_t *data;
+};
+
+struct LzDisk {
+  struct DiskBackend backend;
+  FILE *file;
+  uint32_t chunk_sectors;
+  uint32_t chunk_size;  // bytes
+  uint32_t num_chunks;
+  uint32_t image_sectors;
+  bool header_dirty;
+  uint64_t end;  // of the space handed out so far
+  struct LzIndex *index;
+  struct LzSpace *free_space;
+  uint32_t num_free;
+  uint32_t free_cap;
+  struct LzSlot slots[CACHE_CHUNKS];
+  uint64_t clock;
+  uint8_t *cbuf;  // compressed data
+};
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+bool disk_lz_probe(const char *filename) {
+  char magic[8];
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  bool found = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, DISK_LZ_MAGIC, 8) == 0;
+  fclose(f);
+  return found;
+}
+
+static bool write_index(struct LzDisk *disk, uint32_t chunk) {
+  uint8_t entry[INDEX_ENTRY];
+  struct LzIndex *ix = &disk->index[chunk];
+  put_u32(&entry[0], (uint32_t)ix->offset);
+  put_u32(&entry[4], (uint32_t)(ix->offset >> 32));
+  put_u32(&entry[8], ix->length);
+  put_u32(&entry[12], ix->space);
+  return fseek(disk->file, HEADER_SIZE + (long)chunk * INDEX_ENTRY, SEEK_SET) == 0
+    && fwrite(entry, INDEX_ENTRY, 1, disk->file) == 1;
+}
+
+static void load_chunk(struct LzDisk *disk, struct LzSlot *slot) {
+  struct LzIndex *ix = &disk->index[slot->chunk];
+  bool ok = true;
+  if (ix->length == 0) {
+    memset(slot->data, 0, disk->chunk_size);
+  } else if (ix->length > disk->chunk_size || fseek(disk->file, (long)ix->offset, SEEK_SET) != 0) {
+    ok = false;
+  } else if (ix->length == disk->chunk_size) {
+    ok = fread(slot->data, disk->chunk_size, 1, disk->file) == 1;
+  } else {
+    ok = fread(disk->cbuf, ix->length, 1, disk->file) == 1
+      && lz_decompress(disk->cbuf, ix->length, slot->data, disk->chunk_size) == (long)disk->chunk_size;
+  }
+  if (!ok) {
+    fprintf(stderr, "Compressed disk: chunk %u is unreadable\n", slot->chunk);
+    memset(slot->data, 0, disk->chunk_size);
+  }
+}
+
+static bool all_zero(const uint8_t *p, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (p[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void give_space(struct LzDisk *disk, uint64_t offset, uint32_t space) {
+  if (space == 0) {
+    return;
+  }
+  if (disk->num_free == disk->free_cap) {
+    uint32_t cap = disk->free_cap ? disk->free_cap * 2 : 64;
+    struct LzSpace *p = realloc(disk->free_space, cap * sizeof(*p));
+    if (p == NULL) {
+      return;  // leaked until the image is repacked
+    }
+    disk->free_space = p;
+    disk->free_cap = cap;
+  }
+  disk->free_space[disk->num_free++] = (struct LzSpace){ .offset = offset, .space = space };
+}
+
+// Room for length bytes from the best fitting free space, or else from
+// the end of the file.  Space is handed out in SPACE_UNIT steps so that
+// a chunk whose compressed size creeps up still fits a piece that size.
+static void take_space(struct LzDisk *disk, struct LzIndex *ix) {
+  uint32_t space = (ix->length + SPACE_UNIT - 1) / SPACE_UNIT * SPACE_UNIT;
+  if (space > disk->chunk_size) {
+    space = disk->chunk_size;
+  }
+  uint32_t best = disk->num_free;
+  for (uint32_t i = 0; i < disk->num_free; i++) {
+    if (disk->free_space[i].space >= space &&
+        (best == disk->num_free || disk->free_space[i].space < disk->free_space[best].space)) {
+      best = i;
+    }
+  }
+  if (best < disk->num_free) {
+    struct LzSpace piece = disk->free_space[best];
+    disk->free_space[best] = disk->free_space[--disk->num_free];
+    ix->offset = piece.offset;
+    ix->space = space;
+    give_space(disk, piece.offset + space, piece.space - space);
+  } else {
+    ix->offset = disk->end;
+    ix->space = space;
+    disk->end += space;
+  }
+}
+
+// New data never overwrites the chunk's current data: it goes to other
+// space, is flushed, and only then does the index entry point at it and
+// the old space become free.  So a crash leaves either the old or the
+// new chunk.
+static void store_chunk(struct LzDisk *disk, struct LzSlot *slot) {
+  struct LzIndex *ix = &disk->index[slot->chunk];
+  struct LzIndex new_ix = { 0 };
+  const uint8_t *out = NULL;
+  if (!all_zero(slot->data, disk->chunk_size)) {
+    size_t len = lz_compress(slot->data, disk->chunk_size, disk->cbuf, disk->chunk_size - 1);
+    if (len == 0) {
+      out = slot->data;
+      new_ix.length = disk->chunk_size;
+    } else {
+      out = disk->cbuf;
+      new_ix.length = (uint32_t)len;
+    }
+  }
+  if (out) {
+    take_space(disk, &new_ix);
+    if (fseek(disk->file, (long)new_ix.offset, SEEK_SET) != 0 ||
+        fwrite(out, new_ix.length, 1, disk->file) != 1 || fflush(disk->file) != 0) {
+      fprintf(stderr, "Compressed disk: can't write chunk %u\n", slot->chunk);
+      give_space(disk, new_ix.offset, new_ix.space);
+      return;
+    }
+  }
+  struct LzIndex old_ix = *ix;
+  *ix = new_ix;
+  if (write_index(disk, slot->chunk) && fflush(disk->file) == 0) {
+    give_space(disk, old_ix.offset, old_ix.space);
+  }
+  slot->dirty = false;
+}
+
+static uint8_t *get_chunk(struct LzDisk *disk, uint32_t chunk) {
+  struct LzSlot *victim = &disk->slots[0];
+  for (int i = 0; i < CACHE_CHUNKS; i++) {
+    struct LzSlot *slot = &disk->slots[i];
+    if (slot->used && slot->chunk == chunk) {
+      slot->last_use = ++disk->clock;
+      return slot->data;
+    }
+    if (!slot->used || (victim->used && slot->last_use < victim->last_use)) {
+      victim = slot;
+    }
+  }
+  if (victim->used && victim->dirty) {
+    store_chunk(disk, victim);
+  }
+  victim->chunk = chunk;
+  victim->used = true;
+  victim->dirty = false;
+  victim->last_use = ++disk->clock;
+  load_chunk(disk, victim);
+  return victim->data;
+}
+
+static void lz_read(struct DiskBackend *backend, uint32_t secnum, uint32_t *buf, uint32_t count) {
+  struct LzDisk *disk = (struct LzDisk *)backend;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t s = secnum + i;
+    uint32_t chunk = s / disk->chunk_sectors;
+    if (chunk < disk->num_chunks) {
+      uint8_t *data = get_chunk(disk, chunk);
+      disk_bytes_to_words(data + (s % disk->chunk_sectors) * SECTOR_SIZE, &buf[i * 128], 128);
+    } else {
+      memset(&buf[i * 128], 0, SECTOR_SIZE);
+    }
+  }
+}
+
+static void lz_write(struct DiskBackend *backend, uint32_t secnum, const uint32_t *buf, uint32_t count) {
+  struct LzDisk *disk = (struct LzDisk *)backend;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t s = secnum + i;
+    uint32_t chunk = s / disk->chunk_sectors;
+    if (chunk >= disk->num_chunks) {
+      fprintf(stderr, "Compressed disk: write to sector %u beyond the end, ignored\n", s);
+      continue;
+    }
+    uint8_t *data = get_chunk(disk, chunk);
+    disk_words_to_bytes(&buf[i * 128], data + (s % disk->chunk_sectors) * SECTOR_SIZE, 128);
+    for (int j = 0; j < CACHE_CHUNKS; j++) {
+      if (disk->slots[j].data == data) {
+        disk->slots[j].dirty = true;
+      }
+    }
+    if (s >= disk->image_sectors) {
+      disk->image_sectors = s + 1;
+      disk->header_dirty = true;
+    }
+  }
+}
+
+static void lz_flush(struct DiskBackend *backend, bool durable) {
+  struct LzDisk *disk = (struct LzDisk *)backend;
+  for (int i = 0; i < CACHE_CHUNKS; i++) {
+    if (disk->slots[i].used && disk->slots[i].dirty) {
+      store_chunk(disk, &disk->slots[i]);
+    }
+  }
+  if (disk->header_dirty) {
+    uint8_t word[4];
+    put_u32(word, disk->image_sectors);
+    if (fseek(disk->file, 16, SEEK_SET) == 0 && fwrite(word, 4, 1, disk->file) == 1) {
+      disk->header_dirty = false;
+    }
+  }
+  fflush(disk->file);
+#ifdef HAVE_FSYNC
+  if (durable) {
+    fsync(fileno(disk->file));
+  }
+#endif
+}
+
+static void lz_close(struct DiskBackend *backend) {
+  struct LzDisk *disk = (struct LzDisk *)backend;
+  lz_flush(backend, true);
+  fclose(disk->file);
+  for (int i = 0; i < CACHE_CHUNKS; i++) {
+    free(disk->slots[i].data);
+  }
+  free(disk->index);
+  free(disk->free_space);
+  free(disk->cbuf);
+  free(disk);
+}
+
+static int compare_space(const void *a, const void *b) {
+  uint64_t x = ((const struct LzSpace *)a)->offset, y = ((const struct LzSpace *)b)->offset;
+  return (x > y) - (x < y);
+}
+
+// Everything between the chunks' spaces is free, including what an
+// earlier session freed or a crash left behind.
+static void find_free_space(struct LzDisk *disk) {
+  struct LzSpace *used = malloc(((size_t)disk->num_chunks + 1) * sizeof(*used));
+  if (used == NULL) {
+    return;
+  }
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < disk->num_chunks; i++) {
+    if (disk->index[i].space != 0) {
+      used[n++] = (struct LzSpace){ .offset = disk->index[i].offset, .space = disk->index[i].space };
+    }
+  }
+  qsort(used, n, sizeof(*used), compare_space);
+  uint64_t pos = HEADER_SIZE + (uint64_t)disk->num_chunks * INDEX_ENTRY;
+  for (uint32_t i = 0; i < n; i++) {
+    if (used[i].offset > pos && used[i].offset - pos <= UINT32_MAX) {
+      give_space(disk, pos, (uint32_t)(used[i].offset - pos));
+    }
+    if (used[i].offset + used[i].space > pos) {
+      pos = used[i].offset + used[i].space;
+    }
+  }
+  free(used);
+}
+
+static bool load_index(struct LzDisk *disk) {
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, HEADER_SIZE, 1, disk->file) != 1 || memcmp(header, DISK_LZ_MAGIC, 8) != 0) {
+    return false;
+  }
+  disk->chunk_sectors = get_u32(&header[8]);
+  disk->num_chunks = get_u32(&header[12]);
+  disk->image_sectors = get_u32(&header[16]);
+  if (disk->chunk_sectors == 0 || disk->chunk_sectors > 2048 || disk->num_chunks > (1u << 24)) {
+    return false;
+  }
+  disk->chunk_size = disk->chunk_sectors * SECTOR_SIZE;
+  disk->index = calloc(disk->num_chunks + 1, sizeof(*disk->index));
+  disk->cbuf = malloc(disk->chunk_size);
+  disk->end = HEADER_SIZE + (uint64_t)disk->num_chunks * INDEX_ENTRY;
+  uint8_t *raw = malloc((size_t)disk->num_chunks * INDEX_ENTRY + 1);
+  bool ok = disk->index && disk->cbuf && raw
+    && fread(raw, INDEX_ENTRY, disk->num_chunks, disk->file) == disk->num_chunks;
+  for (uint32_t i = 0; ok && i < disk->num_chunks; i++) {
+    uint8_t *e = &raw[i * INDEX_ENTRY];
+    disk->index[i] = (struct LzIndex){
+      .offset = get_u32(&e[0]) | (uint64_t)get_u32(&e[4]) << 32,
+      .length = get_u32(&e[8]),
+      .space = get_u32(&e[12])
+    };
+    if (disk->index[i].offset + disk->index[i].space > disk->end) {
+      disk->end = disk->index[i].offset + disk->index[i].space;
+    }
+  }
+  for (int i = 0; ok && i < CACHE_CHUNKS; i++) {
+    disk->slots[i].data = malloc(disk->chunk_size);
+    ok = disk->slots[i].data != NULL;
+  }
+  free(raw);
+  if (ok) {
+    find_free_space(disk);
+  }
+  return ok;
+}
+
+struct DiskBackend *disk_lz_open(const char *filename) {
+  struct LzDisk *disk = calloc(1, sizeof(*disk));
+  if (disk == NULL) {
+    return NULL;
+  }
+  disk->backend = (struct DiskBackend){
+    .read = lz_read,
+    .write = lz_write,
+    .flush = lz_flush,
+    .close = lz_close
+  };
+  disk->file = fopen(filename, "rb+");
+  if (disk->file == NULL || !load_index(disk)) {
+    fprintf(stderr, "Can't read compressed disk \"%s\"\n", filename);
+    if (disk->file) {
+      fclose(disk->file);
+    }
+    for (int i = 0; i < CACHE_CHUNKS; i++) {
+      free(disk->slots[i].data);
+    }
+    free(disk->index);
+    free(disk->cbuf);
+    free(disk);
+    return NULL;
+  }
+  return &disk->backend;
+}
+
+bool disk_lz_create(const char *filename, uint32_t image_sectors, uint32_t num_sectors) {
+  uint32_t num_chunks = (num_sectors + DISK_LZ_CHUNK_SECTORS - 1) / DISK_LZ_CHUNK_SECTORS;
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  uint8_t header[HEADER_SIZE] = { 0 };
+  memcpy(header, DISK_LZ_MAGIC, 8);
+  put_u32(&header[8], DISK_LZ_CHUNK_SECTORS);
+  put_u32(&header[12], num_chunks);
+  put_u32(&header[16], image_sectors);
+  bool ok = fwrite(header, HEADER_SIZE, 1, f) == 1;
+  uint8_t entry[INDEX_ENTRY] = { 0 };
+  for (uint32_t i = 0; ok && i < num_chunks; i++) {
+    ok = fwrite(entry, INDEX_ENTRY, 1, f) == 1;
+  }
+  return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,280 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_FSYNC
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk-backend.h"
+
+#ifdef HAVE_FSYNC
+#include <unistd.h>
+#endif
+
+#define SECTOR_SIZE 512
+#define HEADER_SIZE 56
+
+struct Overlay {
+  struct DiskBackend backend;
+  FILE *file;
+  FILE *base;  // read only
+  uint32_t sectors;
+  uint32_t stored;
+  uint32_t *table;
+  long table_offset;
+  long data_offset;
+  uint64_t base_size;  // identity of the base image it was made for
+  uint64_t base_hash;
+  bool committing;     // dskoverlay commit was interrupted
+  uint64_t new_size;   // identity of the base after that commit
+  uint64_t new_hash;
+};
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  put_u32(p, (uint32_t)v);
+  put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static long round_up(long n) {
+  return (n + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+bool disk_overlay_probe(const char *filename) {
+  char magic[8];
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  bool found = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, DISK_OVERLAY_MAGIC, 8) == 0;
+  fclose(f);
+  return found;
+}
+
+static void read_at(FILE *f, long offset, uint8_t bytes[static SECTOR_SIZE]) {
+  memset(bytes, 0, SECTOR_SIZE);
+  if (f && fseek(f, offset, SEEK_SET) == 0) {
+    fread(bytes, SECTOR_SIZE, 1, f);
+  }
+}
+
+static void overlay_read(struct DiskBackend *backend, uint32_t secnum, uint32_t *buf, uint32_t count) {
+  struct Overlay *ovl = (struct Overlay *)backend;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t s = secnum + i;
+    uint8_t bytes[SECTOR_SIZE];
+    if (s < ovl->sectors && ovl->table[s] != 0) {
+      read_at(ovl->file, ovl->data_offset + (long)(ovl->table[s] - 1) * SECTOR_SIZE, bytes);
+    } else {
+      read_at(ovl->base, (long)s * SECTOR_SIZE, bytes);
+    }
+    disk_bytes_to_words(bytes, &buf[i * 128], 128);
+  }
+}
+
+static void overlay_write(struct DiskBackend *backend, uint32_t secnum, const uint32_t *buf, uint32_t count) {
+  struct Overlay *ovl = (struct Overlay *)backend;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t s = secnum + i;
+    if (s >= ovl->sectors) {
+      fprintf(stderr, "Overlay write to sector %u beyond the %u it covers, ignored\n", s, ovl->sectors);
+      continue;
+    }
+    uint8_t bytes[SECTOR_SIZE];
+    disk_words_to_bytes(&buf[i * 128], bytes, 128);
+    bool fresh = ovl->table[s] == 0;
+    uint32_t slot = fresh ? ovl->stored : ovl->table[s] - 1;
+    if (fseek(ovl->file, ovl->data_offset + (long)slot * SECTOR_SIZE, SEEK_SET) != 0 ||
+        fwrite(bytes, SECTOR_SIZE, 1, ovl->file) != 1) {
+      continue;
+    }
+    if (fresh) {
+      // Data first, then the table entry and count that refer to it;
+      // flush so that stdio can't reorder them
+      uint8_t word[4];
+      fflush(ovl->file);
+      ovl->table[s] = ++ovl->stored;
+      put_u32(word, ovl->table[s]);
+      fseek(ovl->file, ovl->table_offset + (long)s * 4, SEEK_SET);
+      fwrite(word, 4, 1, ovl->file);
+      put_u32(word, ovl->stored);
+      fseek(ovl->file, 12, SEEK_SET);
+      fwrite(word, 4, 1, ovl->file);
+    }
+  }
+}
+
+static void overlay_flush(struct DiskBackend *backend, bool durable) {
+  struct Overlay *ovl = (struct Overlay *)backend;
+  fflush(ovl->file);
+#ifdef HAVE_FSYNC
+  if (durable) {
+    fsync(fileno(ovl->file));
+  }
+#endif
+}
+
+static void overlay_close(struct DiskBackend *backend) {
+  struct Overlay *ovl = (struct Overlay *)backend;
+  overlay_flush(backend, true);
+  fclose(ovl->file);
+  if (ovl->base) {
+    fclose(ovl->base);
+  }
+  free(ovl->table);
+  free(ovl);
+}
+
+static FILE *open_base(const char *overlay_name, const char *base_name) {
+  if (base_name[0] == '/') {
+    return fopen(base_name, "rb");
+  }
+  const char *slash = strrchr(overlay_name, '/');
+  size_t dir_len = slash ? (size_t)(slash - overlay_name + 1) : 0;
+  char *path = malloc(dir_len + strlen(base_name) + 1);
+  if (path == NULL) {
+    return NULL;
+  }
+  memcpy(path, overlay_name, dir_len);
+  strcpy(path + dir_len, base_name);
+  FILE *f = fopen(path, "rb");
+  free(path);
+  return f;
+}
+
+// FNV-1a over the whole base image; sets *size.
+static uint64_t hash_base(FILE *f, uint64_t *size) {
+  uint64_t hash = 0xcbf29ce484222325u;
+  uint8_t buf[65536];
+  size_t n;
+  *size = 0;
+  rewind(f);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      hash = (hash ^ buf[i]) * 0x100000001b3u;
+    }
+    *size += n;
+  }
+  return hash;
+}
+
+// Reads header and table; returns the base image name or NULL.
+static char *load(struct Overlay *ovl) {
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, HEADER_SIZE, 1, ovl->file) != 1 || memcmp(header, DISK_OVERLAY_MAGIC, 8) != 0) {
+    return NULL;
+  }
+  ovl->sectors = get_u32(&header[8]);
+  ovl->stored = get_u32(&header[12]);
+  uint32_t name_len = get_u32(&header[16]);
+  ovl->base_size = get_u64(&header[20]);
+  ovl->base_hash = get_u64(&header[28]);
+  ovl->committing = get_u32(&header[36]) != 0;
+  ovl->new_size = get_u64(&header[40]);
+  ovl->new_hash = get_u64(&header[48]);
+  if (name_len == 0 || name_len > 4096 || ovl->sectors > (1u << 28)) {
+    return NULL;
+  }
+  ovl->table_offset = round_up(HEADER_SIZE + (long)name_len);
+  ovl->data_offset = round_up(ovl->table_offset + (long)ovl->sectors * 4);
+
+  char *base_name = calloc(1, name_len + 1);
+  uint8_t *raw = malloc((size_t)ovl->sectors * 4 + 4);
+  ovl->table = malloc((size_t)ovl->sectors * 4 + 4);
+  bool ok = base_name && raw && ovl->table
+    && fread(base_name, name_len, 1, ovl->file) == 1
+    && fseek(ovl->file, ovl->table_offset, SEEK_SET) == 0
+    && fread(raw, 4, ovl->sectors, ovl->file) == ovl->sectors;
+  if (ok) {
+    for (uint32_t i = 0; i < ovl->sectors; i++) {
+      ovl->table[i] = get_u32(&raw[i * 4]);
+      if (ovl->table[i] > ovl->stored) {
+        ovl->table[i] = 0;  // write interrupted before the count was updated
+      }
+    }
+  } else {
+    free(base_name);
+    base_name = NULL;
+  }
+  free(raw);
+  return base_name;
+}
+
+struct DiskBackend *disk_overlay_open(const char *filename) {
+  struct Overlay *ovl = calloc(1, sizeof(*ovl));
+  if (ovl == NULL) {
+    return NULL;
+  }
+  ovl->backend = (struct DiskBackend){
+    .read = overlay_read,
+    .write = overlay_write,
+    .flush = overlay_flush,
+    .close = overlay_close
+  };
+  ovl->file = fopen(filename, "rb+");
+  char *base_name = ovl->file ? load(ovl) : NULL;
+  if (base_name == NULL) {
+    fprintf(stderr, "Can't read overlay \"%s\"\n", filename);
+    if (ovl->file) {
+      fclose(ovl->file);
+    }
+    free(ovl->table);
+    free(ovl);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ovl->base = open_base(filename, base_name);
+  if (ovl->base == NULL) {
+    fprintf(stderr, "Can't open base image \"%s\" of overlay \"%s\": %s\n",
+            base_name, filename, strerror(errno));
+    exit(1);
+  }
+  // Sectors of a different or modified base would silently mix in.
+  // After an interrupted commit the base is either untouched, fully
+  // updated (its sectors then equal the overlay's, which can stay), or
+  // in between, which only finishing the commit sorts out
+  uint64_t size, hash = hash_base(ovl->base, &size);
+  bool is_old = size == ovl->base_size && hash == ovl->base_hash;
+  bool is_new = ovl->committing && size == ovl->new_size && hash == ovl->new_hash;
+  if (!is_old && !is_new) {
+    if (ovl->committing) {
+      fprintf(stderr, "Commit of overlay \"%s\" into \"%s\" was interrupted, run dskoverlay commit again\n",
+              filename, base_name);
+    } else {
+      fprintf(stderr, "Base image \"%s\" has changed since overlay \"%s\" was made from it\n",
+              base_name, filename);
+    }
+    exit(1);
+  }
+  if (ovl->committing) {
+    // Writes to the overlay would make the recorded commit stale
+    uint8_t record[36] = { 0 };
+    ovl->base_size = size;
+    ovl->base_hash = hash;
+    ovl->committing = false;
+    put_u64(&record[0], size);
+    put_u64(&record[8], hash);
+    fseek(ovl->file, 20, SEEK_SET);
+    fwrite(record, sizeof(record), 1, ovl->file);
+    overlay_flush(&ovl->backend, true);
+  }
+  free(base_name);
+  return &ovl->backend;
+}
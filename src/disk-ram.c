@@ -0,0 +1,174 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_MKSTEMP
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk-backend.h"
+
+#ifdef HAVE_MKSTEMP
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SECTOR_SIZE 512
+#define MAX_IMAGE_SIZE ((uint64_t)1 << 32)
+
+struct RamDisk {
+  struct DiskBackend backend;
+  char *filename;
+  bool save;
+  bool dirty;
+  uint8_t *data;
+  uint64_t size;
+
+  struct DiskAtExit at_exit;
+};
+
+static void ram_read(struct DiskBackend *backend, uint32_t secnum, uint32_t *buf, uint32_t count) {
+  struct RamDisk *disk = (struct RamDisk *)backend;
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t offset = ((uint64_t)secnum + i) * SECTOR_SIZE;
+    if (offset + SECTOR_SIZE <= disk->size) {
+      disk_bytes_to_words(disk->data + offset, &buf[i * 128], 128);
+    } else {
+      uint8_t bytes[SECTOR_SIZE] = { 0 };
+      if (offset < disk->size) {
+        memcpy(bytes, disk->data + offset, disk->size - offset);
+      }
+      disk_bytes_to_words(bytes, &buf[i * 128], 128);
+    }
+  }
+}
+
+static void ram_write(struct DiskBackend *backend, uint32_t secnum, const uint32_t *buf, uint32_t count) {
+  struct RamDisk *disk = (struct RamDisk *)backend;
+  uint64_t start = (uint64_t)secnum * SECTOR_SIZE;
+  uint64_t end = start + (uint64_t)count * SECTOR_SIZE;
+  if (end > disk->size) {
+    uint8_t *data = end <= MAX_IMAGE_SIZE ? realloc(disk->data, end) : NULL;
+    if (data == NULL) {
+      fprintf(stderr, "Can't grow RAM disk to %llu bytes\n", (unsigned long long)end);
+      return;
+    }
+    memset(data + disk->size, 0, end - disk->size);
+    disk->data = data;
+    disk->size = end;
+  }
+  disk_words_to_bytes(buf, disk->data + start, count * 128);
+  disk->dirty = true;
+}
+
+static void ram_flush(struct DiskBackend *backend, bool durable) {
+}
+
+// Write the image next to the original and rename it into place.
+static bool save_image(struct RamDisk *disk) {
+  size_t len = strlen(disk->filename);
+  char *tmp = malloc(len + 8);
+  if (tmp == NULL) {
+    return false;
+  }
+  FILE *f;
+#ifdef HAVE_MKSTEMP
+  sprintf(tmp, "%s.XXXXXX", disk->filename);
+  int fd = mkstemp(tmp);
+  struct stat st;
+  if (fd >= 0 && stat(disk->filename, &st) == 0) {
+    fchmod(fd, st.st_mode & 07777);
+  }
+  f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+#else
+  sprintf(tmp, "%s.tmp", disk->filename);
+  f = fopen(tmp, "wb");
+#endif
+  bool ok = f != NULL && fwrite(disk->data, 1, disk->size, f) == disk->size;
+  if (f) {
+    ok = fflush(f) == 0 && ok;
+#ifdef HAVE_MKSTEMP
+    ok = fsync(fileno(f)) == 0 && ok;
+#endif
+    ok = fclose(f) == 0 && ok;
+  }
+#ifndef HAVE_MKSTEMP
+  // rename() doesn't replace existing files here
+  ok = ok && (remove(disk->filename) == 0 || errno == ENOENT);
+#endif
+  ok = ok && rename(tmp, disk->filename) == 0;
+  if (!ok) {
+    fprintf(stderr, "Can't save RAM disk to \"%s\": %s\n", disk->filename, strerror(errno));
+    remove(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+// Saves the changes, if any and if wanted; again only after new writes.
+static void save_changes(struct RamDisk *disk) {
+  if (disk->save && disk->dirty && save_image(disk)) {
+    disk->dirty = false;
+  }
+}
+
+static void ram_finish(struct DiskBackend *backend) {
+  save_changes((struct RamDisk *)backend);
+}
+
+static void ram_close(struct DiskBackend *backend) {
+  struct RamDisk *disk = (struct RamDisk *)backend;
+  disk_forget_at_exit(&disk->at_exit);
+  save_changes(disk);
+  free(disk->filename);
+  free(disk->data);
+  free(disk);
+}
+
+struct DiskBackend *disk_ram_open(const char *filename, bool save) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  struct RamDisk *disk = calloc(1, sizeof(*disk));
+  size_t capacity = 1 << 20;
+  uint8_t *data = malloc(capacity);
+  size_t size = 0, n;
+  while (data != NULL && (n = fread(data + size, 1, capacity - size, f)) > 0) {
+    size += n;
+    if (size == capacity) {
+      capacity *= 2;
+      uint8_t *bigger = realloc(data, capacity);
+      if (bigger == NULL) {
+        free(data);
+      }
+      data = bigger;
+    }
+  }
+  bool ok = data != NULL && !ferror(f);
+  fclose(f);
+  if (disk == NULL || !ok) {
+    if (disk == NULL || data == NULL) {
+      errno = ENOMEM;
+    }
+    free(disk);
+    free(data);
+    return NULL;
+  }
+  disk->backend = (struct DiskBackend){
+    .read = ram_read,
+    .write = ram_write,
+    .flush = ram_flush,
+    .close = ram_close
+  };
+  disk->filename = malloc(strlen(filename) + 1);
+  if (disk->filename) {
+    strcpy(disk->filename, filename);
+  }
+  disk->save = save && disk->filename != NULL;
+  disk->data = data;
+  disk->size = size;
+  disk_finish_at_exit(&disk->at_exit, &disk->backend, ram_finish);
+  return &disk->backend;
+}
@@ -0,0 +1,211 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_CLOCK_GETTIME
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "disk-trace.h"
+
+#define MAX_HEAT (1u << 23)  // sectors, a 4 GB image
+#define HOTTEST 10
+#define HEATMAP_ROWS 32
+#define HEATMAP_WIDTH 50
+
+static const char *op_names[] = { "read", "write" };
+static const char *source_names[] = { "spi", "block" };
+
+struct OpStats {
+  uint64_t transfers;
+  uint64_t sectors;
+  uint64_t sequential;  // transfers starting where the previous one ended
+  uint64_t latency_ns;
+  uint64_t max_latency_ns;
+  uint32_t next;        // sector after the previous transfer
+};
+
+struct DiskTrace {
+  FILE *file;
+  bool csv;
+  uint64_t (*clock)(void *ctx);
+  void *ctx;
+
+  struct OpStats ops[2];
+  uint32_t *heat;  // transfers per sector
+  uint32_t heat_size;
+  uint32_t max_sector;
+  uint64_t outside;  // transfers beyond MAX_HEAT
+};
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+  for (int i = 0; i < n; i++) {
+    p[i] = (uint8_t)(v >> (8 * i));
+  }
+}
+
+struct DiskTrace *disk_trace_open(const char *filename, uint64_t (*clock)(void *ctx), void *ctx) {
+  struct DiskTrace *trace = calloc(1, sizeof(*trace));
+  if (trace == NULL) {
+    return NULL;
+  }
+  trace->clock = clock;
+  trace->ctx = ctx;
+  if (filename) {
+    size_t len = strlen(filename);
+    trace->csv = len >= 4 && strcmp(filename + len - 4, ".csv") == 0;
+    trace->file = fopen(filename, trace->csv ? "w" : "wb");
+    if (trace->file == NULL) {
+      free(trace);
+      return NULL;
+    }
+    if (trace->csv) {
+      fputs("insts,op,source,sector,count,latency_ns\n", trace->file);
+    } else {
+      fwrite("RISCDTR1", 8, 1, trace->file);
+    }
+  }
+  return trace;
+}
+
+void disk_trace_close(struct DiskTrace *trace) {
+  if (trace->file) {
+    fclose(trace->file);
+  }
+  free(trace->heat);
+  free(trace);
+}
+
+uint64_t disk_trace_now(void) {
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+  return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
+
+static void heat_up(struct DiskTrace *trace, uint32_t sector, uint32_t count) {
+  if (sector >= MAX_HEAT || count > MAX_HEAT - sector) {
+    trace->outside++;
+    return;
+  }
+  uint32_t end = sector + count;
+  if (end > trace->heat_size) {
+    uint32_t size = trace->heat_size ? trace->heat_size : 4096;
+    while (size < end) {
+      size *= 2;
+    }
+    uint32_t *heat = realloc(trace->heat, size * sizeof(*heat));
+    if (heat == NULL) {
+      trace->outside++;
+      return;
+    }
+    memset(heat + trace->heat_size, 0, (size - trace->heat_size) * sizeof(*heat));
+    trace->heat = heat;
+    trace->heat_size = size;
+  }
+  for (uint32_t s = sector; s < end; s++) {
+    trace->heat[s]++;
+  }
+  if (end - 1 > trace->max_sector) {
+    trace->max_sector = end - 1;
+  }
+}
+
+void disk_trace_log(struct DiskTrace *trace, enum DiskTraceOp op, enum DiskTraceSource source,
+                    uint32_t sector, uint32_t count, uint64_t latency_ns) {
+  uint64_t insts = trace->clock ? trace->clock(trace->ctx) : 0;
+  struct OpStats *stats = &trace->ops[op];
+  if (stats->transfers > 0 && sector == stats->next) {
+    stats->sequential++;
+  }
+  stats->transfers++;
+  stats->sectors += count;
+  stats->latency_ns += latency_ns;
+  if (latency_ns > stats->max_latency_ns) {
+    stats->max_latency_ns = latency_ns;
+  }
+  stats->next = sector + count;
+  heat_up(trace, sector, count);
+
+  if (trace->file && trace->csv) {
+    fprintf(trace->file, "%" PRIu64 ",%s,%s,%" PRIu32 ",%" PRIu32 ",%" PRIu64 "\n",
+            insts, op_names[op], source_names[source], sector, count, latency_ns);
+  } else if (trace->file) {
+    uint8_t rec[24];
+    put_le(&rec[0], insts, 8);
+    put_le(&rec[8], latency_ns, 8);
+    put_le(&rec[16], sector, 4);
+    put_le(&rec[20], count, 2);
+    rec[22] = (uint8_t)op;
+    rec[23] = (uint8_t)source;
+    fwrite(rec, sizeof(rec), 1, trace->file);
+  }
+}
+
+void disk_trace_report(struct DiskTrace *trace, FILE *f) {
+  fprintf(f, "Disk trace:\n");
+  for (int op = 0; op < 2; op++) {
+    struct OpStats *stats = &trace->ops[op];
+    if (stats->transfers == 0) {
+      fprintf(f, "  %-5s  none\n", op_names[op]);
+      continue;
+    }
+    fprintf(f, "  %-5s  %" PRIu64 " transfers, %" PRIu64 " bytes, %.1f%% sequential, "
+            "latency avg %.1f us max %.1f us\n",
+            op_names[op], stats->transfers, stats->sectors * 512,
+            100.0 * (double)stats->sequential / (double)stats->transfers,
+            (double)stats->latency_ns / (double)stats->transfers / 1000.0,
+            (double)stats->max_latency_ns / 1000.0);
+  }
+  if (trace->outside) {
+    fprintf(f, "  %" PRIu64 " transfers outside the heatmap\n", trace->outside);
+  }
+  if (trace->heat == NULL) {
+    return;
+  }
+
+  uint32_t hottest[HOTTEST];
+  int num_hottest = 0;
+  for (uint32_t s = 0; s <= trace->max_sector; s++) {
+    if (trace->heat[s] == 0) {
+      continue;
+    }
+    int i = num_hottest < HOTTEST ? num_hottest++ : HOTTEST;
+    while (i > 0 && trace->heat[hottest[i - 1]] < trace->heat[s]) {
+      if (i < HOTTEST) {
+        hottest[i] = hottest[i - 1];
+      }
+      i--;
+    }
+    if (i < HOTTEST) {
+      hottest[i] = s;
+    }
+  }
+  fprintf(f, "  Hottest sectors:");
+  for (int i = 0; i < num_hottest; i++) {
+    fprintf(f, " %" PRIu32 " (%" PRIu32 ")", hottest[i], trace->heat[hottest[i]]);
+  }
+  fprintf(f, "\n");
+
+  // Transfers per sector range, scaled to the busiest range
+  uint64_t rows[HEATMAP_ROWS] = { 0 };
+  uint32_t per_row = trace->max_sector / HEATMAP_ROWS + 1;
+  uint64_t busiest = 1;
+  for (uint32_t s = 0; s <= trace->max_sector; s++) {
+    rows[s / per_row] += trace->heat[s];
+  }
+  for (int i = 0; i < HEATMAP_ROWS; i++) {
+    if (rows[i] > busiest) {
+      busiest = rows[i];
+    }
+  }
+  for (int i = 0; i < HEATMAP_ROWS && (uint32_t)i * per_row <= trace->max_sector; i++) {
+    int bar = (int)((rows[i] * HEATMAP_WIDTH + busiest - 1) / busiest);
+    fprintf(f, "  %10" PRIu32 " %10" PRIu64 " %.*s\n", (uint32_t)i * per_row, rows[i],
+            bar, "##################################################");
+  }
+}
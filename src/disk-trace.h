@@ -0,0 +1,45 @@
+#ifndef DISK_TRACE_H
+#define DISK_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Log of every sector transfer between the guest and the disk image,
+// for finding out where boot and module loading spend their time.
+//
+// Each transfer is stamped with the number of instructions the guest
+// has retired and the host time the backend took.  A file name ending
+// in ".csv" gets one line per transfer
+//   insts,op,source,sector,count,latency_ns
+// any other name the same fields as little endian binary records of
+// 24 bytes
+//   u64 insts, u64 latency_ns, u32 sector, u16 count, u8 op, u8 source
+// after an 8 byte "RISCDTR1" header.  Without a file only the summary
+// is collected.
+struct DiskTrace;
+
+enum DiskTraceOp {
+  DISK_TRACE_READ,
+  DISK_TRACE_WRITE,
+};
+
+enum DiskTraceSource {
+  DISK_TRACE_SPI,    // SD card commands
+  DISK_TRACE_BLOCK,  // paravirtual block device
+};
+
+// The clock returns the instruction count for ctx.
+struct DiskTrace *disk_trace_open(const char *filename, uint64_t (*clock)(void *ctx), void *ctx);
+void disk_trace_close(struct DiskTrace *trace);
+
+// Host time in nanoseconds, for measuring latencies.
+uint64_t disk_trace_now(void);
+void disk_trace_log(struct DiskTrace *trace, enum DiskTraceOp op, enum DiskTraceSource source,
+                    uint32_t sector, uint32_t count, uint64_t latency_ns);
+
+// Totals, sequential/random ratio, the hottest sectors and a coarse
+// heatmap over the image.
+void disk_trace_report(struct DiskTrace *trace, FILE *f);
+
+#endif  // DISK_TRACE_H
@@ -4,63 +4,142 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
 #include "disk.h"
+#include "disk-backend.h"
+#include "disk-trace.h"
 
 enum DiskState {
   diskCommand,
   diskRead,
+  diskReadMulti,
   diskWrite,
+  diskWriteMulti,
   diskWriting,
 };
 
 struct Disk {
   struct RISC_SPI spi;
+  struct RISC_Block block;
 
   enum DiskState state;
-  FILE *file;
+  struct DiskBackend *backend;  // NULL for diskless boot
+  struct DiskTrace *trace;
   uint32_t offset;
+  uint32_t read_secnum;   // next block of a multi-block read
+  uint32_t write_secnum;
+  bool write_multi;
 
   uint32_t rx_buf[128];
   int rx_idx;
 
-  uint32_t tx_buf[128+2];
+  uint32_t tx_buf[128+4];
   int tx_cnt;
   int tx_idx;
+
+  // The command came from the stock Oberon driver, whose data phase
+  // can be streamed (see disk_run_command)
+  bool stream;
 };
 
 
 static uint32_t disk_read(const struct RISC_SPI *spi);
 static void disk_write(const struct RISC_SPI *spi, uint32_t value);
 static void disk_run_command(struct Disk *disk);
-static void seek_sector(FILE *f, uint32_t secnum);
-static void read_sector(FILE *f, uint32_t buf[static 128]);
-static void write_sector(FILE *f, uint32_t buf[static 128]);
+static uint32_t stream_read(const struct RISC_SPI *spi);
+static void stream_read_next(const struct RISC_SPI *spi, uint32_t value);
+static void stream_write(const struct RISC_SPI *spi, uint32_t value);
+static bool disk_read_blocks(const struct RISC_Block *block, uint32_t num, uint32_t *buf, uint32_t count);
+static bool disk_write_blocks(const struct RISC_Block *block, uint32_t num, const uint32_t *buf, uint32_t count);
+static void read_sector(struct Disk *disk, uint32_t secnum, uint32_t buf[static 128]);
+static void write_sector(struct Disk *disk, uint32_t secnum, const uint32_t buf[static 128]);
 
 
-struct RISC_SPI *disk_new(const char *filename) {
+struct RISC_SPI *disk_new(const char *filename, const struct DiskOptions *options) {
+  struct DiskOptions defaults = { 0 };
+  if (options == NULL) {
+    options = &defaults;
+  }
   struct Disk *disk = calloc(1, sizeof(*disk));
   disk->spi = (struct RISC_SPI) {
     .read_data = disk_read,
     .write_data = disk_write
   };
+  disk->block = (struct RISC_Block) {
+    .read = disk_read_blocks,
+    .write = disk_write_blocks
+  };
 
   disk->state = diskCommand;
 
   if (filename) {
-    disk->file = fopen(filename, "rb+");
-    if (disk->file == 0) {
+    bool overlay = disk_overlay_probe(filename);
+    bool compressed = !overlay && disk_lz_probe(filename);
+    if ((overlay || compressed) && options->ramdisk != DISK_RAMDISK_OFF) {
+      fprintf(stderr, "%s images can't be used as a RAM disk.\n",
+              overlay ? "Overlay" : "Compressed");
+      exit(1);
+    }
+    if (overlay || compressed) {
+      disk->backend = overlay ? disk_overlay_open(filename) : disk_lz_open(filename);
+      if (disk->backend == NULL) {
+        exit(1);
+      }
+    } else if (options->ramdisk != DISK_RAMDISK_OFF) {
+      disk->backend = disk_ram_open(filename, options->ramdisk == DISK_RAMDISK_SAVE);
+      if (disk->backend == NULL) {
+        fprintf(stderr, "Can't load \"%s\" into memory: %s\n", filename, strerror(errno));
+        exit(1);
+      }
+    } else if (options->backend != DISK_BACKEND_STDIO) {
+      disk->backend = disk_mmap_open(filename, options->msync);
+      if (disk->backend == NULL && options->backend == DISK_BACKEND_MMAP) {
+        fprintf(stderr, "Can't map file \"%s\": %s\n", filename, strerror(errno));
+        exit(1);
+      }
+    }
+    if (disk->backend == NULL) {
+      disk->backend = disk_stdio_open(filename);
+    }
+    if (disk->backend == NULL) {
       fprintf(stderr, "Can't open file \"%s\": %s\n", filename, strerror(errno));
       exit(1);
     }
+    if ((options->cache != DISK_CACHE_WRITETHROUGH || options->fsync)
+        && options->ramdisk == DISK_RAMDISK_OFF) {
+      struct DiskBackend *cache = disk_cache_open(disk->backend, options->cache,
+                                                  options->cache_interval_ms, options->fsync);
+      if (cache) {
+        disk->backend = cache;
+      }
+    }
 
     // Check for filesystem-only image, starting directly at sector 1 (DiskAdr 29)
-    read_sector(disk->file, &disk->tx_buf[0]);
+    read_sector(disk, 0, &disk->tx_buf[0]);
     disk->offset = (disk->tx_buf[0] == 0x9B1EA38D) ? 0x80002 : 0;
   }
 
   return &disk->spi;
 }
 
+const struct RISC_Block *disk_block(struct RISC_SPI *spi) {
+  struct Disk *disk = (struct Disk *)spi;
+  return &disk->block;
+}
+
+void disk_set_trace(struct RISC_SPI *spi, struct DiskTrace *trace) {
+  struct Disk *disk = (struct Disk *)spi;
+  disk->trace = trace;
+}
+
+void disk_free(struct RISC_SPI *spi) {
+  struct Disk *disk = (struct Disk *)spi;
+  if (disk->backend) {
+    disk->backend->close(disk->backend);
+  }
+  free(disk);
+}
+
 static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
   struct Disk *disk = (struct Disk *)spi;
   disk->tx_idx++;
@@ -77,16 +156,58 @@ static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
       break;
     }
     case diskRead: {
-      if (disk->tx_idx == disk->tx_cnt) {
+      if (disk->stream && disk->tx_idx == 1) {
+        // Start marker reached, hand out the sector directly
+        disk->spi.read_data = stream_read;
+        disk->spi.write_data = stream_read_next;
+      } else if (disk->tx_idx == disk->tx_cnt) {
         disk->state = diskCommand;
         disk->tx_cnt = 0;
         disk->tx_idx = 0;
       }
       break;
     }
+    case diskReadMulti: {
+      if (disk->tx_idx < disk->tx_cnt) {
+        break;
+      }
+      // Between blocks.  The first FF poll reads as busy, the second
+      // one gets the start marker of the next block.  Anything else
+      // begins a command, normally STOP_TRANSMISSION.
+      if ((uint8_t)value != 0xFF) {
+        disk->state = diskCommand;
+        disk->tx_cnt = 0;
+        disk->tx_idx = 0;
+        disk->rx_buf[0] = value;
+        disk->rx_idx = 1;
+      } else if (disk->tx_idx > disk->tx_cnt) {
+        disk->tx_buf[0] = 254;
+        read_sector(disk, disk->read_secnum++, &disk->tx_buf[1]);
+        disk->tx_buf[129] = 255;
+        disk->tx_buf[130] = 255;
+        disk->tx_cnt = 1 + 128 + 2;
+        disk->tx_idx = 0;
+      }
+      break;
+    }
     case diskWrite: {
       if (value == 254) {
         disk->state = diskWriting;
+        disk->write_multi = false;
+        if (disk->stream) {
+          disk->spi.write_data = stream_write;
+        }
+      }
+      break;
+    }
+    case diskWriteMulti: {
+      if (value == 252) {
+        // Start token of the next block
+        disk->state = diskWriting;
+        disk->write_multi = true;
+      } else if (value == 253) {
+        // Stop token
+        disk->state = diskCommand;
       }
       break;
     }
@@ -96,14 +217,14 @@ static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
       }
       disk->rx_idx++;
       if (disk->rx_idx == 128) {
-        write_sector(disk->file, &disk->rx_buf[0]);
+        write_sector(disk, disk->write_secnum++, &disk->rx_buf[0]);
       }
       if (disk->rx_idx == 130) {
         disk->tx_buf[0] = 5;
         disk->tx_cnt = 1;
         disk->tx_idx = -1;
         disk->rx_idx = 0;
-        disk->state = diskCommand;
+        disk->state = disk->write_multi ? diskWriteMulti : diskCommand;
       }
       break;
     }
@@ -121,30 +242,87 @@ static uint32_t disk_read(const struct RISC_SPI *spi) {
   return result;
 }
 
+// Fast path for the data phase of single block transfers.  The stock
+// Oberon driver sends CMD17/CMD24 with a dummy CRC of FF, waits for the
+// start marker and then moves the 128 words of the sector without ever
+// looking at anything else, so for those commands the generic state
+// machine is swapped out for these handlers until the sector is done.
+// The guest sees exactly the same bytes; it just costs less host time.
+
+static uint32_t stream_read(const struct RISC_SPI *spi) {
+  struct Disk *disk = (struct Disk *)spi;
+  return disk->tx_buf[disk->tx_idx];
+}
+
+static void stream_read_next(const struct RISC_SPI *spi, uint32_t value) {
+  struct Disk *disk = (struct Disk *)spi;
+  if (++disk->tx_idx == disk->tx_cnt) {
+    disk->spi.read_data = disk_read;
+    disk->spi.write_data = disk_write;
+    disk->state = diskCommand;
+    disk->tx_cnt = 0;
+    disk->tx_idx = 0;
+  }
+}
+
+static void stream_write(const struct RISC_SPI *spi, uint32_t value) {
+  struct Disk *disk = (struct Disk *)spi;
+  disk->tx_idx++;
+  disk->rx_buf[disk->rx_idx++] = value;
+  if (disk->rx_idx == 128) {
+    write_sector(disk, disk->write_secnum, &disk->rx_buf[0]);
+    // The CRC and the data response go through disk_write again
+    disk->spi.write_data = disk_write;
+  }
+}
+
 static void disk_run_command(struct Disk *disk) {
   uint32_t cmd = disk->rx_buf[0];
   uint32_t arg = (disk->rx_buf[1] << 24)
     | (disk->rx_buf[2] << 16)
     | (disk->rx_buf[3] << 8)
     | disk->rx_buf[4];
+  disk->stream = disk->rx_buf[5] == 0xFF;
 
   switch (cmd) {
     case 81: {
       disk->state = diskRead;
       disk->tx_buf[0] = 0;
       disk->tx_buf[1] = 254;
-      seek_sector(disk->file, arg - disk->offset);
-      read_sector(disk->file, &disk->tx_buf[2]);
+      read_sector(disk, arg - disk->offset, &disk->tx_buf[2]);
       disk->tx_cnt = 2 + 128;
       break;
     }
+    case 82: {
+      // CMD18, READ_MULTIPLE_BLOCK: blocks follow each other, each
+      // with its start marker and CRC, until STOP_TRANSMISSION
+      disk->state = diskReadMulti;
+      disk->tx_buf[0] = 0;
+      disk->tx_buf[1] = 254;
+      read_sector(disk, arg - disk->offset, &disk->tx_buf[2]);
+      disk->tx_buf[130] = 255;
+      disk->tx_buf[131] = 255;
+      disk->tx_cnt = 2 + 128 + 2;
+      disk->read_secnum = arg - disk->offset + 1;
+      break;
+    }
+    case 89: {
+      // CMD25, WRITE_MULTIPLE_BLOCK: blocks start with token FC, the
+      // stop token FD ends the transfer
+      disk->state = diskWriteMulti;
+      disk->write_secnum = arg - disk->offset;
+      disk->tx_buf[0] = 0;
+      disk->tx_cnt = 1;
+      break;
+    }
     case 88: {
       disk->state = diskWrite;
-      seek_sector(disk->file, arg - disk->offset);
+      disk->write_secnum = arg - disk->offset;
       disk->tx_buf[0] = 0;
       disk->tx_cnt = 1;
       break;
     }
+    case 76:  // CMD12, STOP_TRANSMISSION: the transfer ended when the command began
     default: {
       disk->tx_buf[0] = 0;
       disk->tx_cnt = 1;
@@ -154,34 +332,53 @@ static void disk_run_command(struct Disk *disk) {
   disk->tx_idx = -1;
 }
 
-static void seek_sector(FILE *f, uint32_t secnum) {
-  if (f) {
-    fseek(f, secnum * 512, SEEK_SET);
+static struct Disk *block_disk(const struct RISC_Block *block) {
+  return (struct Disk *)((char *)block - offsetof(struct Disk, block));
+}
+
+static void read_sectors(struct Disk *disk, enum DiskTraceSource source,
+                         uint32_t secnum, uint32_t *buf, uint32_t count) {
+  uint64_t start = disk->trace ? disk_trace_now() : 0;
+  if (disk->backend) {
+    disk->backend->read(disk->backend, secnum, buf, count);
+  } else {
+    memset(buf, 0, count * 512);
+  }
+  if (disk->trace) {
+    disk_trace_log(disk->trace, DISK_TRACE_READ, source, secnum, count, disk_trace_now() - start);
   }
 }
 
-static void read_sector(FILE *f, uint32_t buf[static 128]) {
-  uint8_t bytes[512] = { 0 };
-  if (f) {
-    fread(bytes, 512, 1, f);
+static void write_sectors(struct Disk *disk, enum DiskTraceSource source,
+                          uint32_t secnum, const uint32_t *buf, uint32_t count) {
+  uint64_t start = disk->trace ? disk_trace_now() : 0;
+  if (disk->backend) {
+    disk->backend->write(disk->backend, secnum, buf, count);
   }
-  for (int i = 0; i < 128; i++) {
-    buf[i] = (uint32_t)bytes[i*4+0]
-      | ((uint32_t)bytes[i*4+1] << 8)
-      | ((uint32_t)bytes[i*4+2] << 16)
-      | ((uint32_t)bytes[i*4+3] << 24);
+  if (disk->trace) {
+    disk_trace_log(disk->trace, DISK_TRACE_WRITE, source, secnum, count, disk_trace_now() - start);
   }
 }
 
-static void write_sector(FILE *f, uint32_t buf[static 128]) {
-  if (f) {
-    uint8_t bytes[512];
-    for (int i = 0; i < 128; i++) {
-      bytes[i*4+0] = (uint8_t)(buf[i]      );
-      bytes[i*4+1] = (uint8_t)(buf[i] >>  8);
-      bytes[i*4+2] = (uint8_t)(buf[i] >> 16);
-      bytes[i*4+3] = (uint8_t)(buf[i] >> 24);
-    }
-    fwrite(bytes, 512, 1, f);
+static bool disk_read_blocks(const struct RISC_Block *block, uint32_t num, uint32_t *buf, uint32_t count) {
+  struct Disk *disk = block_disk(block);
+  read_sectors(disk, DISK_TRACE_BLOCK, num - disk->offset, buf, count);
+  return true;
+}
+
+static bool disk_write_blocks(const struct RISC_Block *block, uint32_t num, const uint32_t *buf, uint32_t count) {
+  struct Disk *disk = block_disk(block);
+  if (disk->backend == NULL) {
+    return false;
   }
+  write_sectors(disk, DISK_TRACE_BLOCK, num - disk->offset, buf, count);
+  return true;
+}
+
+static void read_sector(struct Disk *disk, uint32_t secnum, uint32_t buf[static 128]) {
+  read_sectors(disk, DISK_TRACE_SPI, secnum, buf, 1);
+}
+
+static void write_sector(struct Disk *disk, uint32_t secnum, const uint32_t buf[static 128]) {
+  write_sectors(disk, DISK_TRACE_SPI, secnum, buf, 1);
 }
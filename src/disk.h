@@ -2,7 +2,38 @@
 #define DISK_H
 
 #include "risc-io.h"
+#include "disk-backend.h"
+#include "disk-trace.h"
 
-struct RISC_SPI *disk_new(const char *filename);
+enum DiskBackendType {
+  DISK_BACKEND_AUTO,   // mmap where available, stdio otherwise
+  DISK_BACKEND_STDIO,
+  DISK_BACKEND_MMAP,
+};
+
+enum DiskRamdisk {
+  DISK_RAMDISK_OFF,
+  DISK_RAMDISK_DISCARD,  // changes are lost at exit
+  DISK_RAMDISK_SAVE,     // the image is replaced at exit
+};
+
+struct DiskOptions {
+  enum DiskBackendType backend;
+  enum DiskMsync msync;
+  enum DiskCachePolicy cache;
+  uint32_t cache_interval_ms;  // DISK_CACHE_PERIODIC, 0 = default
+  bool fsync;
+  enum DiskRamdisk ramdisk;
+};
+
+// Options may be NULL for the defaults.
+struct RISC_SPI *disk_new(const char *filename, const struct DiskOptions *options);
+void disk_free(struct RISC_SPI *spi);
+
+// Log every sector transfer to trace (NULL to stop).
+void disk_set_trace(struct RISC_SPI *spi, struct DiskTrace *trace);
+
+// The same disk as a paravirtual block device, for riscv_set_block().
+const struct RISC_Block *disk_block(struct RISC_SPI *spi);
 
 #endif  // DISK_H
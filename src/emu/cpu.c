@@ -1,11 +1,67 @@
 #include "cpu.h"
 
+static void io_lock(CPU *machine) {
+  if (machine->num_harts > 1) {
+    pthread_mutex_lock(&machine->io_lock);
+  }
+}
+
+static void io_unlock(CPU *machine) {
+  if (machine->num_harts > 1) {
+    pthread_mutex_unlock(&machine->io_lock);
+  }
+}
+
+static void serial_counts(const struct RISC_Serial *serial, uint32_t *avail, uint32_t *room) {
+  if (serial->counts) {
+    serial->counts(serial, avail, room);
+  } else {
+    uint32_t status = serial->read_status(serial);
+    *avail = status & 1;
+    *room = (status >> 1) & 1;
+  }
+}
 
-uint32_t riscv_load_io(CPU *machine, uint32_t address) {
+// In extended mode the status register keeps bits 0 and 1, sets
+// SerialMark and holds the free transmit space in bits 4-15 and the
+// bytes ready to be read in bits 16-31, both saturated.  The guest can
+// then move that many bytes without looking at the status again, four
+// at a time through the wide data register.
+static uint32_t serial_status(const struct RISC_Serial *serial) {
+  uint32_t avail, room;
+  serial_counts(serial, &avail, &room);
+  avail = avail < 0xFFFF ? avail : 0xFFFF;
+  room = room < 0xFFF ? room : 0xFFF;
+  return avail << 16 | room << 4 | SerialMark | (room ? 2 : 0) | (avail ? 1 : 0);
+}
+
+// Up to four bytes, the first in bits 0-7.  Takes only what is
+// available, so the guest must know from the counts how many it got.
+static uint32_t serial_read_word(const struct RISC_Serial *serial) {
+  uint32_t avail, room, word = 0;
+  serial_counts(serial, &avail, &room);
+  for (uint32_t i = 0; i < 4 && i < avail; i++) {
+    word |= (serial->read_data(serial) & 0xFF) << (8 * i);
+  }
+  return word;
+}
+
+static void serial_write_word(const struct RISC_Serial *serial, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    serial->write_data(serial, (value >> (8 * i)) & 0xFF);
+  }
+}
+
+static uint32_t load_io(Hart *hart, uint32_t address) {
+  CPU *machine = hart->machine;
   switch (address - IOStart) {
     case 0: {
       // Millisecond counter
-      machine->progress--;
+      hart->progress--;
+      if (machine->insts_per_ms) {
+        uint64_t cycles = ((uint64_t)hart->CSR[0xC80] << 32) | hart->CSR[0xC00];
+        return (uint32_t)(cycles / machine->insts_per_ms);
+      }
       return machine->current_tick;
     }
     case 4: {
@@ -23,6 +79,9 @@ uint32_t riscv_load_io(CPU *machine, uint32_t address) {
     case 12: {
       // RS232 status
       if (machine->serial) {
+        if (machine->serial_extended) {
+          return serial_status(machine->serial);
+        }
         return machine->serial->read_status(machine->serial);
       }
       return 0;
@@ -47,23 +106,31 @@ uint32_t riscv_load_io(CPU *machine, uint32_t address) {
     case 24: {
       // Mouse input / keyboard status
       uint32_t mouse = machine->mouse;
-      if (machine->key_cnt > 0) {
+      if (__atomic_load_n(&machine->key_head, __ATOMIC_ACQUIRE) != machine->key_tail) {
         mouse |= 0x10000000;
       } else {
-        machine->progress--;
+        hart->progress--;
       }
       return mouse;
     }
     case 28: {
       // Keyboard input
-      if (machine->key_cnt > 0) {
-        uint8_t scancode = machine->key_buf[0];
-        machine->key_cnt--;
-        memmove(&machine->key_buf[0], &machine->key_buf[1], machine->key_cnt);
+      uint32_t tail = machine->key_tail;
+      if (__atomic_load_n(&machine->key_head, __ATOMIC_ACQUIRE) != tail) {
+        uint8_t scancode = machine->key_buf[tail % KeyBufSize];
+        __atomic_store_n(&machine->key_tail, tail + 1, __ATOMIC_RELEASE);
         return scancode;
       }
       return 0;
     }
+    case 36: {
+      // IPI mailbox: pending message of this hart, bit 31 set if valid
+      uint32_t message = __atomic_exchange_n(&hart->mailbox, 0, __ATOMIC_ACQ_REL);
+      if (message == 0) {
+        hart->progress--;
+      }
+      return message;
+    }
     case 40: {
       // Clipboard control
       if (machine->clipboard) {
@@ -78,13 +145,206 @@ uint32_t riscv_load_io(CPU *machine, uint32_t address) {
       }
       return 0;
     }
+    case 48: {
+      // Paravirtual block device: presence
+      return machine->block ? BlockMagic : 0;
+    }
+    case 52: {
+      // Host file system: presence
+      return machine->hostfs ? HostFSMagic : 0;
+    }
+    case 56: {
+      // RS232 wide data
+      if (machine->serial) {
+        return serial_read_word(machine->serial);
+      }
+      return 0;
+    }
+    case 60: {
+      // Clipboard bulk transfer: presence
+      return machine->clipboard && machine->clipboard->get ? ClipMagic : 0;
+    }
     default: {
       return 0;
     }
   }
 }
 
-void riscv_store_io(CPU *machine, uint32_t address, uint32_t value) {
+uint32_t riscv_load_io(Hart *hart, uint32_t address) {
+  // The mailbox is lock free, don't let a hart polling it block the others.
+  if (address - IOStart == 36) {
+    return load_io(hart, address);
+  }
+  io_lock(hart->machine);
+  uint32_t value = load_io(hart, address);
+  io_unlock(hart->machine);
+  return value;
+}
+
+// Bits 28-31 select the target hart, bits 0-27 are the message. A
+// parked hart takes its first message as the address to start at.
+static void send_ipi(CPU *machine, uint32_t value) {
+  uint32_t target = value >> 28;
+  if (target >= machine->num_harts) {
+    return;
+  }
+  Hart *hart = &machine->harts[target];
+  pthread_mutex_lock(&machine->sched_lock);
+  if (hart->parked) {
+    hart->pc = value & 0x0FFFFFFC;
+    hart->parked = false;
+  } else {
+    __atomic_store_n(&hart->mailbox, 0x80000000 | (value & 0x0FFFFFFF), __ATOMIC_RELEASE);
+  }
+  pthread_cond_broadcast(&machine->sched_cond);
+  pthread_mutex_unlock(&machine->sched_lock);
+}
+
+// Marks guest memory written by a device as changed on the display.
+static void damage_range(CPU *machine, uint32_t adr, uint32_t len) {
+  uint32_t end = adr + len;
+  for (uint32_t a = adr < machine->display_start ? machine->display_start : adr & ~3u; a < end; a += 4) {
+    riscv_update_damage(machine, (int)(a/4 - machine->display_start/4));
+  }
+}
+
+// Paravirtual block device.  There is only one register left for it,
+// so the guest stores the address of a descriptor in RAM,
+//   {op, block, buffer, count, status},
+// and the sectors are copied between the disk and RAM before the store
+// completes.  The device writes BlockOK or BlockError into status.
+static void block_command(CPU *machine, uint32_t desc) {
+  if (desc % 4 != 0 || desc >= machine->mem_size || machine->mem_size - desc < 5 * 4) {
+    return;
+  }
+  word_t *d = &machine->RAM[desc/4];
+  uint32_t op = d[0], block = d[1], adr = d[2], count = d[3];
+  bool ok = false;
+  if (adr % 4 == 0 && adr <= machine->mem_size && count <= (machine->mem_size - adr) / 512) {
+    word_t *buf = &machine->RAM[adr/4];
+    if (op == BlockRead) {
+      ok = machine->block->read(machine->block, block, buf, count);
+      damage_range(machine, adr, count * 512);
+    } else if (op == BlockWrite) {
+      ok = machine->block->write(machine->block, block, buf, count);
+    }
+  }
+  d[4] = ok ? BlockOK : BlockError;
+}
+
+// Whether guest memory [adr, adr+len) exists.
+static bool in_ram(CPU *machine, uint32_t adr, uint32_t len) {
+  return adr <= machine->mem_size && len <= machine->mem_size - adr;
+}
+
+// A NUL-terminated name within [adr, adr+len) of guest memory, or NULL.
+static const char *guest_name(CPU *machine, uint32_t adr, uint32_t len) {
+  const char *name = (const char *)machine->RAM + adr;
+  return in_ram(machine, adr, len) && memchr(name, 0, len) ? name : NULL;
+}
+
+// Host file system, the same way as the block device: the guest stores
+// the address of a descriptor
+//   {op, handle, pos, buffer, len, result}
+// and the request is done before the store completes.  Names are passed
+// in buffer (HostRename: both, one after the other).  result is -1 on
+// failure; HostStat also sets pos to the file's date.
+static void hostfs_command(CPU *machine, uint32_t desc) {
+  if (desc % 4 != 0 || !in_ram(machine, desc, 6 * 4)) {
+    return;
+  }
+  const struct RISC_HostFS *fs = machine->hostfs;
+  word_t *d = &machine->RAM[desc/4];
+  uint32_t op = d[0], pos = d[2], adr = d[3], len = d[4];
+  int32_t handle = (int32_t)d[1];
+  uint8_t *buf = (uint8_t *)machine->RAM + adr;
+  const char *name = guest_name(machine, adr, len);
+  int32_t result = -1;
+  switch (op) {
+    case HostOpen:
+    case HostNew:
+      if (name) {
+        result = fs->open(fs, name, op == HostNew);
+      }
+      break;
+    case HostClose:
+      fs->close(fs, handle);
+      result = 0;
+      break;
+    case HostRead:
+      if (in_ram(machine, adr, len)) {
+        result = fs->read(fs, handle, pos, buf, len);
+        if (result > 0) {
+          damage_range(machine, adr, (uint32_t)result);
+        }
+      }
+      break;
+    case HostWrite:
+      if (in_ram(machine, adr, len)) {
+        result = fs->write(fs, handle, pos, buf, len);
+      }
+      break;
+    case HostLength:
+      result = fs->length(fs, handle);
+      break;
+    case HostStat:
+      if (name) {
+        result = fs->stat(fs, name, &d[2]);
+      }
+      break;
+    case HostDir:
+      if (in_ram(machine, adr, len)) {
+        result = fs->dir(fs, pos, (char *)buf, len);
+        damage_range(machine, adr, len);
+      }
+      break;
+    case HostDelete:
+      if (name) {
+        result = fs->remove(fs, name);
+      }
+      break;
+    case HostRename:
+      if (name) {
+        uint32_t skip = (uint32_t)strlen(name) + 1;
+        const char *to = guest_name(machine, adr + skip, len - skip);
+        if (to) {
+          result = fs->rename(fs, name, to);
+        }
+      }
+      break;
+  }
+  d[5] = (word_t)result;
+}
+
+// Bulk clipboard transfer through a descriptor
+//   {op, pos, buffer, len, result}
+// ClipGet copies up to len bytes of the host text from pos into buffer
+// and sets result to the length of the whole text.  ClipPut and
+// ClipPutDone hand over len bytes at pos, the latter setting the host
+// clipboard.
+static void clipboard_command(CPU *machine, uint32_t desc) {
+  if (desc % 4 != 0 || !in_ram(machine, desc, 5 * 4)) {
+    return;
+  }
+  const struct RISC_Clipboard *clip = machine->clipboard;
+  word_t *d = &machine->RAM[desc/4];
+  uint32_t op = d[0], pos = d[1], adr = d[2], len = d[3];
+  uint8_t *buf = (uint8_t *)machine->RAM + adr;
+  int32_t result = -1;
+  if (in_ram(machine, adr, len)) {
+    if (op == ClipGet) {
+      result = (int32_t)clip->get(clip, pos, buf, len);
+      damage_range(machine, adr, len);
+    } else if (op == ClipPut || op == ClipPutDone) {
+      clip->put(clip, pos, buf, len, op == ClipPutDone);
+      result = 0;
+    }
+  }
+  d[4] = (word_t)result;
+}
+
+static void store_io(Hart *hart, uint32_t address, uint32_t value) {
+  CPU *machine = hart->machine;
   switch (address - IOStart) {
     case 4: {
       // LED control
@@ -100,6 +360,13 @@ void riscv_store_io(CPU *machine, uint32_t address, uint32_t value) {
       }
       break;
     }
+    case 12: {
+      // RS232 control
+      // Bit 0:   bit rate (ignored)
+      // Bit 1:   extended mode
+      machine->serial_extended = (value & SerialExtended) != 0;
+      break;
+    }
     case 16: {
       // SPI write
       const struct RISC_SPI *spi = machine->spi[machine->spi_selected];
@@ -141,7 +408,7 @@ void riscv_store_io(CPU *machine, uint32_t address, uint32_t value) {
               trace->file[trace->file_pos+1] = (char)((value & 0x00FF00) >> 8);
               trace->file[trace->file_pos+2] = (char)((value & 0xFF0000) >> 16);
               trace->file_pos += 3;
-              trace->pc = machine->pc;
+              trace->pc = hart->pc;
               break;
             }
             case 0xBB: {
@@ -165,6 +432,11 @@ void riscv_store_io(CPU *machine, uint32_t address, uint32_t value) {
       }
       break;
     }
+    case 36: {
+      // IPI mailbox
+      send_ipi(machine, value);
+      break;
+    }
     case 40: {
       // Clipboard control
       if (machine->clipboard) {
@@ -179,6 +451,34 @@ void riscv_store_io(CPU *machine, uint32_t address, uint32_t value) {
       }
       break;
     }
+    case 48: {
+      // Paravirtual block device: descriptor address
+      if (machine->block) {
+        block_command(machine, value);
+      }
+      break;
+    }
+    case 52: {
+      // Host file system: descriptor address
+      if (machine->hostfs) {
+        hostfs_command(machine, value);
+      }
+      break;
+    }
+    case 56: {
+      // RS232 wide data
+      if (machine->serial) {
+        serial_write_word(machine->serial, value);
+      }
+      break;
+    }
+    case 60: {
+      // Clipboard bulk transfer: descriptor address
+      if (machine->clipboard && machine->clipboard->get) {
+        clipboard_command(machine, value);
+      }
+      break;
+    }
     default:
       printf("Wrote %0x to undefined IO at address 0x%0x.", value, address);
       riscv_print_trace(machine); //exit(1);
@@ -186,32 +486,164 @@ void riscv_store_io(CPU *machine, uint32_t address, uint32_t value) {
   }
 }
 
+void riscv_store_io(Hart *hart, uint32_t address, uint32_t value) {
+  if (address - IOStart == 36) {
+    store_io(hart, address, value);
+    return;
+  }
+  io_lock(hart->machine);
+  store_io(hart, address, value);
+  io_unlock(hart->machine);
+}
+
 // TODO Make memory access circular
-word_t riscv_load(CPU *machine, addr_t addr) {
+word_t riscv_load(Hart *hart, addr_t addr) {
+  CPU *machine = hart->machine;
   if (addr < machine->mem_size) {
     //printf("loading %x from addr %x", machine->RAM[addr/4], addr);
     return machine->RAM[addr/4];
   }
   else
-    return riscv_load_io(machine, addr);
+    return riscv_load_io(hart, addr);
 }
 
-void riscv_store(CPU *machine, uint32_t address, word_t value) {
+void riscv_store(Hart *hart, uint32_t address, word_t value) {
+  CPU *machine = hart->machine;
   if (address < machine->display_start) {
     //printf("Store of %x to %x", value, address);
     machine->RAM[address/4] = value;
   } else if (address < machine->mem_size) {
     machine->RAM[address/4] = value;
+    io_lock(machine);
     riscv_update_damage(machine, address/4 - machine->display_start/4);
+    io_unlock(machine);
+  } else {
+    riscv_store_io(hart, address, value);
+  }
+}
+
+// Byte and halfword stores go to RAM directly rather than by rewriting
+// the whole word, so that harts storing to neighbouring bytes of the
+// same word don't undo each other's stores.
+void riscv_store_byte(Hart *hart, uint32_t address, uint8_t value) {
+  CPU *machine = hart->machine;
+  if (address < machine->mem_size) {
+    ((uint8_t *)machine->RAM)[address] = value;
+    if (address >= machine->display_start) {
+      io_lock(machine);
+      riscv_update_damage(machine, address/4 - machine->display_start/4);
+      io_unlock(machine);
+    }
   } else {
-    riscv_store_io(machine, address, value);
+    riscv_store_io(hart, address, value);
+  }
+}
+
+void riscv_store_half(Hart *hart, uint32_t address, uint16_t value) {
+  CPU *machine = hart->machine;
+  if (address % 2 != 0) {
+    riscv_store_byte(hart, address, (uint8_t)value);
+    riscv_store_byte(hart, address + 1, (uint8_t)(value >> 8));
+  } else if (address < machine->mem_size) {
+    memcpy((uint8_t *)machine->RAM + address, &value, sizeof(value));
+    if (address >= machine->display_start) {
+      io_lock(machine);
+      riscv_update_damage(machine, address/4 - machine->display_start/4);
+      io_unlock(machine);
+    }
+  } else {
+    riscv_store_io(hart, address, value);
+  }
+}
+
+static word_t amo_op(uint32_t funct5, word_t old, word_t value) {
+  switch (funct5) {
+    case 0b00001: return value;                                              // AMOSWAP
+    case 0b00000: return old + value;                                        // AMOADD
+    case 0b00100: return old ^ value;                                        // AMOXOR
+    case 0b01100: return old & value;                                        // AMOAND
+    case 0b01000: return old | value;                                        // AMOOR
+    case 0b10000: return (int32_t)old < (int32_t)value ? old : value;        // AMOMIN
+    case 0b10100: return (int32_t)old > (int32_t)value ? old : value;        // AMOMAX
+    case 0b11000: return old < value ? old : value;                          // AMOMINU
+    case 0b11100: return old > value ? old : value;                          // AMOMAXU
+    default:      return old;
+  }
+}
+
+// A extension. Word-aligned RAM accesses map onto host atomics, so harts
+// running on different host threads see them as indivisible. SC.W
+// succeeds if the word still holds the value LR.W saw; that can't tell
+// an A-B-A sequence apart, which is fine for the usual lock idioms.
+// Returns the value for rd.
+word_t riscv_amo(Hart *hart, uint32_t funct5, addr_t addr, word_t value) {
+  CPU *machine = hart->machine;
+  if (addr >= machine->mem_size || addr % 4 != 0) {
+    // Device registers aren't shared memory, do it non-atomically.
+    word_t old = riscv_load(hart, addr);
+    if (funct5 == 0b00010) {
+      return old;
+    } else if (funct5 == 0b00011) {
+      riscv_store(hart, addr, value);
+      return 0;
+    }
+    riscv_store(hart, addr, amo_op(funct5, old, value));
+    return old;
+  }
+
+  word_t *word = &machine->RAM[addr/4];
+  word_t old = 0;
+  switch (funct5) {
+    case 0b00010: { // LR.W
+      old = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+      hart->reserved = true;
+      hart->reservation = addr;
+      hart->reserved_value = old;
+      return old;
+    }
+    case 0b00011: { // SC.W
+      bool ok = false;
+      if (hart->reserved && hart->reservation == addr) {
+        word_t expected = hart->reserved_value;
+        ok = __atomic_compare_exchange_n(word, &expected, value, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      }
+      hart->reserved = false;
+      if (!ok) {
+        return 1;
+      }
+      break;
+    }
+    case 0b00001: old = __atomic_exchange_n(word, value, __ATOMIC_ACQ_REL); break;
+    case 0b00000: old = __atomic_fetch_add(word, value, __ATOMIC_ACQ_REL); break;
+    case 0b00100: old = __atomic_fetch_xor(word, value, __ATOMIC_ACQ_REL); break;
+    case 0b01100: old = __atomic_fetch_and(word, value, __ATOMIC_ACQ_REL); break;
+    case 0b01000: old = __atomic_fetch_or(word, value, __ATOMIC_ACQ_REL); break;
+    default: {
+      // min/max have no host builtin, retry until nobody raced us
+      old = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+      while (!__atomic_compare_exchange_n(word, &old, amo_op(funct5, old, value), false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      }
+      break;
+    }
   }
+  if (addr >= machine->display_start) {
+    io_lock(machine);
+    riscv_update_damage(machine, addr/4 - machine->display_start/4);
+    io_unlock(machine);
+  }
+  return funct5 == 0b00011 ? 0 : old;
 }
 
 void riscv_update_damage(CPU *machine, int w) {
   int row = w / machine->fb_width;
   int col = w % machine->fb_width;
   if (row < machine->fb_height) {
+    if (__atomic_load_n(&machine->probe_armed, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&machine->probe_armed, false, __ATOMIC_RELAXED);
+      machine->probe->framebuffer_store(machine->probe);
+    }
     if (col < machine->damage.x1) {
       machine->damage.x1 = col;
     }
@@ -246,6 +678,19 @@ void riscv_set_clipboard(CPU *machine, const struct RISC_Clipboard *clipboard) {
   machine->clipboard = clipboard;
 }
 
+void riscv_set_probe(CPU *machine, const struct RISC_Probe *probe) {
+  machine->probe = probe;
+  machine->probe_armed = false;
+}
+
+void riscv_set_block(CPU *machine, const struct RISC_Block *block) {
+  machine->block = block;
+}
+
+void riscv_set_hostfs(CPU *machine, const struct RISC_HostFS *hostfs) {
+  machine->hostfs = hostfs;
+}
+
 void riscv_set_switches(CPU *machine, int switches) {
   machine->switches = switches;
 }
@@ -258,6 +703,20 @@ void riscv_set_logging(CPU *machine, bool log) {
   machine->logging = log;
 }
 
+// In deterministic mode the millisecond counter is derived from the
+// retired instruction count instead of the host clock, and harts never
+// stop early because they look idle, so that a run depends on nothing
+// but the instruction stream and the input fed in between calls.
+void riscv_set_deterministic(CPU *machine, uint32_t insts_per_ms) {
+  machine->insts_per_ms = insts_per_ms;
+}
+
+// Instructions retired by the boot hart since power-on.
+uint64_t riscv_get_cycles(CPU *machine) {
+  Hart *hart = &machine->harts[0];
+  return ((uint64_t)hart->CSR[0xC80] << 32) | hart->CSR[0xC00];
+}
+
 void riscv_mouse_moved(CPU *machine, int mouse_x, int mouse_y) {
   if (mouse_x >= 0 && mouse_x < 4096) {
     machine->mouse = (machine->mouse & ~0x00000FFF) | mouse_x;
@@ -265,6 +724,7 @@ void riscv_mouse_moved(CPU *machine, int mouse_x, int mouse_y) {
   if (mouse_y >= 0 && mouse_y < 4096) {
     machine->mouse = (machine->mouse & ~0x00FFF000) | (mouse_y << 12);
   }
+  __atomic_store_n(&machine->probe_armed, machine->probe != NULL, __ATOMIC_RELAXED);
 }
 
 void riscv_mouse_button(CPU *machine, int button, bool down) {
@@ -278,11 +738,26 @@ void riscv_mouse_button(CPU *machine, int button, bool down) {
   }
 }
 
-void riscv_keyboard_input(CPU *machine, uint8_t *scancodes, uint32_t len) {
-  if (sizeof(machine->key_buf) - machine->key_cnt >= len) {
-    memmove(&machine->key_buf[machine->key_cnt], scancodes, len);
-    machine->key_cnt += len;
+// Space for this many more codes.  Only grows until the next
+// riscv_keyboard_input(), so a caller can check before sending.
+uint32_t riscv_keyboard_room(CPU *machine) {
+  uint32_t tail = __atomic_load_n(&machine->key_tail, __ATOMIC_ACQUIRE);
+  return KeyBufSize - (machine->key_head - tail);
+}
+
+// Queues the codes of one key event as a whole, or returns false if
+// they don't fit.  Called from one thread only.
+bool riscv_keyboard_input(CPU *machine, uint8_t *scancodes, uint32_t len) {
+  if (riscv_keyboard_room(machine) < len) {
+    return false;
   }
+  uint32_t head = machine->key_head;
+  for (uint32_t i = 0; i < len; i++) {
+    machine->key_buf[(head + i) % KeyBufSize] = scancodes[i];
+  }
+  __atomic_store_n(&machine->key_head, head + len, __ATOMIC_RELEASE);
+  __atomic_store_n(&machine->probe_armed, machine->probe != NULL, __ATOMIC_RELAXED);
+  return true;
 }
 
 uint32_t *riscv_get_framebuffer_ptr(CPU *machine) {
@@ -291,6 +766,7 @@ uint32_t *riscv_get_framebuffer_ptr(CPU *machine) {
 }
 
 struct Damage riscv_get_framebuffer_damage(CPU *machine) {
+  io_lock(machine);
   struct Damage dmg = machine->damage;
   machine->damage = (struct Damage){
     .x1 = machine->fb_width,
@@ -298,11 +774,25 @@ struct Damage riscv_get_framebuffer_damage(CPU *machine) {
     .y1 = machine->fb_height,
     .y2 = 0
   };
+  io_unlock(machine);
   return dmg;
 }
 
 void riscv_reset(CPU *machine) {
-  machine->pc = ROMStart;
+  machine->harts[0].pc = ROMStart;
+  // Secondary harts wait for the boot hart to send them a start address.
+  for (uint32_t i = 1; i < machine->num_harts; i++) {
+    machine->harts[i].parked = true;
+    machine->harts[i].mailbox = 0;
+    machine->harts[i].reserved = false;
+  }
+  machine->serial_extended = false;
+  if (machine->serial && machine->serial->reset) {
+    machine->serial->reset(machine->serial);
+  }
+  if (machine->hostfs && machine->hostfs->reset) {
+    machine->hostfs->reset(machine->hostfs);
+  }
 }
 
 void riscv_print_trace(CPU *machine) {
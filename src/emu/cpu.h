@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #define DefaultMemSize      0x00100000
 #define DefaultDisplayStart 0x000E7F00
@@ -24,6 +25,42 @@
 
 #define TRACE_SIZE 500
 
+#define KeyBufSize 4096  // PS/2 codes waiting for the guest, a power of two
+
+// Paravirtual block device descriptor, see block_command() in cpu.c
+#define BlockMagic   0x50564231  // "PVB1", read from the register if present
+#define BlockRead    1
+#define BlockWrite   2
+#define BlockOK      0
+#define BlockError   1
+
+// Host file system descriptor, see hostfs_command() in cpu.c
+#define HostFSMagic  0x48465331  // "HFS1", read from the register if present
+#define HostOpen     1
+#define HostNew      2
+#define HostClose    3
+#define HostRead     4
+#define HostWrite    5
+#define HostLength   6
+#define HostStat     7
+#define HostDir      8
+#define HostDelete   9
+#define HostRename   10
+
+// Clipboard bulk descriptor, see clipboard_command() in cpu.c
+#define ClipMagic    0x434C5031  // "CLP1", read from the register if present
+#define ClipGet      1
+#define ClipPut      2
+#define ClipPutDone  3
+
+// Extended serial mode, switched on by storing SerialExtended to the
+// status register, see serial_status() in cpu.c
+#define SerialExtended 2
+#define SerialMark     4
+
+#define MaxHarts 16
+#define CSR_MHARTID 0xF14
+
 // #define RV64
 
 typedef uint32_t word_t;
@@ -48,10 +85,32 @@ typedef struct Trace {
 } Trace;
 
 
-typedef struct CPU {
+struct CPU;
+
+// A hardware thread. Every hart has its own registers and CSRs, all
+// harts share the memory and devices of the machine they belong to.
+typedef struct Hart {
   ureg_t pc;
   ureg_t *registers;
   word_t CSR[4096];
+  uint32_t id;
+
+  uint32_t progress;
+  uint64_t num_insts; // count number of instructions run
+
+  bool     parked;    // secondary hart that hasn't been started yet
+  uint32_t mailbox;   // pending IPI message, bit 31 set if valid
+  bool     reserved;  // LR.W reservation
+  addr_t   reservation;
+  word_t   reserved_value;
+
+  struct CPU *machine;
+  pthread_t thread;
+} Hart;
+
+typedef struct CPU {
+  Hart *harts;        // hart 0 is the boot hart
+  uint32_t num_harts;
   word_t ROM[ROMWords];
   word_t *RAM;
 
@@ -61,20 +120,38 @@ typedef struct CPU {
 
   uint32_t current_tick;
   uint32_t mouse;
-  uint8_t  key_buf[16];
-  uint32_t key_cnt;
+  // Keyboard ring: key_head is only advanced by riscv_keyboard_input(),
+  // key_tail only by the guest's reads, so neither side takes a lock.
+  uint8_t  key_buf[KeyBufSize];
+  uint32_t key_head;
+  uint32_t key_tail;
   uint32_t switches;
 
-  uint32_t progress;
-  uint64_t num_insts; // count number of instructions run
   uint32_t watch_mem; // memory location to "watch"; ie trigger ebreak upon write
   bool     logging;
+  uint32_t insts_per_ms; // deterministic mode: timer follows retired instructions
+
+  // With more than one hart, device and framebuffer damage accesses are
+  // serialized by io_lock; the sched_* fields hand out per-call budgets
+  // to the secondary hart threads.
+  pthread_mutex_t io_lock;
+  pthread_mutex_t sched_lock;
+  pthread_cond_t  sched_cond;
+  uint64_t sched_generation;
+  uint32_t sched_cycles;
+  uint32_t sched_pending;
+  bool     sched_boot_done;
 
   const struct RISC_LED *leds;
   const struct RISC_Serial *serial;
+  bool serial_extended;  // status register reports FIFO counts
   uint32_t spi_selected;
   const struct RISC_SPI *spi[4];
+  const struct RISC_Block *block;
+  const struct RISC_HostFS *hostfs;
   const struct RISC_Clipboard *clipboard;
+  const struct RISC_Probe *probe;
+  bool probe_armed;   // input arrived, no framebuffer store seen since
 
   int fb_width;   // words
   int fb_height;  // lines
@@ -85,12 +162,15 @@ typedef struct CPU {
   uint16_t stack_index;
 } CPU;
 
-uint32_t riscv_load_io(CPU *machine, uint32_t address);
-void riscv_store_io(CPU *machine, uint32_t address, uint32_t value);
+uint32_t riscv_load_io(Hart *hart, uint32_t address);
+void riscv_store_io(Hart *hart, uint32_t address, uint32_t value);
 
 // TODO Make memory access circular
-word_t riscv_load(CPU *machine, addr_t addr);
-void riscv_store(CPU *machine, uint32_t address, word_t value);
+word_t riscv_load(Hart *hart, addr_t addr);
+void riscv_store(Hart *hart, uint32_t address, word_t value);
+void riscv_store_byte(Hart *hart, uint32_t address, uint8_t value);
+void riscv_store_half(Hart *hart, uint32_t address, uint16_t value);
+word_t riscv_amo(Hart *hart, uint32_t funct5, addr_t addr, word_t value);
 void riscv_update_damage(CPU *machine, int w);
 
 // IO functions
@@ -98,12 +178,18 @@ void riscv_set_leds(CPU *machine, const struct RISC_LED *leds);
 void riscv_set_serial(CPU *machine, const struct RISC_Serial *serial);
 void riscv_set_spi(CPU *machine, int index, const struct RISC_SPI *spi);
 void riscv_set_clipboard(CPU *machine, const struct RISC_Clipboard *clipboard);
+void riscv_set_block(CPU *machine, const struct RISC_Block *block);
+void riscv_set_hostfs(CPU *machine, const struct RISC_HostFS *hostfs);
+void riscv_set_probe(CPU *machine, const struct RISC_Probe *probe);
 void riscv_set_switches(CPU *machine, int switches);
 void riscv_set_time(CPU *machine, uint32_t tick);
 void riscv_set_logging(CPU *machine, bool log);
+void riscv_set_deterministic(CPU *machine, uint32_t insts_per_ms);
+uint64_t riscv_get_cycles(CPU *machine);
 void riscv_mouse_moved(CPU *machine, int mouse_x, int mouse_y);
 void riscv_mouse_button(CPU *machine, int button, bool down);
-void riscv_keyboard_input(CPU *machine, uint8_t *scancodes, uint32_t len);
+bool riscv_keyboard_input(CPU *machine, uint8_t *scancodes, uint32_t len);
+uint32_t riscv_keyboard_room(CPU *machine);
 void riscv_print_trace(CPU *machine);
 void write_log(bool logging, const char *format, ...);
 
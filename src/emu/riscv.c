@@ -3,24 +3,39 @@
 #include <stdbool.h>
 #include <string.h>
 
-bool terminate = false;
-
 static const uint32_t program[ROMWords] = {
 #include "bootloader.inc"
 };
 
+static void hart_init(CPU *machine, Hart *hart, uint32_t id) {
+  hart->machine = machine;
+  hart->id = id;
+  hart->registers = malloc(machine->num_regs * sizeof(ureg_t));
+  for(int i = 0; i < machine->num_regs; i++)
+    hart->registers[i] = 0;
+  for(int i = 0; i < 4096; i++)
+    hart->CSR[i] = 0;
+  hart->CSR[CSR_MHARTID] = id;
+  hart->num_insts = 0;
+  hart->parked = id != 0;
+  hart->mailbox = 0;
+  hart->reserved = false;
+}
+
 CPU *riscv_new() {
-  CPU *machine = malloc(sizeof(CPU));
+  CPU *machine = calloc(1, sizeof(CPU));
   if (machine == NULL)
     exit(2);
 
   machine->mem_size = DefaultMemSize;
   machine->num_regs = 32;
-  machine->registers = malloc(machine->num_regs * sizeof(ureg_t));
-  for(int i = 0; i < machine->num_regs; i++)
-    machine->registers[i] = 0;
-  for(int i = 0; i < 4096; i++)
-    machine->CSR[i] = 0;
+  machine->num_harts = 1;
+  machine->harts = calloc(1, sizeof(Hart));
+  hart_init(machine, &machine->harts[0], 0);
+  pthread_mutex_init(&machine->io_lock, NULL);
+  pthread_mutex_init(&machine->sched_lock, NULL);
+  pthread_cond_init(&machine->sched_cond, NULL);
+  machine->sched_generation = 0;
 
   machine->display_start = DefaultDisplayStart;
   machine->fb_width = RISC_FRAMEBUFFER_WIDTH / 32;
@@ -40,8 +55,8 @@ CPU *riscv_new() {
     machine->stack_trace[i] = (Trace){ .file = "", .pos = 0, .file_pos = 0 };
   }
   machine->stack_index = 0;
-  machine->num_insts = 0;
   machine->logging = false;
+  machine->insts_per_ms = 0;
   machine->watch_mem = 0xffffffff;
   return machine;
 }
@@ -89,19 +104,27 @@ CPU *riscv_new() {
 #define rd ((unsigned char) ((instruction&0x00000F80) >> 7 ) )
 #define opcode ((instruction&0x0000007F) )
 
-uint8_t shamt;
-uint32_t instruction;
-uint32_t temp;
+// Runs up to `cycles` instructions on one hart, stops early when the
+// hart is idle. Returns whether an EBREAK was hit; *ran is set to the
+// number of instructions executed.
+static bool hart_execute(Hart *hart, uint32_t cycles, uint32_t *ran) {
+  CPU *machine = hart->machine;
+  uint8_t shamt;
+  uint32_t instruction = 0;
+  uint32_t temp;
+  bool terminate = false;
+  uint32_t i;
 
-bool riscv_execute(CPU *machine, uint32_t cycles) {
-  machine->progress = 20;
-  for (uint32_t i = 0; i < cycles && machine->progress; i++) {
-    if (machine->pc < machine->mem_size) {
-      instruction = machine->RAM[machine->pc / 4];
-    } else if (machine->pc >= ROMStart) {
-      instruction = machine->ROM[(machine->pc - ROMStart) / 4];
+  hart->progress = machine->insts_per_ms ? UINT32_MAX : 20;
+  *ran = 0;
+  for (i = 0; i < cycles && hart->progress; i++) {
+    *ran = i + 1;
+    if (hart->pc < machine->mem_size) {
+      instruction = machine->RAM[hart->pc / 4];
+    } else if (hart->pc >= ROMStart) {
+      instruction = machine->ROM[(hart->pc - ROMStart) / 4];
     } else {
-      printf("Panic! PC = %0x", machine->pc);
+      printf("Panic! PC = %0x", hart->pc);
       terminate = true;
     }
     shamt=rs2;
@@ -132,85 +155,88 @@ bool riscv_execute(CPU *machine, uint32_t cycles) {
       case 0b1110011: //ebreak/ecall/csr
         insttype = 7;
         break;
+      case 0b0101111: // AMO
+        insttype = 1;
+        break;
+      case 0b0001111: // FENCE
+        insttype = 8;
+        break;
     }
  
-    write_log(machine->logging, "PC:0x%x\nINSTRUCTION:\t", machine->pc);
+    write_log(machine->logging, "PC:0x%x\nINSTRUCTION:\t", hart->pc);
     // https://github.com/MicroCoreLabs/Projects/blob/master/RISCV_C_Version/C_Version/riscv.c
-    if (opcode==0b0110111) { machine->registers[rd] = U_immediate << 12; write_log(machine->logging, " LUI "); } else // LUI
-    if (opcode==0b0010111) { machine->registers[rd] = (U_immediate << 12) + machine->pc; write_log(machine->logging, " AUIPC "); } else // AUIPC
-    if (opcode==0b1101111) { machine->registers[rd] = machine->pc + 0x4; machine->pc = (J_immediate_SE) + machine->pc - 0x4; write_log(machine->logging, " JAL "); } else // JAL
-    if (opcode==0b1100111) { machine->registers[rd] = machine->pc + 0x4; machine->pc = (((I_immediate_SE) + machine->registers[rs1]) & 0xFFFFFFFE) - 0x4; write_log(machine->logging, " JALR "); } else // JALR
-    if (opcode==0b1100011 && funct3==0b000) { if (machine->registers[rs1]==machine->registers[rs2]) machine->pc = ( (B_immediate_SE) + machine->pc) - 0x4; write_log(machine->logging, " BEQ "); } else // BEQ
-    if (opcode==0b1100011 && funct3==0b001) { if (machine->registers[rs1]!=machine->registers[rs2]) machine->pc = ( (B_immediate_SE) + machine->pc) - 0x4; write_log(machine->logging, " BNE "); } else // BNE
-    if (opcode==0b1100011 && funct3==0b100) { if ((int32_t)machine->registers[rs1]< (int32_t)machine->registers[rs2]) machine->pc = ((B_immediate_SE) + machine->pc) - 0x4; write_log(machine->logging, " BLT "); } else // BLT
-    if (opcode==0b1100011 && funct3==0b101) { if ((int32_t)machine->registers[rs1]>=(int32_t)machine->registers[rs2]) machine->pc = ((B_immediate_SE) + machine->pc) - 0x4; write_log(machine->logging, " BGE "); } else // BGE
-    if (opcode==0b1100011 && funct3==0b110) { if (machine->registers[rs1]<machine->registers[rs2]) machine->pc = ( (B_immediate_SE) + machine->pc) - 0x4; write_log(machine->logging, " BLTU ");  } else // BLTU
-    if (opcode==0b1100011 && funct3==0b111) { if (machine->registers[rs1]>=machine->registers[rs2]) machine->pc = ( (B_immediate_SE) + machine->pc) - 0x4; write_log(machine->logging, " BGTU "); } else // BGTU
+    if (opcode==0b0110111) { hart->registers[rd] = U_immediate << 12; write_log(machine->logging, " LUI "); } else // LUI
+    if (opcode==0b0010111) { hart->registers[rd] = (U_immediate << 12) + hart->pc; write_log(machine->logging, " AUIPC "); } else // AUIPC
+    if (opcode==0b1101111) { hart->registers[rd] = hart->pc + 0x4; hart->pc = (J_immediate_SE) + hart->pc - 0x4; write_log(machine->logging, " JAL "); } else // JAL
+    if (opcode==0b1100111) { hart->registers[rd] = hart->pc + 0x4; hart->pc = (((I_immediate_SE) + hart->registers[rs1]) & 0xFFFFFFFE) - 0x4; write_log(machine->logging, " JALR "); } else // JALR
+    if (opcode==0b1100011 && funct3==0b000) { if (hart->registers[rs1]==hart->registers[rs2]) hart->pc = ( (B_immediate_SE) + hart->pc) - 0x4; write_log(machine->logging, " BEQ "); } else // BEQ
+    if (opcode==0b1100011 && funct3==0b001) { if (hart->registers[rs1]!=hart->registers[rs2]) hart->pc = ( (B_immediate_SE) + hart->pc) - 0x4; write_log(machine->logging, " BNE "); } else // BNE
+    if (opcode==0b1100011 && funct3==0b100) { if ((int32_t)hart->registers[rs1]< (int32_t)hart->registers[rs2]) hart->pc = ((B_immediate_SE) + hart->pc) - 0x4; write_log(machine->logging, " BLT "); } else // BLT
+    if (opcode==0b1100011 && funct3==0b101) { if ((int32_t)hart->registers[rs1]>=(int32_t)hart->registers[rs2]) hart->pc = ((B_immediate_SE) + hart->pc) - 0x4; write_log(machine->logging, " BGE "); } else // BGE
+    if (opcode==0b1100011 && funct3==0b110) { if (hart->registers[rs1]<hart->registers[rs2]) hart->pc = ( (B_immediate_SE) + hart->pc) - 0x4; write_log(machine->logging, " BLTU ");  } else // BLTU
+    if (opcode==0b1100011 && funct3==0b111) { if (hart->registers[rs1]>=hart->registers[rs2]) hart->pc = ( (B_immediate_SE) + hart->pc) - 0x4; write_log(machine->logging, " BGTU "); } else // BGTU
     if (opcode==0b0000011 && funct3==0b000) {
-      addr_t addr = (I_immediate_SE)+machine->registers[rs1];
-      uint32_t data = (riscv_load(machine, addr) >> ((addr % 4) * 8)) & 0xFF;
-      machine->registers[rd] = data & 0x80 ? 0xFFFFFF00 | data : data; write_log(machine->logging, " LB "); // LB
+      addr_t addr = (I_immediate_SE)+hart->registers[rs1];
+      uint32_t data = (riscv_load(hart, addr) >> ((addr % 4) * 8)) & 0xFF;
+      hart->registers[rd] = data & 0x80 ? 0xFFFFFF00 | data : data; write_log(machine->logging, " LB "); // LB
     } else 
     if (opcode==0b0000011 && funct3==0b001) {
-      addr_t addr = (I_immediate_SE)+machine->registers[rs1];
-      machine->registers[rd] = (riscv_load(machine, addr) & 0x8000) ? 0xFFFF0000| (riscv_load(machine,addr) >> ((addr%4) * 8)) : ((riscv_load(machine,addr) >> ((addr%4) * 8)) & 0xFFFF); write_log(machine->logging, " LH ");
+      addr_t addr = (I_immediate_SE)+hart->registers[rs1];
+      hart->registers[rd] = (riscv_load(hart, addr) & 0x8000) ? 0xFFFF0000| (riscv_load(hart,addr) >> ((addr%4) * 8)) : ((riscv_load(hart,addr) >> ((addr%4) * 8)) & 0xFFFF); write_log(machine->logging, " LH ");
     } else // LH
-    if (opcode==0b0000011 && funct3==0b010) { machine->registers[rd] = riscv_load(machine, (I_immediate_SE)+machine->registers[rs1]); write_log(machine->logging, " LW "); } else // LW
+    if (opcode==0b0000011 && funct3==0b010) { hart->registers[rd] = riscv_load(hart, (I_immediate_SE)+hart->registers[rs1]); write_log(machine->logging, " LW "); } else // LW
     if (opcode==0b0000011 && funct3==0b100) {
-      addr_t addr = (I_immediate_SE)+machine->registers[rs1];
-      uint32_t data = (riscv_load(machine, addr) >> ((addr % 4) * 8)) & 0xFF;
-      machine->registers[rd] = data; write_log(machine->logging, " LBU "); // LBU
+      addr_t addr = (I_immediate_SE)+hart->registers[rs1];
+      uint32_t data = (riscv_load(hart, addr) >> ((addr % 4) * 8)) & 0xFF;
+      hart->registers[rd] = data; write_log(machine->logging, " LBU "); // LBU
     } else 
-    if (opcode==0b0000011 && funct3==0b101) { machine->registers[rd] = riscv_load(machine, (I_immediate_SE)+machine->registers[rs1]) >> ((((I_immediate_SE)+machine->registers[rs1])%4) * 8) & 0x0000FFFF; write_log(machine->logging, " LHU "); } else // LHU
-    if (opcode==0b0100011 && funct3==0b000) {
-      addr_t addr = (S_immediate_SE)+machine->registers[rs1];
-      word_t data = (riscv_load(machine,addr));
-      word_t shamt = (addr % 4) * 8;
-      riscv_store(machine, addr, (data & (0xFFFFFFFF ^ (0xFF << shamt))) | (((machine->registers[rs2]&0xFF) << shamt))); write_log(machine->logging, " SB ");
-    } else // SB
-    if (opcode==0b0100011 && funct3==0b001) { riscv_store(machine,(S_immediate_SE)+machine->registers[rs1], (riscv_load(machine,(S_immediate_SE)+machine->registers[rs1])&0xFFFF0000) | (machine->registers[rs2]&0xFFFF)); write_log(machine->logging, " SH "); } else // SH
-    if (opcode==0b0100011 && funct3==0b010) { riscv_store(machine,(S_immediate_SE)+machine->registers[rs1], machine->registers[rs2]); write_log(machine->logging, " SW "); } else // SW
-    if (opcode==0b0010011 && funct3==0b000) { machine->registers[rd] = (I_immediate_SE) + machine->registers[rs1]; write_log(machine->logging, " ADDI "); } else // ADDI
-    if (opcode==0b0010011 && funct3==0b010) { if ((int32_t)machine->registers[rs1] < ((int32_t)(I_immediate_SE))) machine->registers[rd]=1; else machine->registers[rd]=0; write_log(machine->logging, " SLTI "); } else // SLTI
-    if (opcode==0b0010011 && funct3==0b011) { if (machine->registers[rs1] < (I_immediate_SE)) machine->registers[rd]=1; else machine->registers[rd]=0; write_log(machine->logging, " SLTIU "); } else // SLTIU
-    if (opcode==0b0010011 && funct3==0b100) { machine->registers[rd] = machine->registers[rs1] ^ (I_immediate_SE); write_log(machine->logging, " XORI "); } else // XORI
-    if (opcode==0b0010011 && funct3==0b110) { machine->registers[rd] = machine->registers[rs1] | (I_immediate_SE); write_log(machine->logging, " ORI "); } else // ORI
-    if (opcode==0b0010011 && funct3==0b111) { machine->registers[rd] = machine->registers[rs1] & (I_immediate_SE); write_log(machine->logging, " ANDI "); } else // ANDI
-    if (opcode==0b0010011 && funct3==0b001 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] << shamt; write_log(machine->logging, " SLLI "); } else // SLLI
-    if (opcode==0b0010011 && funct3==0b101 && funct7==0b0100000) {machine->registers[rd]=machine->registers[rs1]; temp=machine->registers[rs1]&0x80000000; while (shamt>0) { machine->registers[rd]=(machine->registers[rd]>>1)|temp; shamt--;} write_log(machine->logging, " SRAI "); } else // SRAI
-    if (opcode==0b0010011 && funct3==0b101 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] >> shamt; write_log(machine->logging, " SRLI "); } else // SRLI
-    if (opcode==0b0110011 && funct3==0b000 && funct7==0b0000001) { machine->registers[rd] = (int32_t)machine->registers[rs1] * (int32_t)machine->registers[rs2]; write_log(machine->logging, " MUL "); } else // MUL
-    if (opcode==0b0110011 && funct3==0b100 && funct7==0b0000001) { machine->registers[rd] = (int32_t)machine->registers[rs1] / (int32_t)machine->registers[rs2]; write_log(machine->logging, " DIV "); } else // DIV
+    if (opcode==0b0000011 && funct3==0b101) { hart->registers[rd] = riscv_load(hart, (I_immediate_SE)+hart->registers[rs1]) >> ((((I_immediate_SE)+hart->registers[rs1])%4) * 8) & 0x0000FFFF; write_log(machine->logging, " LHU "); } else // LHU
+    if (opcode==0b0100011 && funct3==0b000) { riscv_store_byte(hart, (S_immediate_SE)+hart->registers[rs1], hart->registers[rs2] & 0xFF); write_log(machine->logging, " SB "); } else // SB
+    if (opcode==0b0100011 && funct3==0b001) { riscv_store_half(hart, (S_immediate_SE)+hart->registers[rs1], hart->registers[rs2] & 0xFFFF); write_log(machine->logging, " SH "); } else // SH
+    if (opcode==0b0100011 && funct3==0b010) { riscv_store(hart,(S_immediate_SE)+hart->registers[rs1], hart->registers[rs2]); write_log(machine->logging, " SW "); } else // SW
+    if (opcode==0b0010011 && funct3==0b000) { hart->registers[rd] = (I_immediate_SE) + hart->registers[rs1]; write_log(machine->logging, " ADDI "); } else // ADDI
+    if (opcode==0b0010011 && funct3==0b010) { if ((int32_t)hart->registers[rs1] < ((int32_t)(I_immediate_SE))) hart->registers[rd]=1; else hart->registers[rd]=0; write_log(machine->logging, " SLTI "); } else // SLTI
+    if (opcode==0b0010011 && funct3==0b011) { if (hart->registers[rs1] < (I_immediate_SE)) hart->registers[rd]=1; else hart->registers[rd]=0; write_log(machine->logging, " SLTIU "); } else // SLTIU
+    if (opcode==0b0010011 && funct3==0b100) { hart->registers[rd] = hart->registers[rs1] ^ (I_immediate_SE); write_log(machine->logging, " XORI "); } else // XORI
+    if (opcode==0b0010011 && funct3==0b110) { hart->registers[rd] = hart->registers[rs1] | (I_immediate_SE); write_log(machine->logging, " ORI "); } else // ORI
+    if (opcode==0b0010011 && funct3==0b111) { hart->registers[rd] = hart->registers[rs1] & (I_immediate_SE); write_log(machine->logging, " ANDI "); } else // ANDI
+    if (opcode==0b0010011 && funct3==0b001 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] << shamt; write_log(machine->logging, " SLLI "); } else // SLLI
+    if (opcode==0b0010011 && funct3==0b101 && funct7==0b0100000) {hart->registers[rd]=hart->registers[rs1]; temp=hart->registers[rs1]&0x80000000; while (shamt>0) { hart->registers[rd]=(hart->registers[rd]>>1)|temp; shamt--;} write_log(machine->logging, " SRAI "); } else // SRAI
+    if (opcode==0b0010011 && funct3==0b101 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] >> shamt; write_log(machine->logging, " SRLI "); } else // SRLI
+    if (opcode==0b0110011 && funct3==0b000 && funct7==0b0000001) { hart->registers[rd] = (int32_t)hart->registers[rs1] * (int32_t)hart->registers[rs2]; write_log(machine->logging, " MUL "); } else // MUL
+    if (opcode==0b0110011 && funct3==0b100 && funct7==0b0000001) { hart->registers[rd] = (int32_t)hart->registers[rs1] / (int32_t)hart->registers[rs2]; write_log(machine->logging, " DIV "); } else // DIV
 
     if (opcode==0b0110011 && funct3==0b110 && funct7==0b0000001) {
-      int32_t r = (int32_t)machine->registers[rs1] % (int32_t)machine->registers[rs2];
-      r         = (r + (int32_t)machine->registers[rs2]) % (int32_t)machine->registers[rs2];
-      machine->registers[rd] = r;
+      int32_t r = (int32_t)hart->registers[rs1] % (int32_t)hart->registers[rs2];
+      r         = (r + (int32_t)hart->registers[rs2]) % (int32_t)hart->registers[rs2];
+      hart->registers[rd] = r;
       write_log(machine->logging, " REM ");
     } else // REM
-    if (opcode==0b0110011 && funct3==0b000 && funct7==0b0100000) { machine->registers[rd] = machine->registers[rs1] - machine->registers[rs2]; write_log(machine->logging, " SUB "); } else // SUB
-    if (opcode==0b0110011 && funct3==0b000 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] + machine->registers[rs2]; write_log(machine->logging, " ADD "); } else // ADD
-    if (opcode==0b0110011 && funct3==0b001 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] << (machine->registers[rs2]&0x1F); write_log(machine->logging, " SLL "); } else // SLL
-    if (opcode==0b0110011 && funct3==0b010 && funct7==0b0000000) { if ((int32_t)machine->registers[rs1] < (int32_t)machine->registers[rs2]) machine->registers[rd]=1; else machine->registers[rd]=0; write_log(machine->logging, " SLT "); } else // SLT
-    if (opcode==0b0110011 && funct3==0b011 && funct7==0b0000000) { if (machine->registers[rs1] < machine->registers[rs2]) machine->registers[rd]=1; else machine->registers[rd]=0; write_log(machine->logging, " SLTU "); } else // SLTU
-    if (opcode==0b0110011 && funct3==0b100 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] ^ machine->registers[rs2]; write_log(machine->logging, " XOR "); } else // XOR
-    if (opcode==0b0110011 && funct3==0b101 && funct7==0b0100000) { machine->registers[rd] = machine->registers[rs1]; shamt=(machine->registers[rs2]&0x1F); temp=machine->registers[rs1]&0x80000000; while (shamt>0) { machine->registers[rd]=(machine->registers[rd]>>1)|temp; shamt--;} write_log(machine->logging, " SRA "); } else // SRA
-    if (opcode==0b0110011 && funct3==0b101 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] >> (machine->registers[rs2]&0x1F); write_log(machine->logging, " SRL "); } else // SRL
-    if (opcode==0b0110011 && funct3==0b110 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] | machine->registers[rs2]; write_log(machine->logging, " OR "); } else // OR
-    if (opcode==0b0110011 && funct3==0b111 && funct7==0b0000000) { machine->registers[rd] = machine->registers[rs1] & machine->registers[rs2]; write_log(machine->logging, " AND "); } else // AND
+    if (opcode==0b0110011 && funct3==0b000 && funct7==0b0100000) { hart->registers[rd] = hart->registers[rs1] - hart->registers[rs2]; write_log(machine->logging, " SUB "); } else // SUB
+    if (opcode==0b0110011 && funct3==0b000 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] + hart->registers[rs2]; write_log(machine->logging, " ADD "); } else // ADD
+    if (opcode==0b0110011 && funct3==0b001 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] << (hart->registers[rs2]&0x1F); write_log(machine->logging, " SLL "); } else // SLL
+    if (opcode==0b0110011 && funct3==0b010 && funct7==0b0000000) { if ((int32_t)hart->registers[rs1] < (int32_t)hart->registers[rs2]) hart->registers[rd]=1; else hart->registers[rd]=0; write_log(machine->logging, " SLT "); } else // SLT
+    if (opcode==0b0110011 && funct3==0b011 && funct7==0b0000000) { if (hart->registers[rs1] < hart->registers[rs2]) hart->registers[rd]=1; else hart->registers[rd]=0; write_log(machine->logging, " SLTU "); } else // SLTU
+    if (opcode==0b0110011 && funct3==0b100 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] ^ hart->registers[rs2]; write_log(machine->logging, " XOR "); } else // XOR
+    if (opcode==0b0110011 && funct3==0b101 && funct7==0b0100000) { hart->registers[rd] = hart->registers[rs1]; shamt=(hart->registers[rs2]&0x1F); temp=hart->registers[rs1]&0x80000000; while (shamt>0) { hart->registers[rd]=(hart->registers[rd]>>1)|temp; shamt--;} write_log(machine->logging, " SRA "); } else // SRA
+    if (opcode==0b0110011 && funct3==0b101 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] >> (hart->registers[rs2]&0x1F); write_log(machine->logging, " SRL "); } else // SRL
+    if (opcode==0b0110011 && funct3==0b110 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] | hart->registers[rs2]; write_log(machine->logging, " OR "); } else // OR
+    if (opcode==0b0110011 && funct3==0b111 && funct7==0b0000000) { hart->registers[rd] = hart->registers[rs1] & hart->registers[rs2]; write_log(machine->logging, " AND "); } else // AND
     if (opcode==0b1110011 && funct3==0b000 && (I_immediate_SE)==0) { printf("ECALL\n"); } else // ECALL, which just gets treated as ebreak at the moment
     if (opcode==0b1110011 && funct3==0b000 && (I_immediate_SE)==1) { printf("EBREAK\n"); } else // EBREAK
-    if (opcode==0b1110011 && funct3==0b010)                      { machine->registers[rd] = machine->CSR[instruction>>20]; write_log(machine->logging, " CSRRS "); } // CSRRS
+    if (opcode==0b1110011 && funct3==0b010)                      { hart->registers[rd] = hart->CSR[instruction>>20]; write_log(machine->logging, " CSRRS "); } else // CSRRS
+    if (opcode==0b0101111 && funct3==0b010) { hart->registers[rd] = riscv_amo(hart, funct7 >> 2, hart->registers[rs1], hart->registers[rs2]); write_log(machine->logging, " AMO.W "); } else // LR/SC/AMO
+    if (opcode==0b0001111)                  { __atomic_thread_fence(__ATOMIC_SEQ_CST); write_log(machine->logging, " FENCE "); } // FENCE
     else write_log(machine->logging, " **INVALID** ");
 
-    machine->pc = machine->pc + 0x4;
-    machine->registers[0]=0;
-    machine->num_insts++;
-    if (machine->CSR[0xC00] == UINT_MAX) {
-      machine->CSR[0xC80]++;
-      machine->CSR[0xC00] = 0;
+    hart->pc = hart->pc + 0x4;
+    hart->registers[0]=0;
+    hart->num_insts++;
+    if (hart->CSR[0xC00] == UINT_MAX) {
+      hart->CSR[0xC80]++;
+      hart->CSR[0xC00] = 0;
     } else {
-      machine->CSR[0xC00]++;
+      hart->CSR[0xC00]++;
     }
 
     switch (insttype) {
@@ -222,14 +248,14 @@ bool riscv_execute(CPU *machine, uint32_t cycles) {
         break;
       case 3:
         write_log(machine->logging, "x%d %d(x%d)\n", rs2, S_immediate_SE, rs1);
-        write_log(machine->logging, "Write to address %x with value 0x%x\n", (machine->registers[rs1] + (S_immediate_SE)), machine->registers[rs2]);
-        if (machine->registers[rs1] + (S_immediate_SE) == 0xffffffc4) { // subtract LED write from num_insts
-          machine->num_insts -= 3;
-          if (machine->registers[rs2] > 0xffff) machine->num_insts--; // requires LUI, so remove one additional write
+        write_log(machine->logging, "Write to address %x with value 0x%x\n", (hart->registers[rs1] + (S_immediate_SE)), hart->registers[rs2]);
+        if (hart->registers[rs1] + (S_immediate_SE) == 0xffffffc4) { // subtract LED write from num_insts
+          hart->num_insts -= 3;
+          if (hart->registers[rs2] > 0xffff) hart->num_insts--; // requires LUI, so remove one additional write
         }
 
-        if ((S_immediate_SE) + machine->registers[rs1] == machine->watch_mem) {
-          printf("Write to address %x with value 0x%x\n", (S_immediate_SE) + machine->registers[rs1], machine->registers[rs2]);
+        if ((S_immediate_SE) + hart->registers[rs1] == machine->watch_mem) {
+          printf("Write to address %x with value 0x%x\n", (S_immediate_SE) + hart->registers[rs1], hart->registers[rs2]);
           return true; // enter debug mode
         }
         break;
@@ -245,25 +271,124 @@ bool riscv_execute(CPU *machine, uint32_t cycles) {
         break;
       case 7:
         if (funct3 == 0b000) {
-          machine->num_insts--;
+          hart->num_insts--;
           return true;
         } else {
           write_log(machine->logging, "x%d x%d %d\n", rd, rs1, I_immediate_SE);
         }
         break;
+      case 8:
+        write_log(machine->logging, "\n");
+        break;
       default: printf("invalid insttype\n"); printf(" [%08x]", instruction); terminate = true;
     }
     //printf("Memory: "); for (int i=0; i<7; i++) { printf("Addr%d:%x ",i,machine->RAM[i]); } printf("\n");
     if (machine->logging) {
-      //write_log(machine->logging, "Regs:\n"); for (int i=0; i<32; i++) { if (machine->registers[i] != 0) write_log(machine->logging, "x%d: 0x%x\n",i,machine->registers[i]); } write_log(machine->logging, "\n");
-      write_log(machine->logging, "Regs changed:\nx%d: 0x%x\n\n", rd, machine->registers[rd]);
+      //write_log(machine->logging, "Regs:\n"); for (int i=0; i<32; i++) { if (hart->registers[i] != 0) write_log(machine->logging, "x%d: 0x%x\n",i,hart->registers[i]); } write_log(machine->logging, "\n");
+      write_log(machine->logging, "Regs changed:\nx%d: 0x%x\n\n", rd, hart->registers[rd]);
     }
 
     if (terminate) {
       printf("Instruction: 0x%08x", instruction);
-      printf("PC: 0x%08x", machine->pc);
+      printf("PC: 0x%08x", hart->pc);
       riscv_print_trace(machine); exit(1);
     }
   }
   return false;
 }
+
+bool riscv_execute(CPU *machine, uint32_t cycles) {
+  uint32_t ran;
+  if (machine->num_harts == 1) {
+    return hart_execute(&machine->harts[0], cycles, &ran);
+  }
+
+  if (machine->insts_per_ms) {
+    // Deterministic: no threads, run the harts one after the other.
+    bool ebreak = hart_execute(&machine->harts[0], cycles, &ran);
+    for (uint32_t i = 1; i < machine->num_harts; i++) {
+      if (!machine->harts[i].parked) {
+        hart_execute(&machine->harts[i], cycles, &ran);
+      }
+    }
+    return ebreak;
+  }
+
+  // Hand the same budget to every secondary hart, run the boot hart on
+  // this thread and wait until the others are done as well, so that all
+  // harts advance in step with the frames.
+  pthread_mutex_lock(&machine->sched_lock);
+  machine->sched_cycles = cycles;
+  machine->sched_pending = machine->num_harts - 1;
+  machine->sched_boot_done = false;
+  machine->sched_generation++;
+  pthread_cond_broadcast(&machine->sched_cond);
+  pthread_mutex_unlock(&machine->sched_lock);
+
+  bool ebreak = hart_execute(&machine->harts[0], cycles, &ran);
+
+  pthread_mutex_lock(&machine->sched_lock);
+  machine->sched_boot_done = true;
+  pthread_cond_broadcast(&machine->sched_cond);
+  while (machine->sched_pending > 0) {
+    pthread_cond_wait(&machine->sched_cond, &machine->sched_lock);
+  }
+  pthread_mutex_unlock(&machine->sched_lock);
+  return ebreak;
+}
+
+static void *hart_thread(void *arg) {
+  Hart *hart = arg;
+  CPU *machine = hart->machine;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&machine->sched_lock);
+  for (;;) {
+    while (machine->sched_generation == seen) {
+      pthread_cond_wait(&machine->sched_cond, &machine->sched_lock);
+    }
+    seen = machine->sched_generation;
+    uint32_t left = machine->sched_cycles;
+    while (!hart->parked && left > 0) {
+      pthread_mutex_unlock(&machine->sched_lock);
+      uint32_t ran;
+      hart_execute(hart, left, &ran);
+      left -= ran;
+      pthread_mutex_lock(&machine->sched_lock);
+      if (left > 0) {
+        // Idle: sleep until an IPI arrives or the boot hart is through
+        // with its budget.
+        while (__atomic_load_n(&hart->mailbox, __ATOMIC_ACQUIRE) == 0 &&
+               !machine->sched_boot_done) {
+          pthread_cond_wait(&machine->sched_cond, &machine->sched_lock);
+        }
+        if (machine->sched_boot_done) {
+          break;
+        }
+      }
+    }
+    machine->sched_pending--;
+    pthread_cond_broadcast(&machine->sched_cond);
+  }
+  return NULL;
+}
+
+void riscv_set_harts(CPU *machine, uint32_t count) {
+  if (count < 1 || count > MaxHarts || machine->num_harts != 1) {
+    return;
+  }
+  Hart *harts = realloc(machine->harts, count * sizeof(Hart));
+  if (harts == NULL)
+    exit(2);
+  machine->harts = harts;
+  for (uint32_t i = 1; i < count; i++) {
+    hart_init(machine, &machine->harts[i], i);
+  }
+  machine->num_harts = count;
+  for (uint32_t i = 1; i < count; i++) {
+    if (pthread_create(&machine->harts[i].thread, NULL, hart_thread, &machine->harts[i]) != 0) {
+      fprintf(stderr, "Can't start thread for hart %u\n", i);
+      exit(2);
+    }
+  }
+}
@@ -18,6 +18,12 @@
 
 CPU *riscv_new();
 
+// Start `count` harts (at most MaxHarts). Must be called before the
+// machine runs. The secondary harts run on their own host threads and
+// stay parked until the boot hart sends them a start address through
+// the IPI mailbox.
+void riscv_set_harts(CPU *machine, uint32_t count);
+
 // return whether an EBREAK was hit
 bool riscv_execute(CPU *machine, uint32_t cycles);
 
@@ -0,0 +1,282 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_OPENAT
+#endif
+
+#include <stdio.h>
+#include "hostfs.h"
+
+#ifndef HAVE_OPENAT
+
+struct RISC_HostFS *hostfs_new(const char *dirname) {
+  fprintf(stderr, "Host directories are not available on this platform.\n");
+  return NULL;
+}
+
+#else  // HAVE_OPENAT
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_HANDLES 64
+#define NAME_SIZE 32
+
+struct Entry {
+  char name[NAME_SIZE];
+  int32_t length;
+};
+
+struct HostFS {
+  struct RISC_HostFS hostfs;
+  int dir_fd;
+  int fds[MAX_HANDLES];
+  struct Entry *entries;  // snapshot for dir()
+  uint32_t num_entries;
+};
+
+static bool valid_name(const char *name) {
+  if (!((name[0] >= 'A' && name[0] <= 'Z') || (name[0] >= 'a' && name[0] <= 'z'))) {
+    return false;
+  }
+  for (int i = 1; name[i]; i++) {
+    char c = name[i];
+    if (i >= NAME_SIZE - 1 ||
+        !((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '.')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int fd_of(struct HostFS *fs, int32_t handle) {
+  return handle >= 0 && handle < MAX_HANDLES ? fs->fds[handle] : -1;
+}
+
+static uint32_t oberon_date(time_t t) {
+  struct tm tm;
+  if (localtime_r(&t, &tm) == NULL) {
+    return 0;
+  }
+  return (((((uint32_t)(tm.tm_year % 100) * 16 + (uint32_t)tm.tm_mon + 1) * 32 + (uint32_t)tm.tm_mday) * 32
+           + (uint32_t)tm.tm_hour) * 64 + (uint32_t)tm.tm_min) * 64 + (uint32_t)tm.tm_sec;
+}
+
+static int32_t clamp_length(off_t size) {
+  return size < INT32_MAX ? (int32_t)size : INT32_MAX;
+}
+
+static int32_t hostfs_open(const struct RISC_HostFS *hostfs, const char *name, bool create) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  struct stat st;
+
+  if (!valid_name(name)) {
+    return -1;
+  }
+  int32_t handle = 0;
+  while (handle < MAX_HANDLES && fs->fds[handle] >= 0) {
+    handle++;
+  }
+  if (handle == MAX_HANDLES) {
+    return -1;
+  }
+  // O_NONBLOCK keeps a FIFO or device in the directory from blocking the
+  // emulator in open; only regular files are kept, in blocking mode.
+  int flags = O_RDWR | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK | (create ? O_CREAT | O_TRUNC : 0);
+  int fd = openat(fs->dir_fd, name, flags, 0666);
+  if (fd < 0 && !create) {
+    fd = openat(fs->dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);  // read-only file
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+    close(fd);
+    return -1;
+  }
+  fs->fds[handle] = fd;
+  return handle;
+}
+
+static void hostfs_close(const struct RISC_HostFS *hostfs, int32_t handle) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  int fd = fd_of(fs, handle);
+  if (fd >= 0) {
+    close(fd);
+    fs->fds[handle] = -1;
+  }
+}
+
+static int32_t hostfs_read(const struct RISC_HostFS *hostfs, int32_t handle, uint32_t pos, uint8_t *buf, uint32_t len) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  int fd = fd_of(fs, handle);
+  uint32_t done = 0;
+  while (fd >= 0 && done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, (off_t)pos + done);
+    if (n <= 0) {
+      if (n < 0 && done == 0) {
+        return -1;
+      }
+      break;
+    }
+    done += (uint32_t)n;
+  }
+  return fd >= 0 ? (int32_t)done : -1;
+}
+
+static int32_t hostfs_write(const struct RISC_HostFS *hostfs, int32_t handle, uint32_t pos, const uint8_t *buf, uint32_t len) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  int fd = fd_of(fs, handle);
+  uint32_t done = 0;
+  while (fd >= 0 && done < len) {
+    ssize_t n = pwrite(fd, buf + done, len - done, (off_t)pos + done);
+    if (n <= 0) {
+      return -1;
+    }
+    done += (uint32_t)n;
+  }
+  return fd >= 0 ? (int32_t)done : -1;
+}
+
+static int32_t hostfs_length(const struct RISC_HostFS *hostfs, int32_t handle) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  struct stat st;
+  int fd = fd_of(fs, handle);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    return -1;
+  }
+  return clamp_length(st.st_size);
+}
+
+static int32_t hostfs_stat(const struct RISC_HostFS *hostfs, const char *name, uint32_t *date) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  struct stat st;
+  if (!valid_name(name) || fstatat(fs->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  *date = oberon_date(st.st_mtime);
+  return clamp_length(st.st_size);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return strcmp(((const struct Entry *)a)->name, ((const struct Entry *)b)->name);
+}
+
+// Takes a sorted snapshot of the visible files.
+static void scan(struct HostFS *fs) {
+  struct stat st;
+  uint32_t cap = 0;
+
+  free(fs->entries);
+  fs->entries = NULL;
+  fs->num_entries = 0;
+  int fd = dup(fs->dir_fd);
+  DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+  if (dir == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  rewinddir(dir);
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    if (!valid_name(de->d_name) || fstatat(fs->dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (fs->num_entries == cap) {
+      cap = cap ? cap * 2 : 64;
+      struct Entry *entries = realloc(fs->entries, cap * sizeof(*entries));
+      if (entries == NULL) {
+        break;
+      }
+      fs->entries = entries;
+    }
+    struct Entry *e = &fs->entries[fs->num_entries++];
+    strcpy(e->name, de->d_name);
+    e->length = clamp_length(st.st_size);
+  }
+  closedir(dir);
+  if (fs->num_entries > 0) {
+    qsort(fs->entries, fs->num_entries, sizeof(*fs->entries), compare_entries);
+  }
+}
+
+static int32_t hostfs_dir(const struct RISC_HostFS *hostfs, uint32_t index, char *name, uint32_t size) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  if (index == 0) {
+    scan(fs);
+  }
+  if (index >= fs->num_entries || strlen(fs->entries[index].name) >= size) {
+    return -1;
+  }
+  strcpy(name, fs->entries[index].name);
+  return fs->entries[index].length;
+}
+
+static int32_t hostfs_remove(const struct RISC_HostFS *hostfs, const char *name) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  struct stat st;
+  if (!valid_name(name) || fstatat(fs->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  return unlinkat(fs->dir_fd, name, 0) == 0 ? 0 : -1;
+}
+
+static int32_t hostfs_rename(const struct RISC_HostFS *hostfs, const char *from, const char *to) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  struct stat st;
+  if (!valid_name(from) || !valid_name(to) ||
+      fstatat(fs->dir_fd, from, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  return renameat(fs->dir_fd, from, fs->dir_fd, to) == 0 ? 0 : -1;
+}
+
+// Handles the guest didn't close (after a trap, or File objects that
+// were just dropped) are only given back here.
+static void hostfs_reset(const struct RISC_HostFS *hostfs) {
+  struct HostFS *fs = (struct HostFS *)hostfs;
+  for (int32_t handle = 0; handle < MAX_HANDLES; handle++) {
+    hostfs_close(hostfs, handle);
+  }
+  free(fs->entries);
+  fs->entries = NULL;
+  fs->num_entries = 0;
+}
+
+struct RISC_HostFS *hostfs_new(const char *dirname) {
+  int dir_fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return NULL;
+  }
+  struct HostFS *fs = calloc(1, sizeof(*fs));
+  if (!fs) {
+    close(dir_fd);
+    return NULL;
+  }
+  fs->hostfs = (struct RISC_HostFS){
+    .open = hostfs_open,
+    .close = hostfs_close,
+    .read = hostfs_read,
+    .write = hostfs_write,
+    .length = hostfs_length,
+    .stat = hostfs_stat,
+    .dir = hostfs_dir,
+    .remove = hostfs_remove,
+    .rename = hostfs_rename,
+    .reset = hostfs_reset,
+  };
+  fs->dir_fd = dir_fd;
+  for (int i = 0; i < MAX_HANDLES; i++) {
+    fs->fds[i] = -1;
+  }
+  return &fs->hostfs;
+}
+
+#endif  // HAVE_OPENAT
@@ -0,0 +1,12 @@
+#ifndef HOSTFS_H
+#define HOSTFS_H
+
+#include "risc-io.h"
+
+// The regular files of a host directory, for riscv_set_hostfs().  Only
+// valid Oberon names (a letter followed by letters, digits and dots,
+// at most 31 characters) are visible, which keeps the guest inside the
+// directory; symlinks aren't followed.
+struct RISC_HostFS *hostfs_new(const char *dirname);
+
+#endif  // HOSTFS_H
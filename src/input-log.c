@@ -0,0 +1,129 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input-log.h"
+#include "sdl-ps2.h"
+
+// One event per line:
+//   <count> key <hex byte>...
+//   <count> move <x> <y>
+//   <count> button <n> <0|1>
+//   <count> reset
+// preceded by a "# quantum <n>" line giving the slice size the log was
+// recorded with; input only lands on slice boundaries, so a replay
+// with a different slice size would not match.
+
+struct InputLog {
+  FILE *file;
+  bool replay;
+  char line[256];
+  bool have_line;
+  uint64_t next;  // count of the buffered line
+};
+
+static void read_next(struct InputLog *log) {
+  log->have_line = false;
+  while (fgets(log->line, sizeof(log->line), log->file)) {
+    if (log->line[0] != '#' && sscanf(log->line, "%" SCNu64, &log->next) == 1) {
+      log->have_line = true;
+      return;
+    }
+  }
+}
+
+struct InputLog *input_log_record(const char *filename, uint32_t quantum) {
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) {
+    perror("Can't create input log");
+    return NULL;
+  }
+  struct InputLog *log = calloc(1, sizeof(*log));
+  log->file = f;
+  fprintf(f, "# quantum %u\n", quantum);
+  return log;
+}
+
+struct InputLog *input_log_replay(const char *filename, uint32_t quantum) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror("Can't open input log");
+    return NULL;
+  }
+  struct InputLog *log = calloc(1, sizeof(*log));
+  log->file = f;
+  log->replay = true;
+  uint32_t recorded;
+  if (fgets(log->line, sizeof(log->line), f) &&
+      sscanf(log->line, "# quantum %u", &recorded) == 1 && recorded != quantum) {
+    fprintf(stderr, "Input log was recorded with %u instructions per slice, not %u; "
+            "the replay will diverge.\n", recorded, quantum);
+  }
+  read_next(log);
+  return log;
+}
+
+bool input_log_is_replay(const struct InputLog *log) {
+  return log->replay;
+}
+
+void input_log_key(struct InputLog *log, uint64_t when, const uint8_t *scancodes, uint32_t len) {
+  fprintf(log->file, "%" PRIu64 " key", when);
+  for (uint32_t i = 0; i < len; i++) {
+    fprintf(log->file, " %02x", scancodes[i]);
+  }
+  fputc('\n', log->file);
+}
+
+void input_log_mouse_moved(struct InputLog *log, uint64_t when, int x, int y) {
+  fprintf(log->file, "%" PRIu64 " move %d %d\n", when, x, y);
+}
+
+void input_log_mouse_button(struct InputLog *log, uint64_t when, int button, bool down) {
+  fprintf(log->file, "%" PRIu64 " button %d %d\n", when, button, down);
+}
+
+void input_log_reset(struct InputLog *log, uint64_t when) {
+  fprintf(log->file, "%" PRIu64 " reset\n", when);
+}
+
+void input_log_feed(struct InputLog *log, CPU *machine, uint64_t now) {
+  while (log->have_line && log->next <= now) {
+    char kind[16];
+    int n;
+    if (sscanf(log->line, "%*[0-9] %15s %n", kind, &n) == 1) {
+      const char *args = log->line + n;
+      if (strcmp(kind, "key") == 0) {
+        uint8_t scancodes[MAX_PS2_CODE_LEN];
+        uint32_t len = 0;
+        unsigned byte;
+        int used;
+        while (len < MAX_PS2_CODE_LEN && sscanf(args, "%x%n", &byte, &used) == 1) {
+          scancodes[len++] = (uint8_t)byte;
+          args += used;
+        }
+        riscv_keyboard_input(machine, scancodes, len);
+      } else if (strcmp(kind, "move") == 0) {
+        int x, y;
+        if (sscanf(args, "%d %d", &x, &y) == 2) {
+          riscv_mouse_moved(machine, x, y);
+        }
+      } else if (strcmp(kind, "button") == 0) {
+        int button, down;
+        if (sscanf(args, "%d %d", &button, &down) == 2) {
+          riscv_mouse_button(machine, button, down != 0);
+        }
+      } else if (strcmp(kind, "reset") == 0) {
+        riscv_reset(machine);
+      }
+    }
+    read_next(log);
+  }
+}
+
+void input_log_close(struct InputLog *log) {
+  if (log) {
+    fclose(log->file);
+    free(log);
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef INPUT_LOG_H
+#define INPUT_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "emu/cpu.h"
+
+// Journal of guest input, keyed by the boot hart's retired instruction
+// count.  Recorded in deterministic mode and replayed at exactly the
+// same counts, it makes a whole session reproducible.
+struct InputLog;
+
+struct InputLog *input_log_record(const char *filename, uint32_t quantum);
+struct InputLog *input_log_replay(const char *filename, uint32_t quantum);
+bool input_log_is_replay(const struct InputLog *log);
+
+void input_log_key(struct InputLog *log, uint64_t when, const uint8_t *scancodes, uint32_t len);
+void input_log_mouse_moved(struct InputLog *log, uint64_t when, int x, int y);
+void input_log_mouse_button(struct InputLog *log, uint64_t when, int button, bool down);
+void input_log_reset(struct InputLog *log, uint64_t when);
+
+// Replay every event recorded at or before instruction count `now`.
+void input_log_feed(struct InputLog *log, CPU *machine, uint64_t now);
+
+void input_log_close(struct InputLog *log);
+
+#endif  // INPUT_LOG_H
@@ -0,0 +1,164 @@
+#include <SDL.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+
+#define MAX_PENDING 256
+#define STALE_MS 1000
+
+enum Stage {
+  STAGE_STORE,    // input -> first framebuffer store
+  STAGE_UPLOAD,   // store -> texture upload
+  STAGE_PRESENT,  // upload -> SDL_RenderPresent
+  STAGE_TOTAL,    // input -> SDL_RenderPresent
+  NUM_STAGES
+};
+
+static const char *stage_names[NUM_STAGES] = {
+  "input -> store", "store -> upload", "upload -> present", "input -> present"
+};
+
+struct Pending {
+  uint64_t input, store, upload;  // performance counter, 0 = not yet
+};
+
+struct Samples {
+  uint32_t *us;
+  size_t count, capacity;
+};
+
+struct Latency {
+  struct RISC_Probe probe;
+  uint64_t freq;
+
+  // Ring of inputs that haven't been presented yet, oldest first.
+  struct Pending pending[MAX_PENDING];
+  int first, count;
+
+  struct Samples samples[NUM_STAGES];
+  uint64_t dropped;  // no visible change, or pushed out of the ring
+};
+
+static void framebuffer_store(const struct RISC_Probe *probe);
+
+struct Latency *latency_new(void) {
+  struct Latency *latency = calloc(1, sizeof(*latency));
+  if (latency == NULL) {
+    return NULL;
+  }
+  latency->probe.framebuffer_store = framebuffer_store;
+  latency->freq = SDL_GetPerformanceFrequency();
+  return latency;
+}
+
+void latency_free(struct Latency *latency) {
+  if (latency) {
+    for (int i = 0; i < NUM_STAGES; i++) {
+      free(latency->samples[i].us);
+    }
+    free(latency);
+  }
+}
+
+const struct RISC_Probe *latency_probe(struct Latency *latency) {
+  return &latency->probe;
+}
+
+static struct Pending *pending_at(struct Latency *latency, int i) {
+  return &latency->pending[(latency->first + i) % MAX_PENDING];
+}
+
+static void add_sample(struct Latency *latency, enum Stage stage, uint64_t from, uint64_t to) {
+  struct Samples *s = &latency->samples[stage];
+  if (s->count == s->capacity) {
+    size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+    uint32_t *us = realloc(s->us, capacity * sizeof(*us));
+    if (us == NULL) {
+      return;
+    }
+    s->us = us;
+    s->capacity = capacity;
+  }
+  s->us[s->count++] = (uint32_t)((to - from) * 1000000 / latency->freq);
+}
+
+void latency_input(struct Latency *latency) {
+  if (latency->count == MAX_PENDING) {
+    latency->first = (latency->first + 1) % MAX_PENDING;
+    latency->count--;
+    latency->dropped++;
+  }
+  *pending_at(latency, latency->count++) = (struct Pending){
+    .input = SDL_GetPerformanceCounter()
+  };
+}
+
+// Called from the emulator (with the I/O lock held when there are
+// several harts), so only stamp, don't allocate.
+static void framebuffer_store(const struct RISC_Probe *probe) {
+  struct Latency *latency = (struct Latency *)probe;
+  uint64_t now = SDL_GetPerformanceCounter();
+  for (int i = 0; i < latency->count; i++) {
+    struct Pending *p = pending_at(latency, i);
+    if (p->store == 0) {
+      p->store = now;
+    }
+  }
+}
+
+void latency_upload(struct Latency *latency) {
+  uint64_t now = SDL_GetPerformanceCounter();
+  for (int i = 0; i < latency->count; i++) {
+    struct Pending *p = pending_at(latency, i);
+    if (p->store != 0 && p->upload == 0) {
+      p->upload = now;
+    }
+  }
+}
+
+void latency_present(struct Latency *latency) {
+  uint64_t now = SDL_GetPerformanceCounter();
+  uint64_t stale = latency->freq * STALE_MS / 1000;
+  int kept = 0;
+  for (int i = 0; i < latency->count; i++) {
+    struct Pending p = *pending_at(latency, i);
+    if (p.upload != 0) {
+      add_sample(latency, STAGE_STORE, p.input, p.store);
+      add_sample(latency, STAGE_UPLOAD, p.store, p.upload);
+      add_sample(latency, STAGE_PRESENT, p.upload, now);
+      add_sample(latency, STAGE_TOTAL, p.input, now);
+    } else if (p.store == 0 && now - p.input > stale) {
+      latency->dropped++;
+    } else {
+      *pending_at(latency, kept++) = p;
+    }
+  }
+  latency->count = kept;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const struct Samples *s, int pct) {
+  size_t i = (s->count * (size_t)pct + 99) / 100;
+  return s->us[i > 0 ? i - 1 : 0] / 1000.0;
+}
+
+void latency_report(struct Latency *latency, FILE *f) {
+  size_t total = latency->samples[STAGE_TOTAL].count;
+  fprintf(f, "Input latency: %zu events presented, %llu without visible change\n",
+          total, (unsigned long long)latency->dropped);
+  if (total == 0) {
+    return;
+  }
+  fprintf(f, "  %-18s %8s %8s %8s\n", "stage (ms)", "p50", "p95", "p99");
+  for (int i = 0; i < NUM_STAGES; i++) {
+    struct Samples *s = &latency->samples[i];
+    qsort(s->us, s->count, sizeof(*s->us), compare_u32);
+    fprintf(f, "  %-18s %8.2f %8.2f %8.2f\n", stage_names[i],
+            percentile(s, 50), percentile(s, 95), percentile(s, 99));
+  }
+}
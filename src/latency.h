@@ -0,0 +1,28 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include "risc-io.h"
+
+// Input-to-photon latency measurement.  Every input event is stamped
+// when it is handed to the emulator, then again at the first
+// framebuffer store the guest makes afterwards, when the damaged area
+// is uploaded to the texture and when the frame containing it is
+// presented.  Inputs that don't lead to a store within a second are
+// counted but not sampled.
+struct Latency;
+
+struct Latency *latency_new(void);
+void latency_free(struct Latency *latency);
+
+// The probe to pass to riscv_set_probe().
+const struct RISC_Probe *latency_probe(struct Latency *latency);
+
+void latency_input(struct Latency *latency);
+void latency_upload(struct Latency *latency);
+void latency_present(struct Latency *latency);
+
+// Print p50/p95/p99 of each stage, in milliseconds.
+void latency_report(struct Latency *latency, FILE *f);
+
+#endif  // LATENCY_H
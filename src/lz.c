@@ -0,0 +1,136 @@
+#include <string.h>
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static uint32_t hash4(const uint8_t *p) {
+  return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes a length that didn't fit in the token's nibble.
+static size_t put_length(uint8_t *dst, size_t op, size_t cap, size_t n) {
+  while (n >= 255) {
+    if (op >= cap) {
+      return 0;
+    }
+    dst[op++] = 255;
+    n -= 255;
+  }
+  if (op >= cap) {
+    return 0;
+  }
+  dst[op++] = (uint8_t)n;
+  return op;
+}
+
+// Emits literals followed by a match, or only literals if match_len is 0.
+static size_t put_sequence(uint8_t *dst, size_t op, size_t cap, const uint8_t *lit,
+                           size_t lit_len, size_t offset, size_t match_len) {
+  if (op >= cap) {
+    return 0;
+  }
+  size_t ml = match_len ? match_len - MIN_MATCH : 0;
+  dst[op++] = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15));
+  if (lit_len >= 15 && (op = put_length(dst, op, cap, lit_len - 15)) == 0) {
+    return 0;
+  }
+  if (cap - op < lit_len) {
+    return 0;
+  }
+  memcpy(dst + op, lit, lit_len);
+  op += lit_len;
+  if (match_len) {
+    if (cap - op < 2) {
+      return 0;
+    }
+    dst[op++] = (uint8_t)offset;
+    dst[op++] = (uint8_t)(offset >> 8);
+    if (ml >= 15 && (op = put_length(dst, op, cap, ml - 15)) == 0) {
+      return 0;
+    }
+  }
+  return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  uint32_t table[1 << HASH_BITS] = { 0 };
+  size_t ip = 0, anchor = 0, op = 0;
+  while (len >= MIN_MATCH && ip <= len - MIN_MATCH) {
+    uint32_t h = hash4(src + ip);
+    size_t ref = table[h];
+    table[h] = (uint32_t)ip;
+    if (ref < ip && ip - ref <= MAX_OFFSET && read32(src + ref) == read32(src + ip)) {
+      size_t match_len = MIN_MATCH;
+      while (ip + match_len < len && src[ref + match_len] == src[ip + match_len]) {
+        match_len++;
+      }
+      op = put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, match_len);
+      if (op == 0) {
+        return 0;
+      }
+      ip += match_len;
+      anchor = ip;
+    } else {
+      ip++;
+    }
+  }
+  return put_sequence(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+static long get_length(const uint8_t *src, size_t len, size_t *ip, size_t n) {
+  uint8_t b;
+  do {
+    if (*ip >= len) {
+      return -1;
+    }
+    b = src[(*ip)++];
+    n += b;
+  } while (b == 255);
+  return (long)n;
+}
+
+long lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  size_t ip = 0, op = 0;
+  while (ip < len) {
+    uint8_t token = src[ip++];
+    long lit_len = token >> 4;
+    if (lit_len == 15 && (lit_len = get_length(src, len, &ip, 15)) < 0) {
+      return -1;
+    }
+    if ((size_t)lit_len > len - ip || (size_t)lit_len > cap - op) {
+      return -1;
+    }
+    memcpy(dst + op, src + ip, (size_t)lit_len);
+    ip += (size_t)lit_len;
+    op += (size_t)lit_len;
+    if (ip == len) {
+      break;  // the last sequence has no match
+    }
+    if (len - ip < 2) {
+      return -1;
+    }
+    size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+    ip += 2;
+    long match_len = token & 15;
+    if (match_len == 15 && (match_len = get_length(src, len, &ip, 15)) < 0) {
+      return -1;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > op || (size_t)match_len > cap - op) {
+      return -1;
+    }
+    // Byte by byte: the match may overlap what it produces
+    for (long i = 0; i < match_len; i++, op++) {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return (long)op;
+}
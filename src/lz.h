@@ -0,0 +1,19 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A small LZ77 codec in the style of LZ4: sequences of a token byte
+// (literal count, match length), the literals, and a 16-bit backwards
+// offset.  Meant for disk image chunks, which are mostly zeros or
+// repetitive data.
+
+// Returns the compressed size, or 0 if it doesn't fit in cap bytes.
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+// Returns the decompressed size, or -1 if the input is corrupt or
+// doesn't fit in cap bytes.
+long lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif  // LZ_H
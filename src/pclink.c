@@ -1,15 +1,49 @@
 // pclink.c for Peter De Wachter's RISC emulator PDR 20.3.14
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "pclink.h"
 
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#define HAVE_INOTIFY
+#endif
+
 #define ACK 0x10
+#define NAK 0x11
 #define REC 0x21
 #define SND 0x22
+#define REC2 0x23
+#define SND2 0x24
+#define HELLO 0x25
+
+// Protocol v2 (Mods/PCLink2.Mod).  The guest announces itself with
+// HELLO and its largest block as a 4-byte number (all numbers little
+// endian, 0 to go back to v1); the reply is HELLO, the block size to
+// use and the window.  A transfer starts with
+//   REC2 name 0 length  ->  ACK | NAK                (into Oberon)
+//   SND2 name 0         ->  ACK length | NAK         (out of Oberon)
+// after which the sender streams the blocks, each seq data check,
+// with up to WINDOW of them unacknowledged.  The receiver answers
+// ACK seq for each good block and NAK seq for a bad one, upon which
+// the sender goes back to that block; blocks that aren't the expected
+// one are dropped.  The length of each block follows from the file
+// length, and check is a Fletcher-style sum over seq and data.
+// A guest that answers REC2 or SND2 with anything but ACK or NAK is
+// taken to speak v1, and so is the guest after a reset.
+#define MAX_BLOCK 65536
+#define WINDOW 4
+
+// Without inotify, look for job files on every POLL_INTERVAL-th status
+// read only.
+#define POLL_INTERVAL 4096
 
 #ifndef S_IRGRP
 #define S_IRGRP 0
@@ -31,23 +65,164 @@
 static const char * RecName = "PCLink.REC";  // e.g. echo Test.Mod > PCLink.REC
 static const char * SndName = "PCLink.SND";
 static uint8_t mode = 0;
-static int fd = -1;
 static int txcount, rxcount, fnlen, flen;
 static char szFilename[32];
 static char buf[257];
 
+// The job being worked through.  A job file lists any number of host
+// paths separated by white space, which are transferred one after the
+// other under the last component of their path.
+static const char *job;      // RecName, SndName or NULL
+static struct stat jobstat;  // to tell whether the job file was replaced
+static char *jobtext;        // the list, names get NUL-terminated as they are used
+static char *jobnext;
+static const char *hostpath;
+static bool retry;           // transfer hostpath again, the guest changed protocols
+
+// The whole file being transferred: read in one go when a REC transfer
+// starts, written in one go when a SND transfer ends.
+static uint8_t *data;
+static int dpos, dlen, dcap;
+
+enum V2State {
+  V2_IDLE,       // waiting for HELLO
+  V2_REC_REPLY,  // REC2 sent, waiting for ACK or NAK
+  V2_REC_ACKS,   // sending blocks
+  V2_SND_REPLY,  // SND2 sent, waiting for ACK and length or NAK
+  V2_SND_BLOCK,  // receiving blocks
+};
+
+static enum V2State v2state = V2_IDLE;
+static uint32_t v2block;        // negotiated block size, 0 for v1
+static uint32_t nblocks;        // of the current transfer
+static uint32_t next, acked;    // REC2: next block to send, first unacknowledged
+static uint32_t expect;         // SND2: next block to accept
+static uint8_t out[MAX_BLOCK + 64];  // bytes queued for the guest
+static int outpos, outlen;
+static uint8_t in[MAX_BLOCK + 8];    // message from the guest being collected
+static int inlen, inneed;
+
+// Set when a job file may have appeared.  Starts out set to pick up
+// jobs created before the emulator.
+static int job_hint = 1;
+
+#ifdef HAVE_INOTIFY
+static int watching = 0;
+
+static void *WatchJobs(void *arg) {
+  int ifd = (int)(intptr_t)arg;
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    ssize_t n = read(ifd, events, sizeof(events));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (char *p = events; p < events + n; ) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len > 0 && (strcmp(ev->name, RecName) == 0 || strcmp(ev->name, SndName) == 0)) {
+        __atomic_store_n(&job_hint, 1, __ATOMIC_RELEASE);
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  // Back to polling
+  close(ifd);
+  __atomic_store_n(&watching, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&job_hint, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static bool StartWatching(void) {
+  pthread_t thread;
+  int ifd = inotify_init1(IN_CLOEXEC);
+
+  if (ifd < 0) {
+    return false;
+  }
+  if (inotify_add_watch(ifd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(ifd);
+    return false;
+  }
+  watching = 1;
+  if (pthread_create(&thread, NULL, WatchJobs, (void *)(intptr_t)ifd) != 0) {
+    watching = 0;
+    close(ifd);
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+#endif
+
+// Whether to look for job files now.  With inotify the job files are
+// only looked at after they were written, so an idle link costs no
+// system calls at all.
+static bool JobHint(void) {
+  static unsigned polls = 0;
+#ifdef HAVE_INOTIFY
+  static bool started = false;
+
+  if (!started) {
+    started = true;
+    StartWatching();
+  }
+  if (__atomic_load_n(&watching, __ATOMIC_ACQUIRE)) {
+    return __atomic_load_n(&job_hint, __ATOMIC_ACQUIRE)
+      && __atomic_exchange_n(&job_hint, 0, __ATOMIC_ACQ_REL);
+  }
+#endif
+  if (__atomic_exchange_n(&job_hint, 0, __ATOMIC_ACQ_REL)) {
+    return true;
+  }
+  return ++polls % POLL_INTERVAL == 0;
+}
+
+static void EndTransfer(void) {
+  mode = 0;
+  free(data);
+  data = NULL;
+  dpos = dlen = dcap = 0;
+}
+
+static void EndJob(void) {
+  struct stat st;
+
+  // Leave a job file alone that was replaced in the meantime
+  if (stat(job, &st) == 0 && st.st_ino == jobstat.st_ino && st.st_dev == jobstat.st_dev
+      && st.st_mtime == jobstat.st_mtime && st.st_size == jobstat.st_size) {
+    unlink(job);
+  }
+  free(jobtext);
+  jobtext = jobnext = NULL;
+  job = NULL;
+  // Another job may have been waiting for this one
+  __atomic_store_n(&job_hint, 1, __ATOMIC_RELEASE);
+}
+
 static bool GetJob(const char *JobName) {
   bool res = false;
-  struct stat st;
   FILE * f;
 
-  if (stat(JobName, &st) == 0) {
-    if (st.st_size > 0 && st.st_size <= 33) {
+  if (stat(JobName, &jobstat) == 0) {
+    if (jobstat.st_size > 0 && jobstat.st_size <= 0x100000) {
       f = fopen(JobName, "r");
+      jobtext = malloc(jobstat.st_size + 1);
+      if (f && jobtext) {
+        size_t n = fread(jobtext, 1, jobstat.st_size, f);
+        jobtext[n] = 0;
+        jobnext = jobtext;
+        job = JobName;
+        res = true;
+      } else {
+        free(jobtext);
+        jobtext = NULL;
+      }
       if (f) {
-        fscanf(f, "%31s", szFilename);
         fclose(f);
-        res = true; txcount = 0; rxcount = 0; fnlen = (int)strlen(szFilename)+1;
       }
     }
     if (!res) {
@@ -57,39 +232,339 @@ static bool GetJob(const char *JobName) {
   return res;
 }
 
-static uint32_t PCLink_RStat(const struct RISC_Serial *serial) {
+static char *NextName(void) {
+  char *name;
+
+  while (*jobnext == ' ' || *jobnext == '\t' || *jobnext == '\r' || *jobnext == '\n') {
+    jobnext++;
+  }
+  if (*jobnext == 0) {
+    return NULL;
+  }
+  name = jobnext;
+  while (*jobnext && *jobnext != ' ' && *jobnext != '\t' && *jobnext != '\r' && *jobnext != '\n') {
+    jobnext++;
+  }
+  if (*jobnext) {
+    *jobnext++ = 0;
+  }
+  return name;
+}
+
+static bool ReadFile(const char *name) {
   struct stat st;
+  int fd = open(name, O_RDONLY);
+
+  if (fd == -1) {
+    return false;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < 0 || st.st_size >= 0x1000000) {
+    close(fd);
+    return false;
+  }
+  dlen = (int)st.st_size;
+  data = malloc(dlen > 0 ? dlen : 1);
+  dpos = 0;
+  while (data && dpos < dlen) {
+    ssize_t n = read(fd, data + dpos, dlen - dpos);
+    if (n <= 0) {
+      free(data);
+      data = NULL;
+    } else {
+      dpos += (int)n;
+    }
+  }
+  close(fd);
+  dpos = 0;
+  return data != NULL;
+}
 
-  if (!mode) {
-    if (GetJob(RecName)) {
-      if (stat(szFilename, &st) == 0 && st.st_size >= 0 && st.st_size < 0x1000000) {
-        fd = open(szFilename, O_RDONLY);
-        if (fd != -1) {
-          flen = (int)st.st_size; mode = REC;
-          printf("PCLink REC Filename: %s size %d\n", szFilename, flen);
+static bool WriteFile(const char *name) {
+  int fd = open(name, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  bool ok = fd != -1;
+
+  for (int pos = 0; ok && pos < dlen; ) {
+    ssize_t n = write(fd, data + pos, dlen - pos);
+    ok = n > 0;
+    pos += (int)n;
+  }
+  if (fd != -1 && close(fd) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+static bool Append(const char *bytes, int len) {
+  if (dlen + len > dcap) {
+    int cap = dcap ? dcap * 2 : 65536;
+    uint8_t *p;
+    while (cap < dlen + len) {
+      cap *= 2;
+    }
+    p = realloc(data, cap);
+    if (!p) {
+      return false;
+    }
+    data = p; dcap = cap;
+  }
+  memcpy(data + dlen, bytes, len);
+  dlen += len;
+  return true;
+}
+
+static uint32_t Get32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void Queue(const void *bytes, int len) {
+  memcpy(out + outlen, bytes, len);
+  outlen += len;
+}
+
+static void Queue32(uint32_t v) {
+  uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+  Queue(b, 4);
+}
+
+static uint32_t Checksum(const uint8_t *seq, const uint8_t *bytes, int len) {
+  uint32_t a = 1, b = 0;
+
+  for (int i = 0; i < 4; i++) {
+    a += seq[i]; b += a;
+  }
+  for (int i = 0; i < len; i++) {
+    a += bytes[i]; b += a;
+  }
+  return (b << 16) + (a & 0xFFFF);
+}
+
+static int BlockLen(uint32_t seq) {
+  int n = dlen - (int)(seq * v2block);
+  return n > (int)v2block ? (int)v2block : n;
+}
+
+static void EndV2(void) {
+  v2state = V2_IDLE;
+  inlen = 0;
+  EndTransfer();
+}
+
+// The guest answered a v2 job with something other than ACK or NAK, so
+// it doesn't speak v2 (any more).  HELLO is a new announcement to be
+// collected; anything else is PCLink1 talking.  The file is sent again
+// once that is settled.
+static void Fallback(uint8_t x) {
+  EndV2();
+  retry = true;
+  if (x == HELLO) {
+    in[inlen++] = x;
+  } else {
+    v2block = 0;
+    printf("PCLink back to v1\n");
+  }
+}
+
+// Queues the next block of a REC2 transfer once the previous one is
+// on its way and the window allows.
+static void Refill(void) {
+  if (v2state == V2_REC_ACKS && outpos == outlen && next < nblocks && next - acked < WINDOW) {
+    uint8_t seq[4] = { (uint8_t)next, (uint8_t)(next >> 8), (uint8_t)(next >> 16), (uint8_t)(next >> 24) };
+    const uint8_t *block = data + next * v2block;
+    int n = BlockLen(next);
+
+    outpos = outlen = 0;
+    Queue(seq, 4);
+    Queue(block, n);
+    Queue32(Checksum(seq, block, n));
+    next++;
+  }
+}
+
+static void V2Input(uint8_t x) {
+  uint32_t seq;
+
+  in[inlen++] = x;
+  switch (v2state) {
+    case V2_IDLE:
+      if (in[0] != HELLO) {
+        inlen = 0;
+      } else if (inlen == 5) {
+        inlen = 0;
+        v2block = Get32(in + 1) < MAX_BLOCK ? Get32(in + 1) : MAX_BLOCK;
+        if (v2block > 0) {
+          uint8_t hello = HELLO, window = WINDOW;
+          Queue(&hello, 1);
+          Queue32(v2block);
+          Queue(&window, 1);
+          printf("PCLink v2, blocks of %u bytes\n", v2block);
         }
       }
-      if (!mode) {
-        unlink(RecName);  // clean up
+      break;
+    case V2_REC_REPLY:
+      inlen = 0;
+      if (x == ACK && nblocks > 0) {
+        v2state = V2_REC_ACKS;
+        Refill();
+      } else if (x == ACK || x == NAK) {
+        EndV2();  // NAK, or nothing to send
+      } else {
+        Fallback(x);
       }
-    } else if (GetJob(SndName)) {
-      fd = open(szFilename, O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-      if (fd != -1) {
-        flen = -1; mode = SND;
-        printf("PCLink SND Filename: %s\n", szFilename);
+      break;
+    case V2_REC_ACKS:
+      if (inlen == 5) {
+        inlen = 0;
+        seq = Get32(in + 1);
+        if (in[0] == ACK && seq >= acked && seq < next) {
+          acked = seq + 1;
+          if (acked == nblocks) {
+            EndV2();
+          }
+        } else if (in[0] == NAK && seq >= acked && seq < next) {
+          next = seq;
+        }
       }
-      if (!mode) {
-        unlink(SndName);  // clean up
+      break;
+    case V2_SND_REPLY:
+      if (in[0] == NAK) {
+        EndV2();  // file not found on the Oberon side
+      } else if (in[0] != ACK) {
+        Fallback(x);
+      } else if (inlen == 5) {
+        inlen = 0;
+        flen = (int)Get32(in + 1);
+        if (flen < 0 || flen >= 0x1000000) {
+          printf("PCLink %s too large\n", szFilename);
+          EndV2();
+          break;
+        }
+        nblocks = ((uint32_t)flen + v2block - 1) / v2block;
+        expect = 0;
+        dlen = flen;
+        data = malloc(dlen > 0 ? dlen : 1);
+        v2state = V2_SND_BLOCK;
+        if (!data || nblocks == 0) {
+          if (!data || !WriteFile(hostpath)) {
+            printf("PCLink can't write %s\n", hostpath);
+          }
+          EndV2();
+        }
       }
+      break;
+    case V2_SND_BLOCK:
+      if (inlen == 4) {
+        seq = Get32(in);
+        if (seq >= nblocks) {
+          printf("PCLink protocol error\n");
+          EndV2();
+          break;
+        }
+        inneed = 4 + BlockLen(seq) + 4;
+      } else if (inlen == inneed) {
+        inlen = 0;
+        seq = Get32(in);
+        if (seq != expect) {
+          break;  // in flight after a NAK
+        }
+        if (Get32(in + inneed - 4) != Checksum(in, in + 4, inneed - 8)) {
+          Queue(&(uint8_t){NAK}, 1);
+          Queue32(seq);
+          break;
+        }
+        memcpy(data + seq * v2block, in + 4, inneed - 8);
+        Queue(&(uint8_t){ACK}, 1);
+        Queue32(seq);
+        if (++expect == nblocks) {
+          if (!WriteFile(hostpath)) {
+            printf("PCLink can't write %s\n", hostpath);
+          }
+          EndV2();
+        }
+      }
+      break;
+  }
+}
+
+// Starts the transfer of the next file of the job, or ends the job.
+static void StartNext(void) {
+  const char *path, *base;
+
+  while ((path = retry ? hostpath : NextName()) != NULL) {
+    retry = false;
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    if (*base == 0 || strlen(base) >= sizeof(szFilename)) {
+      printf("PCLink bad file name: %s\n", path);
+      continue;
+    }
+    strcpy(szFilename, base);
+    hostpath = path;
+    txcount = 0; rxcount = 0; fnlen = (int)strlen(szFilename)+1;
+    if (job == RecName) {
+      if (ReadFile(path)) {
+        flen = dlen; mode = v2block ? REC2 : REC;
+        printf("PCLink REC Filename: %s size %d\n", szFilename, flen);
+        if (mode == REC2) {
+          outpos = outlen = 0;
+          Queue(&mode, 1);
+          Queue(szFilename, fnlen);
+          Queue32((uint32_t)dlen);
+          nblocks = ((uint32_t)dlen + v2block - 1) / v2block;
+          next = acked = 0;
+          v2state = V2_REC_REPLY;
+        }
+        return;
+      }
+      printf("PCLink can't read %s\n", path);
+    } else {
+      flen = -1; mode = v2block ? SND2 : SND; dlen = 0;
+      printf("PCLink SND Filename: %s\n", szFilename);
+      if (mode == SND2) {
+        outpos = outlen = 0;
+        Queue(&mode, 1);
+        Queue(szFilename, fnlen);
+        v2state = V2_SND_REPLY;
+      }
+      return;
+    }
+  }
+  EndJob();
+}
+
+static uint32_t PCLink_RStat(const struct RISC_Serial *serial) {
+  // Not in the middle of a message from the guest either
+  if (!mode && outpos == outlen && inlen == 0) {
+    if (!job && JobHint() && !GetJob(RecName)) {
+      GetJob(SndName);
+    }
+    if (job) {
+      StartNext();
     }
   }
-  return 2 + (mode != 0);  // xmit always ready
+  Refill();
+  return 2 + (mode == REC || mode == SND || outpos < outlen);  // xmit always ready
+}
+
+// Everything queued can be read in one go, and the guest's output is
+// always taken.
+static void PCLink_Counts(const struct RISC_Serial *serial, uint32_t *avail, uint32_t *room) {
+  uint32_t status = PCLink_RStat(serial);
+  *avail = outpos < outlen ? (uint32_t)(outlen - outpos) : (status & 1);
+  *room = 0xFFFF;
 }
 
 static uint32_t PCLink_RData(const struct RISC_Serial *serial) {
   uint8_t ch = 0;
 
-  if (mode) {
+  if (outpos < outlen) {
+    ch = out[outpos++];
+    if (outpos == outlen) {
+      outpos = outlen = 0;
+      Refill();
+    }
+    return ch;
+  }
+  if (mode == REC || mode == SND) {
     if (rxcount == 0) {
       ch = mode;
     } else if (rxcount < fnlen+1) {
@@ -97,7 +572,7 @@ static uint32_t PCLink_RData(const struct RISC_Serial *serial) {
     } else if (mode == SND) {
       ch = ACK;
       if (flen == 0) {
-        mode = 0; unlink(SndName);
+        EndTransfer();
       }
     } else {
       int pos = (rxcount - fnlen - 1) % 256;
@@ -107,11 +582,11 @@ static uint32_t PCLink_RData(const struct RISC_Serial *serial) {
         } else {
           ch = (uint8_t)flen;
           if (flen == 0) {
-            mode = 0; unlink(RecName);
+            EndTransfer();
           }
         }
       } else {
-        read(fd, &ch, 1);
+        ch = data[dpos++];
         flen--;
       }
     }
@@ -122,17 +597,21 @@ static uint32_t PCLink_RData(const struct RISC_Serial *serial) {
 }
 
 static void PCLink_TData(const struct RISC_Serial *serial, uint32_t value) {
+  if (mode != REC && mode != SND) {
+    V2Input((uint8_t)value);
+    return;
+  }
   if (mode) {
     if (txcount == 0) {
-      if (value != ACK) {
-        close(fd); fd = -1;
-        if (mode == SND) {
-          unlink(szFilename);  // file not found, delete file created
-          unlink(SndName);  // clean up
-        } else {
-          unlink(RecName);  // clean up
-        }
-        mode = 0;
+      if (value == HELLO) {
+        // PCLink2 started; send the file again once it's settled
+        EndTransfer();
+        retry = true;
+        V2Input((uint8_t)value);
+        return;
+      } else if (value != ACK) {
+        // file not found on the Oberon side
+        EndTransfer();
       }
     } else if (mode == SND) {
       int lim;
@@ -141,9 +620,14 @@ static void PCLink_TData(const struct RISC_Serial *serial, uint32_t value) {
       buf[pos] = (uint8_t)value;
       lim = (unsigned char)buf[0];
       if (pos == lim) {
-        write(fd, buf+1, lim);
+        if (!Append(buf+1, lim)) {
+          flen = 0;
+        }
         if (lim < 255) {
-          flen = 0; close(fd);
+          flen = 0;
+          if (!WriteFile(hostpath)) {
+            printf("PCLink can't write %s\n", hostpath);
+          }
         }
       }
     }
@@ -151,9 +635,21 @@ static void PCLink_TData(const struct RISC_Serial *serial, uint32_t value) {
   txcount++;
 }
 
+// The guest starts over without PCLink, and speaks v1 until it says
+// HELLO again.  A file that was on its way is sent again.
+static void PCLink_Reset(const struct RISC_Serial *serial) {
+  if (mode) {
+    retry = true;
+  }
+  EndV2();
+  v2block = 0;
+  outpos = outlen = 0;
+}
 
 const struct RISC_Serial pclink = {
   .read_status = PCLink_RStat,
   .read_data = PCLink_RData,
-  .write_data = PCLink_TData
+  .write_data = PCLink_TData,
+  .counts = PCLink_Counts,
+  .reset = PCLink_Reset
 };
@@ -1,34 +1,67 @@
 #ifdef _WIN32
 
 #include <stdio.h>
+#include "raw-serial.h"
 
-struct RISC_Serial *raw_serial_new(int fd_in, int fd_out) {
+struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename_out, bool synchronous) {
   fprintf(stderr, "The --serial-fd feature is not available on Windows.\n");
   return NULL;
 }
 
+struct RISC_Serial *raw_serial_open(const char *spec) {
+  fprintf(stderr, "The --serial feature is not available on Windows.\n");
+  return NULL;
+}
+
 #else  // _WIN32
 
+#define _XOPEN_SOURCE 600
+#include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <termios.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "raw-serial.h"
+#include "serial-ring.h"
 
 struct RawSerial {
   struct RISC_Serial serial;
   int fd_in;
   int fd_out;
+  // Synchronous mode: the fds block, and whether input is available is
+  // decided by actually reading a byte ahead instead of asking select(),
+  // so the guest sees the same bytes at the same time on every run.
+  bool sync;
+  int lookahead;  // byte read ahead, or NO_BYTE / END_OF_INPUT
 };
 
+#define NO_BYTE -1
+#define END_OF_INPUT -2
+
 static int max(int a, int b) {
   return a > b ? a : b;
 }
 
+static void read_ahead(struct RawSerial *s) {
+  if (s->lookahead == NO_BYTE) {
+    uint8_t byte;
+    s->lookahead = read(s->fd_in, &byte, 1) == 1 ? byte : END_OF_INPUT;
+  }
+}
+
 static uint32_t read_status(const struct RISC_Serial *serial) {
   struct RawSerial *s = (struct RawSerial *)serial;
+  if (s->sync) {
+    read_ahead(s);
+    return (s->lookahead >= 0 ? 1 : 0) | 2;
+  }
   struct timeval tv = { 0, 0 };
   fd_set read_fds;
   fd_set write_fds;
@@ -53,6 +86,14 @@ static uint32_t read_status(const struct RISC_Serial *serial) {
 static uint32_t read_data(const struct RISC_Serial *serial) {
   struct RawSerial *s = (struct RawSerial *)serial;
   uint8_t byte = 0;
+  if (s->sync) {
+    read_ahead(s);
+    if (s->lookahead >= 0) {
+      byte = (uint8_t)s->lookahead;
+      s->lookahead = NO_BYTE;
+    }
+    return byte;
+  }
   read(s->fd_in, &byte, 1);
   return byte;
 }
@@ -63,21 +104,36 @@ static void write_data(const struct RISC_Serial *serial, uint32_t data) {
   write(s->fd_out, &byte, 1);
 }
 
-struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename_out) {
+struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename_out, bool synchronous) {
   int fd_in, fd_out;
+  int nonblock = synchronous ? 0 : O_NONBLOCK;
 
-  fd_in = open(filename_in, O_RDONLY | O_NONBLOCK);
+#ifdef __linux__
+  // Opened for writing as well, a FIFO never reports end of file when
+  // the host program on the other end closes it, and the I/O thread
+  // just waits for the next one.
+  fd_in = synchronous ? -1 : open(filename_in, O_RDWR | nonblock);
+  if (fd_in < 0)
+#endif
+  fd_in = open(filename_in, O_RDONLY | nonblock);
   if (fd_in < 0) {
     perror("Failed to open serial input file");
     goto fail1;
   }
 
-  fd_out = open(filename_out, O_RDWR | O_NONBLOCK);
+  fd_out = open(filename_out, O_RDWR | nonblock);
   if (fd_out < 0) {
     perror("Failed to open serial output file");
     goto fail2;
   }
 
+  if (!synchronous) {
+    struct RISC_Serial *ring = serial_ring_new(fd_in, fd_out);
+    if (ring) {
+      return ring;
+    }
+  }
+
   struct RawSerial *s = malloc(sizeof(*s));
   if (!s) {
     goto fail3;
@@ -90,7 +146,9 @@ struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename
       .write_data = &write_data
     },
     .fd_in = fd_in,
-    .fd_out = fd_out
+    .fd_out = fd_out,
+    .sync = synchronous,
+    .lookahead = NO_BYTE
   };
   return &s->serial;
 
@@ -102,4 +160,155 @@ struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename
   return NULL;
 }
 
+struct UnixLink {
+  struct SerialLink link;
+  struct sockaddr_un addr;
+};
+
+static int unix_connect(struct SerialLink *link) {
+  struct UnixLink *u = (struct UnixLink *)link;
+  int fd;
+
+  if (link->wait_fd >= 0) {
+    fd = accept(link->wait_fd, NULL, NULL);
+  } else {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&u->addr, sizeof(u->addr)) < 0) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      fd = -1;
+    }
+  }
+  if (fd >= 0) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+}
+
+// Connects to a program listening on path, or else listens there for
+// programs to connect, one at a time.  Either way a lost connection is
+// replaced by the next one.
+static struct RISC_Serial *unix_serial_new(const char *path) {
+  struct UnixLink *u = calloc(1, sizeof(*u));
+  struct stat st;
+
+  if (!u) {
+    return NULL;
+  }
+  if (strlen(path) >= sizeof(u->addr.sun_path)) {
+    fprintf(stderr, "Serial socket path too long: %s\n", path);
+    goto fail;
+  }
+  u->addr.sun_family = AF_UNIX;
+  strcpy(u->addr.sun_path, path);
+  u->link = (struct SerialLink){ .connect = &unix_connect, .wait_fd = -1, .socket = true };
+
+  int fd = unix_connect(&u->link);
+  if (fd < 0) {
+    // A socket nobody listens on is left over from an earlier run
+    if (errno == ECONNREFUSED && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(path);
+    }
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&u->addr, sizeof(u->addr)) < 0 || listen(lfd, 1) < 0) {
+      perror("Failed to create serial socket");
+      if (lfd >= 0) {
+        close(lfd);
+      }
+      goto fail;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+    fcntl(lfd, F_SETFD, FD_CLOEXEC);
+    u->link.wait_fd = lfd;
+    printf("Serial line listening on %s\n", path);
+  }
+
+  struct RISC_Serial *serial = serial_ring_link(&u->link, fd);
+  if (serial) {
+    return serial;
+  }
+  fprintf(stderr, "Serial sockets are not available on this platform.\n");
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (u->link.wait_fd >= 0) {
+    close(u->link.wait_fd);
+    unlink(path);
+  }
+ fail:
+  free(u);
+  return NULL;
+}
+
+// A new pseudo terminal, optionally with a symlink to it at link.
+// The emulator keeps the terminal side open itself, so programs can
+// come and go without the line hanging up, and output written while
+// nobody listens waits in the terminal's buffer.
+static struct RISC_Serial *pty_serial_new(const char *link) {
+  struct termios t;
+  struct stat st;
+  const char *name;
+  int slave = -1;
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 ||
+      (name = ptsname(master)) == NULL || (slave = open(name, O_RDWR | O_NOCTTY)) < 0) {
+    perror("Failed to create serial pseudo terminal");
+    goto fail;
+  }
+  // Raw bytes both ways, no echo
+  if (tcgetattr(slave, &t) == 0) {
+    t.c_iflag &= ~(tcflag_t)(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    t.c_oflag &= ~(tcflag_t)OPOST;
+    t.c_lflag &= ~(tcflag_t)(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(tcflag_t)(CSIZE | PARENB);
+    t.c_cflag |= CS8;
+    tcsetattr(slave, TCSANOW, &t);
+  }
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  fcntl(master, F_SETFD, FD_CLOEXEC);
+  fcntl(slave, F_SETFD, FD_CLOEXEC);
+  if (link) {
+    if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode)) {
+      unlink(link);
+    }
+    if (symlink(name, link) < 0) {
+      perror("Failed to link serial pseudo terminal");
+      goto fail;
+    }
+  }
+
+  struct RISC_Serial *serial = serial_ring_new(master, master);
+  if (serial) {
+    printf("Serial line on %s\n", name);
+    return serial;
+  }
+  fprintf(stderr, "Serial pseudo terminals are not available on this platform.\n");
+  if (link) {
+    unlink(link);
+  }
+ fail:
+  if (slave >= 0) {
+    close(slave);
+  }
+  if (master >= 0) {
+    close(master);
+  }
+  return NULL;
+}
+
+struct RISC_Serial *raw_serial_open(const char *spec) {
+  if (strncmp(spec, "unix:", 5) == 0 && spec[5] != 0) {
+    return unix_serial_new(spec + 5);
+  } else if (strcmp(spec, "pty") == 0) {
+    return pty_serial_new(NULL);
+  } else if (strncmp(spec, "pty:", 4) == 0 && spec[4] != 0) {
+    return pty_serial_new(spec + 4);
+  }
+  fprintf(stderr, "Unknown serial line: %s\n", spec);
+  return NULL;
+}
+
 #endif  // _WIN32
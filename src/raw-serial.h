@@ -1,8 +1,17 @@
 #ifndef RAW_SERIAL_H
 #define RAW_SERIAL_H
 
+#include <stdbool.h>
 #include "risc-io.h"
 
-struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename_out);
+// In synchronous mode reads and writes block, which makes the serial
+// line deterministic at the cost of stalling the emulator on slow input.
+struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename_out, bool synchronous);
+
+// Serial line given as "unix:PATH" (a Unix domain socket, connecting
+// to PATH if something listens there and listening on it otherwise),
+// "pty" or "pty:LINK" (a new pseudo terminal, LINK a symlink to it).
+// Connections can come and go while the emulator runs.
+struct RISC_Serial *raw_serial_open(const char *spec);
 
 #endif  // SERIAL_H
@@ -1,6 +1,7 @@
 #ifndef RISC_IO_H
 #define RISC_IO_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 // This is the standard size of the framebuffer, can be overridden.
@@ -11,6 +12,11 @@ struct RISC_Serial {
   uint32_t (*read_status)(const struct RISC_Serial *);
   uint32_t (*read_data)(const struct RISC_Serial *);
   void (*write_data)(const struct RISC_Serial *, uint32_t);
+  // Optional: the number of bytes that can be read and written right
+  // now.  Without it the status bits count as one byte each.
+  void (*counts)(const struct RISC_Serial *, uint32_t *avail, uint32_t *room);
+  // Optional: the machine was reset, whatever the guest set up is gone.
+  void (*reset)(const struct RISC_Serial *);
 };
 
 struct RISC_SPI {
@@ -23,12 +29,51 @@ struct RISC_Clipboard {
   uint32_t (*read_control)(const struct RISC_Clipboard *);
   void (*write_data)(const struct RISC_Clipboard *, uint32_t);
   uint32_t (*read_data)(const struct RISC_Clipboard *);
+  // Optional bulk transfer (see clipboard_command() in cpu.c), with
+  // Oberon line endings.  get copies up to len bytes of the text from
+  // pos and returns the length of the whole text; put collects text at
+  // pos, 0 starting a new one, and with done the text up to pos+len
+  // becomes the clipboard.
+  uint32_t (*get)(const struct RISC_Clipboard *, uint32_t pos, uint8_t *buf, uint32_t len);
+  void (*put)(const struct RISC_Clipboard *, uint32_t pos, const uint8_t *buf, uint32_t len, bool done);
+};
+
+// Block device behind the paravirtual DMA interface.  Blocks are the
+// 512-byte SD blocks the SPI interface uses, as little endian words.
+struct RISC_Block {
+  bool (*read)(const struct RISC_Block *, uint32_t block, uint32_t *buf, uint32_t count);
+  bool (*write)(const struct RISC_Block *, uint32_t block, const uint32_t *buf, uint32_t count);
+};
+
+// Files in a host directory, behind the paravirtual descriptor interface
+// (see hostfs_command() in cpu.c).  Names are NUL-terminated, buffers
+// are guest memory.  Everything returns -1 on failure.
+struct RISC_HostFS {
+  int32_t (*open)(const struct RISC_HostFS *, const char *name, bool create);
+  void (*close)(const struct RISC_HostFS *, int32_t handle);
+  int32_t (*read)(const struct RISC_HostFS *, int32_t handle, uint32_t pos, uint8_t *buf, uint32_t len);
+  int32_t (*write)(const struct RISC_HostFS *, int32_t handle, uint32_t pos, const uint8_t *buf, uint32_t len);
+  int32_t (*length)(const struct RISC_HostFS *, int32_t handle);
+  // Length of the named file, and its modification time as an Oberon date
+  int32_t (*stat)(const struct RISC_HostFS *, const char *name, uint32_t *date);
+  // The index-th file, as of the last call with index 0
+  int32_t (*dir)(const struct RISC_HostFS *, uint32_t index, char *name, uint32_t size);
+  int32_t (*remove)(const struct RISC_HostFS *, const char *name);
+  int32_t (*rename)(const struct RISC_HostFS *, const char *from, const char *to);
+  // Optional: the machine was reset, close all handles.
+  void (*reset)(const struct RISC_HostFS *);
 };
 
 struct RISC_LED {
   void (*write)(const struct RISC_LED *, uint32_t);
 };
 
+// Called on the first framebuffer store after each keyboard or mouse
+// input, for measuring input latency.
+struct RISC_Probe {
+  void (*framebuffer_store)(const struct RISC_Probe *);
+};
+
 struct Damage {
   int x1, x2, y1, y2;
 };
@@ -165,15 +165,17 @@ void risc_reset(struct RISC *risc) {
   risc->PC = ROMStart/4;
 }
 
-void risc_run(struct RISC *risc, int cycles) {
+int risc_run(struct RISC *risc, int cycles) {
   risc->progress = 20;
   // The progress value is used to detect that the RISC cpu is busy
   // waiting on the millisecond counter or on the keyboard ready
   // bit. In that case it's better to just pause emulation until the
   // next frame.
-  for (int i = 0; i < cycles && risc->progress; i++) {
+  int i;
+  for (i = 0; i < cycles && risc->progress; i++) {
     risc_single_step(risc);
   }
+  return i;
 }
 
 static void risc_single_step(struct RISC *risc) {
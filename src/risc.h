@@ -17,7 +17,7 @@ void risc_set_clipboard(struct RISC *risc, const struct RISC_Clipboard *clipboar
 void risc_set_switches(struct RISC *risc, int switches);
 
 void risc_reset(struct RISC *risc);
-void risc_run(struct RISC *risc, int cycles);
+int risc_run(struct RISC *risc, int cycles);
 void risc_set_time(struct RISC *risc, uint32_t tick);
 void risc_mouse_moved(struct RISC *risc, int mouse_x, int mouse_y);
 void risc_mouse_button(struct RISC *risc, int button, bool down);
@@ -4,6 +4,9 @@
 #include <SDL.h>
 #include "sdl-clipboard.h"
 
+// Largest text the guest can put in one go
+#define MAX_PUT (64 << 20)
+
 enum State { IDLE, GET, PUT };
 
 static enum State state = IDLE;
@@ -11,6 +14,16 @@ static char *data = NULL;
 static size_t data_ptr = 0;
 static size_t data_len = 0;
 
+// The host clipboard with Oberon line endings.  It is only fetched again
+// after SDL reported a change, so polling the control register is cheap.
+static char *text = NULL;
+static uint32_t text_len = 0;
+static int text_stale = 1;
+
+// Text collected by bulk puts
+static char *put_text = NULL;
+static size_t put_len = 0;
+
 static void reset() {
   state = IDLE;
   free(data);
@@ -19,28 +32,48 @@ static void reset() {
   data_ptr = 0;
 }
 
-static uint32_t clipboard_control_read(const struct RISC_Clipboard *clip) {
-  uint32_t r = 0;
-  reset();
-  data = SDL_GetClipboardText();
-  if (data) {
-    data_len = strlen(data);
-    if (data_len > UINT32_MAX) {
-      reset();
+static void refresh() {
+  if (!__atomic_exchange_n(&text_stale, 0, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  free(text);
+  text = NULL;
+  text_len = 0;
+  char *s = SDL_GetClipboardText();
+  if (s) {
+    size_t len = strlen(s);
+    if (len < UINT32_MAX) {
+      text = malloc(len + 1);
     }
-    else if (data_len > 0) {
-      state = GET;
-      r = (uint32_t)data_len;
-      // Decrease length if data contains CR/LF line endings
-      const char *p = data;
-      while ((p = strchr(p, '\r')) != NULL) {
-        if (*++p == '\n') {
-          r--;
+    if (text) {
+      // CR/LF and LF both become CR
+      for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\r' && s[i + 1] == '\n') {
+          i++;
         }
+        text[text_len++] = s[i] == '\n' ? '\r' : s[i];
       }
     }
+    SDL_free(s);
+  }
+}
+
+static void set_clipboard(char *buf) {
+  SDL_SetClipboardText(buf);
+  __atomic_store_n(&text_stale, 1, __ATOMIC_RELEASE);
+}
+
+void sdl_clipboard_changed(void) {
+  __atomic_store_n(&text_stale, 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t clipboard_control_read(const struct RISC_Clipboard *clip) {
+  reset();
+  refresh();
+  if (text_len > 0) {
+    state = GET;
   }
-  return r;
+  return text_len;
 }
 
 static void clipboard_control_write(const struct RISC_Clipboard *clip, uint32_t len) {
@@ -58,15 +91,10 @@ static void clipboard_control_write(const struct RISC_Clipboard *clip, uint32_t
 static uint32_t clipboard_data_read(const struct RISC_Clipboard *clip) {
   uint32_t result = 0;
   if (state == GET) {
-    assert(data && data_ptr < data_len);
-    result = (uint8_t)data[data_ptr];
+    assert(text && data_ptr < text_len);
+    result = (uint8_t)text[data_ptr];
     data_ptr++;
-    if (result == '\r' && data[data_ptr] == '\n') {
-      data_ptr++;
-    } else if (result == '\n') {
-      result = '\r';
-    }
-    if (data_ptr == data_len) {
+    if (data_ptr == text_len) {
       reset();
     }
   }
@@ -83,15 +111,54 @@ static void clipboard_data_write(const struct RISC_Clipboard *clip, uint32_t c)
     ++data_ptr;
     if (data_ptr == data_len) {
       data[data_ptr] = 0;
-      SDL_SetClipboardText(data);
+      set_clipboard(data);
       reset();
     }
   }
 }
 
+static uint32_t clipboard_get(const struct RISC_Clipboard *clip, uint32_t pos, uint8_t *buf, uint32_t len) {
+  if (pos == 0) {
+    refresh();
+  }
+  if (pos < text_len) {
+    uint32_t n = text_len - pos < len ? text_len - pos : len;
+    memcpy(buf, text + pos, n);
+  }
+  return text_len;
+}
+
+static void clipboard_put(const struct RISC_Clipboard *clip, uint32_t pos, const uint8_t *buf, uint32_t len, bool done) {
+  if (pos == 0) {
+    put_len = 0;
+  }
+  size_t end = (size_t)pos + len;
+  if (pos > put_len || end > MAX_PUT) {
+    return;  // out of order
+  }
+  char *p = realloc(put_text, end + 1);
+  if (p == NULL) {
+    return;
+  }
+  put_text = p;
+  for (uint32_t i = 0; i < len; i++) {
+    put_text[pos + i] = buf[i] == '\r' ? '\n' : (char)buf[i];
+  }
+  put_len = end;
+  if (done) {
+    put_text[end] = 0;
+    set_clipboard(put_text);
+    free(put_text);
+    put_text = NULL;
+    put_len = 0;
+  }
+}
+
 const struct RISC_Clipboard sdl_clipboard = {
   .write_control = clipboard_control_write,
   .read_control = clipboard_control_read,
   .write_data = clipboard_data_write,
-  .read_data = clipboard_data_read
+  .read_data = clipboard_data_read,
+  .get = clipboard_get,
+  .put = clipboard_put
 };
@@ -5,4 +5,7 @@
 
 extern const struct RISC_Clipboard sdl_clipboard;
 
+// To be called on SDL_CLIPBOARDUPDATE: the cached host text is stale.
+void sdl_clipboard_changed(void);
+
 #endif  // SDL_CLIPBOARD_H
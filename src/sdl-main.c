@@ -1,12 +1,18 @@
 #include "disk.h"
 #include "emu/riscv.h"
+#include "input-log.h"
+#include "latency.h"
 #include "pclink.h"
 #include "raw-serial.h"
+#include "hostfs.h"
 #include "risc-io.h"
 #include "sdl-clipboard.h"
 #include "sdl-ps2.h"
+#include "speed.h"
 #include <SDL.h>
+#include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -32,14 +38,39 @@ static enum Action map_keyboard_event(SDL_KeyboardEvent *event);
 static void show_leds(const struct RISC_LED *leds, uint32_t value);
 static double scale_display(SDL_Window *window, const SDL_Rect *risc_rect,
                             SDL_Rect *display_rect);
-static void update_texture(CPU *risc, SDL_Texture *texture,
+static bool update_texture(CPU *risc, SDL_Texture *texture,
                            const SDL_Rect *risc_rect);
 
+struct Frontend {
+  SDL_Window *window;
+  SDL_Rect risc_rect;
+  SDL_Rect display_rect;
+  double display_scale;
+  bool fullscreen;
+  bool mouse_was_offscreen;
+  struct Speed *speed;
+  uint32_t configured_hz;
+  CPU *riscv;
+  struct InputLog *input_log;
+  struct Latency *latency;
+  char *typing;       // text being typed, see type_more()
+  size_t typing_len;
+  size_t typing_pos;
+};
+
+static bool handle_events(CPU *riscv, struct Frontend *fe);
+static bool type_file(struct Frontend *fe, const char *path);
+static void type_more(struct Frontend *fe);
+static uint64_t trace_clock(void *riscv);
+
 enum Action {
   ACTION_OBERON_INPUT,
   ACTION_QUIT,
   ACTION_RESET,
   ACTION_TOGGLE_FULLSCREEN,
+  ACTION_TOGGLE_SPEED,
+  ACTION_REPORT_LATENCY,
+  ACTION_TYPE_CLIPBOARD,
   ACTION_FAKE_MOUSE1,
   ACTION_FAKE_MOUSE2,
   ACTION_FAKE_MOUSE3
@@ -60,6 +91,9 @@ struct KeyMapping key_map[] = {
     {SDL_PRESSED, SDLK_RETURN, KMOD_ALT, 0, ACTION_TOGGLE_FULLSCREEN},
     {SDL_PRESSED, SDLK_f, KMOD_GUI, KMOD_SHIFT,
      ACTION_TOGGLE_FULLSCREEN}, // Mac?
+    {SDL_PRESSED, SDLK_F9, 0, 0, ACTION_TOGGLE_SPEED},
+    {SDL_PRESSED, SDLK_F8, 0, 0, ACTION_REPORT_LATENCY},
+    {SDL_PRESSED, SDLK_F7, 0, 0, ACTION_TYPE_CLIPBOARD},
     { SDL_PRESSED,  SDLK_LALT,   0, 0,                  ACTION_FAKE_MOUSE2 },
     { SDL_RELEASED, SDLK_LALT,   0, 0,                  ACTION_FAKE_MOUSE2 },
 };
@@ -73,7 +107,23 @@ static struct option long_options[] = {
     {"size", required_argument, NULL, 's'},
     {"serial-in", required_argument, NULL, 'I'},
     {"serial-out", required_argument, NULL, 'O'},
+    {"serial", required_argument, NULL, 'E'},
     {"boot-from-serial", no_argument, NULL, 'S'},
+    {"speed", required_argument, NULL, 'X'},
+    {"slice", required_argument, NULL, 'T'},
+    {"harts", required_argument, NULL, 'H'},
+    {"deterministic", no_argument, NULL, 'D'},
+    {"record", required_argument, NULL, 'R'},
+    {"replay", required_argument, NULL, 'P'},
+    {"latency", no_argument, NULL, 'Y'},
+    {"disk-backend", required_argument, NULL, 'B'},
+    {"msync", required_argument, NULL, 'M'},
+    {"disk-cache", required_argument, NULL, 'C'},
+    {"disk-fsync", no_argument, NULL, 'F'},
+    {"ramdisk", required_argument, NULL, 'A'},
+    {"disk-trace", required_argument, NULL, 'K'},
+    {"host-dir", required_argument, NULL, 'G'},
+    {"type", required_argument, NULL, 'W'},
     {NULL, no_argument, NULL, 0}};
 
 static void fail(int code, const char *fmt, ...) {
@@ -96,7 +146,38 @@ static void usage() {
        "  --boot-from-serial    Boot from serial line (disk image not "
        "required)\n"
        "  --serial-in FILE      Read serial input from FILE\n"
-       "  --serial-out FILE     Write serial output to FILE\n");
+       "  --serial-out FILE     Write serial output to FILE\n"
+       "  --serial SPEC         Serial line on a Unix socket, 'unix:PATH'\n"
+       "                        (connecting, or else listening), or on a new\n"
+       "                        pseudo terminal, 'pty' or 'pty:LINK'\n"
+       "  --speed SPEED         Emulated clock: 'max', a MHz value or a multiple\n"
+       "                        of the nominal 25 MHz such as '4x' (F9 toggles max)\n"
+       "  --slice MS            Check for input every MS milliseconds within a\n"
+       "                        frame (default 1, 0 = once per frame)\n"
+       "  --harts N             Emulate N harts (1-16), each on its own thread\n"
+       "  --deterministic       Derive time from the instruction count and apply\n"
+       "                        input only between fixed-size slices\n"
+       "  --record FILE         Deterministic mode, logging all input to FILE\n"
+       "  --replay FILE         Deterministic mode, taking input from FILE\n"
+       "  --latency             Measure input-to-display latency, reported at\n"
+       "                        exit and on F8\n"
+       "  --disk-backend TYPE   Access the disk image through 'mmap' (default\n"
+       "                        where available) or 'stdio'\n"
+       "  --msync POLICY        When to write back the mapped image: 'none'\n"
+       "                        (left to the OS, default), 'async' or 'sync'\n"
+       "                        after every disk write\n"
+       "  --disk-cache POLICY   'writethrough' (default), 'periodic[:MS]' to write\n"
+       "                        back dirty sectors in the background every MS ms\n"
+       "                        (default 1000) or 'exit' to keep them until exit\n"
+       "  --disk-fsync          Make every write-back durable with fsync\n"
+       "  --ramdisk MODE        Run from a copy of the disk image in memory;\n"
+       "                        at exit 'discard' the changes or 'save' them\n"
+       "  --disk-trace FILE     Log every disk transfer to FILE (CSV if it ends\n"
+       "                        in .csv, binary otherwise), summary at exit\n"
+       "  --host-dir DIR        Let Oberon open the files in DIR directly\n"
+       "                        (Mods/HostFiles.Mod)\n"
+       "  --type FILE           Type the text in FILE on the keyboard, as fast\n"
+       "                        as Oberon reads it (F7 types the clipboard)\n");
   exit(1);
 }
 
@@ -155,16 +236,16 @@ void debug(CPU *riscv) {
       printf("Logging: %0d\n", riscv->logging);
       break;
     case 'p': // print count
-      printf("\tInstructions counted since toggle: %lu\n", riscv->num_insts);
+      printf("\tInstructions counted since toggle: %lu\n", riscv->harts[0].num_insts);
       break;
     case 'c': // toggle count
-      riscv->num_insts = 0;
+      riscv->harts[0].num_insts = 0;
       break;
     case 'x': // print regs
       printf("Regs:\n");
-        printf("x%2d: 0x%8x, ", 0, riscv->registers[0]);
+        printf("x%2d: 0x%8x, ", 0, riscv->harts[0].registers[0]);
       for (int i = 1; i < 32; i++) {
-        printf("x%2d: 0x%8x, ", i, riscv->registers[i]);
+        printf("x%2d: 0x%8x, ", i, riscv->harts[0].registers[i]);
         if (i % 4 == 0) printf("\n");
       }
       printf("\n");
@@ -218,10 +299,22 @@ int main(int argc, char *argv[]) {
   int mem_option = 0;
   const char *serial_in = NULL;
   const char *serial_out = NULL;
+  const char *serial_spec = NULL;
   bool boot_from_serial = false;
+  struct Speed speed;
+  speed_init(&speed, CPU_HZ);
+  int slice_ms = 1;
+  bool deterministic = false;
+  const char *record_file = NULL;
+  const char *replay_file = NULL;
+  bool measure_latency = false;
+  struct DiskOptions disk_options = { 0 };
+  const char *disk_trace_file = NULL;
+  const char *host_dir = NULL;
+  const char *typing_file = NULL;
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "z:fLlm:s:I:O:S", long_options,
+  while ((opt = getopt_long(argc, argv, "z:fLlm:s:I:O:E:SX:T:H:DR:P:YB:M:C:FA:K:G:W:", long_options,
                             NULL)) != -1) {
     switch (opt) {
     case 'z': {
@@ -267,11 +360,117 @@ int main(int argc, char *argv[]) {
       serial_out = optarg;
       break;
     }
+    case 'E': {
+      serial_spec = optarg;
+      break;
+    }
     case 'S': {
       boot_from_serial = true;
       riscv_set_switches(riscv, 1);
       break;
     }
+    case 'X': {
+      if (!speed_parse(&speed, optarg)) {
+        usage();
+      }
+      break;
+    }
+    case 'T': {
+      if (sscanf(optarg, "%d", &slice_ms) != 1 || slice_ms < 0) {
+        usage();
+      }
+      break;
+    }
+    case 'H': {
+      int harts;
+      if (sscanf(optarg, "%d", &harts) != 1 || harts < 1 || harts > MaxHarts) {
+        usage();
+      }
+      riscv_set_harts(riscv, (uint32_t)harts);
+      break;
+    }
+    case 'D': {
+      deterministic = true;
+      break;
+    }
+    case 'R': {
+      deterministic = true;
+      record_file = optarg;
+      break;
+    }
+    case 'P': {
+      deterministic = true;
+      replay_file = optarg;
+      break;
+    }
+    case 'Y': {
+      measure_latency = true;
+      break;
+    }
+    case 'K': {
+      disk_trace_file = optarg;
+      break;
+    }
+    case 'G': {
+      host_dir = optarg;
+      break;
+    }
+    case 'W': {
+      typing_file = optarg;
+      break;
+    }
+    case 'B': {
+      if (strcmp(optarg, "mmap") == 0) {
+        disk_options.backend = DISK_BACKEND_MMAP;
+      } else if (strcmp(optarg, "stdio") == 0) {
+        disk_options.backend = DISK_BACKEND_STDIO;
+      } else {
+        usage();
+      }
+      break;
+    }
+    case 'M': {
+      if (strcmp(optarg, "none") == 0) {
+        disk_options.msync = DISK_MSYNC_NONE;
+      } else if (strcmp(optarg, "async") == 0) {
+        disk_options.msync = DISK_MSYNC_ASYNC;
+      } else if (strcmp(optarg, "sync") == 0) {
+        disk_options.msync = DISK_MSYNC_SYNC;
+      } else {
+        usage();
+      }
+      break;
+    }
+    case 'C': {
+      unsigned interval = 0;
+      if (strcmp(optarg, "writethrough") == 0) {
+        disk_options.cache = DISK_CACHE_WRITETHROUGH;
+      } else if (strcmp(optarg, "periodic") == 0) {
+        disk_options.cache = DISK_CACHE_PERIODIC;
+      } else if (sscanf(optarg, "periodic:%u", &interval) == 1 && interval > 0) {
+        disk_options.cache = DISK_CACHE_PERIODIC;
+        disk_options.cache_interval_ms = interval;
+      } else if (strcmp(optarg, "exit") == 0) {
+        disk_options.cache = DISK_CACHE_EXIT;
+      } else {
+        usage();
+      }
+      break;
+    }
+    case 'F': {
+      disk_options.fsync = true;
+      break;
+    }
+    case 'A': {
+      if (strcmp(optarg, "discard") == 0) {
+        disk_options.ramdisk = DISK_RAMDISK_DISCARD;
+      } else if (strcmp(optarg, "save") == 0) {
+        disk_options.ramdisk = DISK_RAMDISK_SAVE;
+      } else {
+        usage();
+      }
+      break;
+    }
     default: {
       usage();
     }
@@ -283,24 +482,77 @@ int main(int argc, char *argv[]) {
     //risc_configure_memory(risc, mem_option, risc_rect.w, risc_rect.h);
   }
 
+  struct RISC_SPI *disk = NULL;
   if (optind == argc - 1) {
     printf("Booting from disk %s\n", argv[optind]);
-    riscv_set_spi(riscv, 1, disk_new(argv[optind]));
+    disk = disk_new(argv[optind], &disk_options);
   } else if (optind == argc && boot_from_serial) {
     /* Allow diskless boot */
-    riscv_set_spi(riscv, 1, disk_new(NULL));
+    disk = disk_new(NULL, &disk_options);
   } else {
     usage();
   }
+  riscv_set_spi(riscv, 1, disk);
+  riscv_set_block(riscv, disk_block(disk));
+
+  struct DiskTrace *disk_trace = NULL;
+  if (disk_trace_file) {
+    disk_trace = disk_trace_open(disk_trace_file, trace_clock, riscv);
+    if (disk_trace == NULL) {
+      fail(1, "Can't create disk trace \"%s\": %s", disk_trace_file, strerror(errno));
+    }
+    disk_set_trace(disk, disk_trace);
+  }
 
-  if (serial_in || serial_out) {
+  if (host_dir) {
+    struct RISC_HostFS *hostfs = hostfs_new(host_dir);
+    if (hostfs == NULL) {
+      fail(1, "Can't open host directory \"%s\": %s", host_dir, strerror(errno));
+    }
+    riscv_set_hostfs(riscv, hostfs);
+  }
+
+  if (serial_spec) {
+    if (serial_in || serial_out) {
+      usage();
+    }
+    if (deterministic) {
+      fail(1, "--serial can't be used in deterministic mode");
+    }
+    struct RISC_Serial *serial = raw_serial_open(serial_spec);
+    if (serial == NULL) {
+      fail(1, "Can't open serial line \"%s\"", serial_spec);
+    }
+    riscv_set_serial(riscv, serial);
+  } else if (serial_in || serial_out) {
     if (!serial_in) {
       serial_in = "/dev/null";
     }
     if (!serial_out) {
       serial_out = "/dev/null";
     }
-    riscv_set_serial(riscv, raw_serial_new(serial_in, serial_out));
+    riscv_set_serial(riscv, raw_serial_new(serial_in, serial_out, deterministic));
+  } else if (deterministic) {
+    // PCLink picks up jobs whenever the host creates them
+    riscv_set_serial(riscv, NULL);
+  }
+
+  // In deterministic mode every slice runs exactly this many
+  // instructions, whatever the speed setting; the speed only decides
+  // how the slices are paced against the wall clock.
+  int slices = slice_ms > 0 ? clamp(1000 / FPS / slice_ms, 1, 1000 / FPS) : 1;
+  uint32_t quantum = (speed.target_hz != 0 ? speed.target_hz : CPU_HZ) / FPS / slices;
+  struct InputLog *input_log = NULL;
+  if (deterministic) {
+    riscv_set_deterministic(riscv, (speed.target_hz != 0 ? speed.target_hz : CPU_HZ) / 1000);
+    if (record_file) {
+      input_log = input_log_record(record_file, quantum);
+    } else if (replay_file) {
+      input_log = input_log_replay(replay_file, quantum);
+    }
+    if ((record_file || replay_file) && input_log == NULL) {
+      exit(1);
+    }
   }
 
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
@@ -346,124 +598,142 @@ int main(int argc, char *argv[]) {
     fail(1, "Could not create texture: %s", SDL_GetError());
   }
 
-  SDL_Rect display_rect;
-  double display_scale = scale_display(window, &risc_rect, &display_rect);
+  struct Latency *latency = NULL;
+  if (measure_latency) {
+    latency = latency_new();
+    if (latency == NULL) {
+      fail(1, "Failed to allocate latency buffers.");
+    }
+    riscv_set_probe(riscv, latency_probe(latency));
+  }
+
+  struct Frontend fe = {
+    .window = window,
+    .risc_rect = risc_rect,
+    .fullscreen = fullscreen,
+    .speed = &speed,
+    .configured_hz = speed.target_hz,
+    .riscv = riscv,
+    .input_log = input_log,
+    .latency = latency
+  };
+  fe.display_scale = scale_display(window, &risc_rect, &fe.display_rect);
+  if (typing_file && !type_file(&fe, typing_file)) {
+    fail(1, "Can't read \"%s\": %s", typing_file, strerror(errno));
+  }
   update_texture(riscv, texture, &risc_rect);
   SDL_ShowWindow(window);
   SDL_RenderClear(renderer);
-  SDL_RenderCopy(renderer, texture, &risc_rect, &display_rect);
+  SDL_RenderCopy(renderer, texture, &risc_rect, &fe.display_rect);
   SDL_RenderPresent(renderer);
 
   bool done = false;
-  bool mouse_was_offscreen = false;
+  const uint64_t perf_freq = SDL_GetPerformanceFrequency();
+  uint64_t overhead_us = 0;
   while (!done) {
     uint32_t frame_start = SDL_GetTicks();
+    uint64_t frame_perf = SDL_GetPerformanceCounter();
 
-    SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-      switch (event.type) {
-      case SDL_QUIT: {
-        done = true;
-        break;
-      }
+    if (!handle_events(riscv, &fe)) {
+      break;
+    }
 
-      case SDL_WINDOWEVENT: {
-        if (event.window.event == SDL_WINDOWEVENT_RESIZED) {
-          display_scale = scale_display(window, &risc_rect, &display_rect);
-        }
-        break;
-      }
+    // Leave the time the rest of the frame took last time (events,
+    // rendering) plus some slack, and fill the remainder with emulation.
+    uint64_t frame_us = 1000000 / FPS;
+    uint64_t avail_us = overhead_us < frame_us / 2 ? frame_us - overhead_us : frame_us / 2;
+    uint32_t budget = speed_budget(&speed, FPS, (uint32_t)(avail_us * 9 / 10));
+    if (deterministic) {
+      budget = quantum * slices;
+    }
 
-      case SDL_MOUSEMOTION: {
-        int scaled_x =
-            (int)round((event.motion.x - display_rect.x) / display_scale);
-        int scaled_y =
-            (int)round((event.motion.y - display_rect.y) / display_scale);
-        int x = clamp(scaled_x, 0, risc_rect.w - 1);
-        int y = clamp(scaled_y, 0, risc_rect.h - 1);
-        bool mouse_is_offscreen = x != scaled_x || y != scaled_y;
-        if (mouse_is_offscreen != mouse_was_offscreen) {
-          SDL_ShowCursor(mouse_is_offscreen);
-          mouse_was_offscreen = mouse_is_offscreen;
-        }
-        riscv_mouse_moved(riscv, x, risc_rect.h - y - 1);
+    // Run the frame in slices and look at the input queue between
+    // them, so that a key press doesn't have to wait for the next
+    // frame before the guest sees it.  At a fixed speed every slice
+    // waits until it is due, so a busy guest is spread over the frame
+    // as well; at maximum speed only a guest that went idle early waits.
+    uint64_t exec_ticks = 0;
+    uint64_t idle_ticks = 0;
+    uint64_t insts_run = 0;
+    bool ebreak = false;
+    for (int slice = 0; slice < slices && !ebreak; slice++) {
+      if (slice > 0 && !handle_events(riscv, &fe)) {
+        done = true;
         break;
       }
-
-      case SDL_MOUSEBUTTONDOWN:
-      case SDL_MOUSEBUTTONUP: {
-        bool down = event.button.state == SDL_PRESSED;
-        riscv_mouse_button(riscv, event.button.button, down);
-	break;
+      uint32_t slice_budget = budget / slices;
+      if (slice + 1 == slices) {
+        slice_budget += budget % slices;
       }
-
-      case SDL_KEYDOWN:
-      case SDL_KEYUP: {
-        bool down = event.key.state == SDL_PRESSED;
-        switch (map_keyboard_event(&event.key)) {
-        case ACTION_RESET: {
-          riscv_reset(riscv);
-          break;
-        }
-        case ACTION_TOGGLE_FULLSCREEN: {
-          fullscreen ^= true;
-          if (fullscreen) {
-            SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
-          } else {
-            SDL_SetWindowFullscreen(window, 0);
-          }
-          break;
-        }
-        case ACTION_QUIT: {
-          SDL_PushEvent(&(SDL_Event){.type = SDL_QUIT});
-          break;
-        }
-        case ACTION_FAKE_MOUSE1: {
-          riscv_mouse_button(riscv, 1, down);
-          break;
-        }
-        case ACTION_FAKE_MOUSE2: {
-          riscv_mouse_button(riscv, 2, down);
-          break;
-        }
-        case ACTION_FAKE_MOUSE3: {
-          riscv_mouse_button(riscv, 3, down);
-          break;
-        }
-        case ACTION_OBERON_INPUT: {
-          uint8_t ps2_bytes[MAX_PS2_CODE_LEN];
-          int len = ps2_encode(event.key.keysym.scancode, down, ps2_bytes);
-          riscv_keyboard_input(riscv, ps2_bytes, len);
-          break;
-        }
-        }
+      if (input_log && input_log_is_replay(input_log)) {
+        input_log_feed(input_log, riscv, riscv_get_cycles(riscv));
       }
+      type_more(&fe);
+      riscv_set_time(riscv, SDL_GetTicks());
+      uint64_t insts_before = riscv->harts[0].num_insts;
+      uint64_t exec_start = SDL_GetPerformanceCounter();
+      ebreak = riscv_execute(riscv, slice_budget);
+      exec_ticks += SDL_GetPerformanceCounter() - exec_start;
+      insts_run += riscv->harts[0].num_insts - insts_before;
+      bool idle = riscv->harts[0].num_insts - insts_before < slice_budget;
+      if ((speed.target_hz != 0 || idle) && slice + 1 < slices) {
+        int delay = (int)(frame_start + (uint32_t)(slice + 1) * 1000 / FPS / slices - SDL_GetTicks());
+        if (delay > 0) {
+          uint64_t idle_start = SDL_GetPerformanceCounter();
+          SDL_Delay(delay);
+          idle_ticks += SDL_GetPerformanceCounter() - idle_start;
+        }
       }
     }
-
-    riscv_set_time(riscv, frame_start);
-    bool ebreak = riscv_execute(riscv, CPU_HZ / FPS);
+    speed_measure(&speed, insts_run, exec_ticks * 1000000 / perf_freq);
     if (ebreak) {
       debug(riscv);
 
     }
     //risc_run(risc, CPU_HZ / FPS);
 
-    update_texture(riscv, texture, &risc_rect);
+    if (update_texture(riscv, texture, &risc_rect) && latency) {
+      latency_upload(latency);
+    }
     SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, &risc_rect, &display_rect);
+    SDL_RenderCopy(renderer, texture, &risc_rect, &fe.display_rect);
     SDL_RenderPresent(renderer);
+    if (latency) {
+      latency_present(latency);
+    }
+    if (!ebreak) {
+      overhead_us = ((SDL_GetPerformanceCounter() - frame_perf) - exec_ticks - idle_ticks)
+        * 1000000 / perf_freq;
+    }
 
     uint32_t frame_end = SDL_GetTicks();
     int delay = frame_start + 1000 / FPS - frame_end;
-    if (delay > 0) {
+    if (delay > 0 && !(deterministic && speed.target_hz == 0)) {
       SDL_Delay(delay);
     }
   }
+  if (deterministic) {
+    printf("Instructions retired: %" PRIu64 "\n", riscv_get_cycles(riscv));
+  }
+  input_log_close(input_log);
+  free(fe.typing);
+  if (latency) {
+    latency_report(latency, stderr);
+    latency_free(latency);
+  }
+  disk_free(disk);
+  if (disk_trace) {
+    disk_trace_report(disk_trace, stderr);
+    disk_trace_close(disk_trace);
+  }
   riscv_print_trace(riscv);
   return 0;
 }
 
+static uint64_t trace_clock(void *riscv) {
+  return riscv_get_cycles(riscv);
+}
+
 static int best_display(const SDL_Rect *rect) {
   int best = 0;
   int display_cnt = SDL_GetNumVideoDisplays();
@@ -531,7 +801,8 @@ static double scale_display(SDL_Window *window, const SDL_Rect *risc_rect,
 // allocate three megabyte on the stack.
 static uint32_t pixel_buf[MAX_WIDTH * MAX_HEIGHT];
 
-static void update_texture(CPU *machine, SDL_Texture *texture,
+// Returns true if anything had changed.
+static bool update_texture(CPU *machine, SDL_Texture *texture,
                            const SDL_Rect *risc_rect) {
   struct Damage damage = riscv_get_framebuffer_damage(machine);
   if (damage.y1 <= damage.y2) {
@@ -555,5 +826,252 @@ static void update_texture(CPU *machine, SDL_Texture *texture,
                      .w = (damage.x2 - damage.x1 + 1) * 32,
                      .h = (damage.y2 - damage.y1 + 1)};
     SDL_UpdateTexture(texture, &rect, pixel_buf, rect.w * 4);
+    return true;
+  }
+  return false;
+}
+
+// Guest input goes through these so that it can be journaled. While
+// replaying a journal, live input is ignored.
+static void send_keyboard_input(struct Frontend *fe, uint8_t *scancodes, int len) {
+  if (fe->input_log) {
+    if (input_log_is_replay(fe->input_log)) {
+      return;
+    }
+    input_log_key(fe->input_log, riscv_get_cycles(fe->riscv), scancodes, len);
+  }
+  if (fe->latency) {
+    latency_input(fe->latency);
+  }
+  riscv_keyboard_input(fe->riscv, scancodes, len);
+}
+
+static void send_mouse_moved(struct Frontend *fe, int x, int y) {
+  if (fe->input_log) {
+    if (input_log_is_replay(fe->input_log)) {
+      return;
+    }
+    input_log_mouse_moved(fe->input_log, riscv_get_cycles(fe->riscv), x, y);
+  }
+  if (fe->latency) {
+    latency_input(fe->latency);
+  }
+  riscv_mouse_moved(fe->riscv, x, y);
+}
+
+static void send_mouse_button(struct Frontend *fe, int button, bool down) {
+  if (fe->input_log) {
+    if (input_log_is_replay(fe->input_log)) {
+      return;
+    }
+    input_log_mouse_button(fe->input_log, riscv_get_cycles(fe->riscv), button, down);
+  }
+  riscv_mouse_button(fe->riscv, button, down);
+}
+
+static void send_reset(struct Frontend *fe) {
+  if (fe->input_log) {
+    if (input_log_is_replay(fe->input_log)) {
+      return;
+    }
+    input_log_reset(fe->input_log, riscv_get_cycles(fe->riscv));
+  }
+  riscv_reset(fe->riscv);
+}
+
+// Typed text goes out before every slice, as many characters as fit in
+// the guest's keyboard buffer, so it arrives as fast as Oberon reads it.
+// A character's codes are only sent once they fit as a whole.
+static void start_typing(struct Frontend *fe, char *text, size_t len) {
+  free(fe->typing);
+  fe->typing = text;
+  fe->typing_len = len;
+  fe->typing_pos = 0;
+}
+
+static bool type_file(struct Frontend *fe, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  char *text = NULL;
+  size_t len = 0, cap = 0, n;
+  do {
+    if (len == cap) {
+      cap = cap ? cap * 2 : 4096;
+      char *p = realloc(text, cap);
+      if (p == NULL) {
+        break;
+      }
+      text = p;
+    }
+    n = fread(text + len, 1, cap - len, f);
+    len += n;
+  } while (n > 0);
+  bool ok = !ferror(f) && len < cap;
+  fclose(f);
+  if (!ok) {
+    free(text);
+    return false;
+  }
+  start_typing(fe, text, len);
+  return true;
+}
+
+static void type_clipboard(struct Frontend *fe) {
+  char *s = SDL_GetClipboardText();
+  if (s) {
+    size_t len = strlen(s);
+    char *text = malloc(len + 1);
+    if (text) {
+      memcpy(text, s, len);
+      start_typing(fe, text, len);
+    }
+    SDL_free(s);
+  }
+}
+
+static void type_more(struct Frontend *fe) {
+  if (fe->typing == NULL) {
+    return;
+  }
+  if (fe->input_log && input_log_is_replay(fe->input_log)) {
+    // The recording has the keys already
+    start_typing(fe, NULL, 0);
+    return;
+  }
+  while (fe->typing_pos < fe->typing_len) {
+    char ch = fe->typing[fe->typing_pos];
+    if (ch == '\n') {
+      // CR/LF and LF both become Return
+      if (fe->typing_pos > 0 && fe->typing[fe->typing_pos - 1] == '\r') {
+        fe->typing_pos++;
+        continue;
+      }
+      ch = '\r';
+    }
+    uint8_t ps2_bytes[MAX_PS2_TYPE_LEN];
+    int len = ps2_type(ch, ps2_bytes);
+    if (riscv_keyboard_room(fe->riscv) < (uint32_t)len) {
+      return;
+    }
+    if (len > 0) {
+      send_keyboard_input(fe, ps2_bytes, len);
+    }
+    fe->typing_pos++;
+  }
+  start_typing(fe, NULL, 0);
+}
+
+// Feed all pending SDL events to the emulator.  Returns false when
+// the user asked to quit.
+static bool handle_events(CPU *riscv, struct Frontend *fe) {
+  bool running = true;
+  SDL_Event event;
+  while (SDL_PollEvent(&event)) {
+    switch (event.type) {
+    case SDL_QUIT: {
+      running = false;
+      break;
+    }
+
+    case SDL_CLIPBOARDUPDATE: {
+      sdl_clipboard_changed();
+      break;
+    }
+
+    case SDL_WINDOWEVENT: {
+      if (event.window.event == SDL_WINDOWEVENT_RESIZED) {
+        fe->display_scale = scale_display(fe->window, &fe->risc_rect, &fe->display_rect);
+      }
+      break;
+    }
+
+    case SDL_MOUSEMOTION: {
+      int scaled_x =
+          (int)round((event.motion.x - fe->display_rect.x) / fe->display_scale);
+      int scaled_y =
+          (int)round((event.motion.y - fe->display_rect.y) / fe->display_scale);
+      int x = clamp(scaled_x, 0, fe->risc_rect.w - 1);
+      int y = clamp(scaled_y, 0, fe->risc_rect.h - 1);
+      bool mouse_is_offscreen = x != scaled_x || y != scaled_y;
+      if (mouse_is_offscreen != fe->mouse_was_offscreen) {
+        SDL_ShowCursor(mouse_is_offscreen);
+        fe->mouse_was_offscreen = mouse_is_offscreen;
+      }
+      send_mouse_moved(fe, x, fe->risc_rect.h - y - 1);
+      break;
+    }
+
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP: {
+      bool down = event.button.state == SDL_PRESSED;
+      send_mouse_button(fe, event.button.button, down);
+	break;
+    }
+
+    case SDL_KEYDOWN:
+    case SDL_KEYUP: {
+      bool down = event.key.state == SDL_PRESSED;
+      switch (map_keyboard_event(&event.key)) {
+      case ACTION_RESET: {
+        send_reset(fe);
+        break;
+      }
+      case ACTION_TOGGLE_FULLSCREEN: {
+        fe->fullscreen ^= true;
+        if (fe->fullscreen) {
+          SDL_SetWindowFullscreen(fe->window, SDL_WINDOW_FULLSCREEN_DESKTOP);
+        } else {
+          SDL_SetWindowFullscreen(fe->window, 0);
+        }
+        break;
+      }
+      case ACTION_TOGGLE_SPEED: {
+        if (fe->speed->target_hz != 0) {
+          fe->speed->target_hz = 0;
+        } else {
+          fe->speed->target_hz = fe->configured_hz != 0 ? fe->configured_hz : CPU_HZ;
+        }
+        SDL_SetWindowTitle(fe->window, fe->speed->target_hz == 0 ? "Project Oberon (max speed)"
+                                                              : "Project Oberon");
+        break;
+      }
+      case ACTION_REPORT_LATENCY: {
+        if (fe->latency) {
+          latency_report(fe->latency, stderr);
+        }
+        break;
+      }
+      case ACTION_TYPE_CLIPBOARD: {
+        type_clipboard(fe);
+        break;
+      }
+      case ACTION_QUIT: {
+        SDL_PushEvent(&(SDL_Event){.type = SDL_QUIT});
+        break;
+      }
+      case ACTION_FAKE_MOUSE1: {
+        send_mouse_button(fe, 1, down);
+        break;
+      }
+      case ACTION_FAKE_MOUSE2: {
+        send_mouse_button(fe, 2, down);
+        break;
+      }
+      case ACTION_FAKE_MOUSE3: {
+        send_mouse_button(fe, 3, down);
+        break;
+      }
+      case ACTION_OBERON_INPUT: {
+        uint8_t ps2_bytes[MAX_PS2_CODE_LEN];
+        int len = ps2_encode(event.key.keysym.scancode, down, ps2_bytes);
+        send_keyboard_input(fe, ps2_bytes, len);
+        break;
+      }
+      }
+    }
+    }
   }
+  return running;
 }
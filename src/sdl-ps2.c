@@ -1,5 +1,6 @@
 // Translate SDL scancodes to PS/2 codeset 2 scancodes.
 
+#include <string.h>
 #include <SDL.h>
 #include "sdl-ps2.h"
 
@@ -99,6 +100,68 @@ int ps2_encode(int sdl_scancode, bool make, uint8_t out[static MAX_PS2_CODE_LEN]
   return i;
 }
 
+// US layout; letters and digits are handled in ps2_type()
+static const struct {
+  char plain, shifted;
+  SDL_Scancode key;
+} charmap[] = {
+  { '\r', 0,    SDL_SCANCODE_RETURN },
+  { '\t', 0,    SDL_SCANCODE_TAB },
+  { '\b', 0,    SDL_SCANCODE_BACKSPACE },
+  { ' ',  0,    SDL_SCANCODE_SPACE },
+  { '-',  '_',  SDL_SCANCODE_MINUS },
+  { '=',  '+',  SDL_SCANCODE_EQUALS },
+  { '[',  '{',  SDL_SCANCODE_LEFTBRACKET },
+  { ']',  '}',  SDL_SCANCODE_RIGHTBRACKET },
+  { '\\', '|',  SDL_SCANCODE_BACKSLASH },
+  { ';',  ':',  SDL_SCANCODE_SEMICOLON },
+  { '\'', '"',  SDL_SCANCODE_APOSTROPHE },
+  { '`',  '~',  SDL_SCANCODE_GRAVE },
+  { ',',  '<',  SDL_SCANCODE_COMMA },
+  { '.',  '>',  SDL_SCANCODE_PERIOD },
+  { '/',  '?',  SDL_SCANCODE_SLASH },
+};
+
+int ps2_type(char ch, uint8_t out[static MAX_PS2_TYPE_LEN]) {
+  static const char shifted_digits[] = ")!@#$%^&*(";
+  int key = -1;
+  bool shift = false;
+  if (ch >= 'a' && ch <= 'z') {
+    key = SDL_SCANCODE_A + (ch - 'a');
+  } else if (ch >= 'A' && ch <= 'Z') {
+    key = SDL_SCANCODE_A + (ch - 'A');
+    shift = true;
+  } else if (ch >= '0' && ch <= '9') {
+    key = ch == '0' ? SDL_SCANCODE_0 : SDL_SCANCODE_1 + (ch - '1');
+  } else if (ch != 0 && strchr(shifted_digits, ch)) {
+    int digit = (int)(strchr(shifted_digits, ch) - shifted_digits);
+    key = digit == 0 ? SDL_SCANCODE_0 : SDL_SCANCODE_1 + (digit - 1);
+    shift = true;
+  } else {
+    for (size_t j = 0; j < sizeof(charmap) / sizeof(charmap[0]); j++) {
+      if (ch == charmap[j].plain || (ch != 0 && ch == charmap[j].shifted)) {
+        key = charmap[j].key;
+        shift = ch != charmap[j].plain;
+        break;
+      }
+    }
+  }
+  if (key < 0) {
+    return 0;
+  }
+  int i = 0;
+  if (shift) {
+    out[i++] = 0x12;
+  }
+  i += ps2_encode(key, true, &out[i]);
+  i += ps2_encode(key, false, &out[i]);
+  if (shift) {
+    out[i++] = 0xF0;
+    out[i++] = 0x12;
+  }
+  return i;
+}
+
 static struct k_info keymap[SDL_NUM_SCANCODES] = {
   [SDL_SCANCODE_A] = { 0x1C, K_NORMAL },
   [SDL_SCANCODE_B] = { 0x32, K_NORMAL },
@@ -8,4 +8,11 @@
 
 int ps2_encode(int sdl_scancode, bool make, uint8_t out[static MAX_PS2_CODE_LEN]);
 
+#define MAX_PS2_TYPE_LEN (2 * MAX_PS2_CODE_LEN + 3)
+
+// Codes that type the ASCII character ch on a US keyboard: a press and
+// release of its key, with left shift held around them if needed.
+// Returns 0 for characters that have no key.
+int ps2_type(char ch, uint8_t out[static MAX_PS2_TYPE_LEN]);
+
 #endif  // SDL_PS2_H
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include "serial-ring.h"
+
+#ifndef __linux__
+
+struct RISC_Serial *serial_ring_new(int fd_in, int fd_out) {
+  return NULL;
+}
+
+struct RISC_Serial *serial_ring_link(struct SerialLink *link, int fd) {
+  return NULL;
+}
+
+#else  // __linux__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define RING_SIZE (1 << 16)
+
+// While there was traffic in the last LINGER_MS the thread looks at the
+// rings every millisecond, so a guest writing byte by byte doesn't wake
+// it for every byte.  After that it sleeps until the guest or an fd
+// wakes it.
+#define LINGER_MS 20
+
+#define RETRY_MS 100
+
+// Single producer, single consumer: head is only written by the
+// producer, tail only by the consumer.  Both count bytes forever and
+// are reduced modulo RING_SIZE for indexing.
+struct Ring {
+  uint32_t head;
+  uint32_t tail;
+  uint8_t buf[RING_SIZE];
+};
+
+struct SerialRing {
+  struct RISC_Serial serial;
+  struct Ring rx;  // fd_in -> guest
+  struct Ring tx;  // guest -> fd_out
+  int fd_in, fd_out;  // -1 while a link has no connection
+  int epoll_fd;
+  int wake_fd;     // eventfd, written by the guest side to end a sleep
+  int asleep;      // set by the thread while it sleeps without timeout
+  // False for regular files, which are always ready, and for fds that
+  // hung up, which are drained without epoll until they run dry.
+  bool poll_in, poll_out;
+  uint32_t events_in, events_out, events_wait;
+  bool in_eof;
+  struct SerialLink *link;
+  bool retry;      // whether to ask the link for a connection
+};
+
+static uint32_t ring_used(struct Ring *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static void wake(struct SerialRing *s) {
+  // Pairs with the fence in io_thread: either the thread sees our ring
+  // update before sleeping, or we see it asleep.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&s->asleep, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&s->asleep, 0, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    if (write(s->wake_fd, &one, sizeof(one)) < 0) {
+      // the counter can't overflow with one write per sleep
+    }
+  }
+}
+
+static uint32_t read_status(const struct RISC_Serial *serial) {
+  struct SerialRing *s = (struct SerialRing *)serial;
+  return (ring_used(&s->rx) > 0 ? 1 : 0) | (ring_used(&s->tx) < RING_SIZE ? 2 : 0);
+}
+
+static void counts(const struct RISC_Serial *serial, uint32_t *avail, uint32_t *room) {
+  struct SerialRing *s = (struct SerialRing *)serial;
+  *avail = ring_used(&s->rx);
+  *room = RING_SIZE - ring_used(&s->tx);
+}
+
+static uint32_t read_data(const struct RISC_Serial *serial) {
+  struct SerialRing *s = (struct SerialRing *)serial;
+  uint32_t tail = s->rx.tail;
+  if (__atomic_load_n(&s->rx.head, __ATOMIC_ACQUIRE) == tail) {
+    return 0;
+  }
+  uint8_t byte = s->rx.buf[tail % RING_SIZE];
+  __atomic_store_n(&s->rx.tail, tail + 1, __ATOMIC_RELEASE);
+  wake(s);
+  return byte;
+}
+
+static void write_data(const struct RISC_Serial *serial, uint32_t data) {
+  struct SerialRing *s = (struct SerialRing *)serial;
+  uint32_t head = s->tx.head;
+  if (head - __atomic_load_n(&s->tx.tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+    return;  // the guest didn't wait for the transmitter to be ready
+  }
+  s->tx.buf[head % RING_SIZE] = (uint8_t)data;
+  __atomic_store_n(&s->tx.head, head + 1, __ATOMIC_RELEASE);
+  wake(s);
+}
+
+static void set_events(struct SerialRing *s, int fd, uint32_t events, uint32_t *current) {
+  if (events != *current) {
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    *current = events;
+  }
+}
+
+static void watch(struct SerialRing *s, bool want_in, bool want_out) {
+  if (s->link && s->link->wait_fd >= 0) {
+    set_events(s, s->link->wait_fd, s->fd_in < 0 ? EPOLLIN : 0, &s->events_wait);
+  }
+  if (s->fd_in < 0) {
+    return;
+  }
+  uint32_t in = want_in && s->poll_in ? EPOLLIN : 0;
+  uint32_t out = want_out && s->poll_out ? EPOLLOUT : 0;
+  if (s->fd_in == s->fd_out) {
+    if (s->poll_in) {
+      set_events(s, s->fd_in, in | out, &s->events_in);
+    }
+  } else {
+    if (s->poll_in) {
+      set_events(s, s->fd_in, in, &s->events_in);
+    }
+    if (s->poll_out) {
+      set_events(s, s->fd_out, out, &s->events_out);
+    }
+  }
+}
+
+// Registers fd with no events, or tells that epoll can't watch it.
+static bool add_fd(int epoll_fd, int fd) {
+  struct epoll_event ev = { .events = 0, .data.fd = fd };
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+// Stops watching a connection that hung up.  Level-triggered epoll
+// would report it over and over while there is no room to read the
+// rest of its data.
+static void unwatch(struct SerialRing *s, int fd) {
+  if (fd == s->fd_in && s->poll_in) {
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    s->poll_in = false;
+    s->events_in = 0;
+  }
+  if (fd == s->fd_out && s->poll_out) {
+    if (fd != s->fd_in) {
+      epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    s->poll_out = false;
+    s->events_out = 0;
+  }
+}
+
+static void attach(struct SerialRing *s, int fd) {
+  s->fd_in = s->fd_out = fd;
+  s->poll_in = s->poll_out = add_fd(s->epoll_fd, fd);
+  s->events_in = s->events_out = 0;
+}
+
+static void disconnect(struct SerialRing *s) {
+  unwatch(s, s->fd_in);
+  close(s->fd_in);
+  s->fd_in = s->fd_out = -1;
+  s->retry = s->link->wait_fd < 0;
+}
+
+// Reads what fits into the contiguous free part of the receive ring.
+static bool fill(struct SerialRing *s) {
+  uint32_t head = s->rx.head;
+  uint32_t space = RING_SIZE - (head - __atomic_load_n(&s->rx.tail, __ATOMIC_ACQUIRE));
+  uint32_t pos = head % RING_SIZE;
+  if (space > RING_SIZE - pos) {
+    space = RING_SIZE - pos;
+  }
+  ssize_t n = read(s->fd_in, s->rx.buf + pos, space);
+  if (n > 0) {
+    __atomic_store_n(&s->rx.head, head + (uint32_t)n, __ATOMIC_RELEASE);
+    return true;
+  }
+  if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+    if (s->link) {
+      disconnect(s);
+    } else {
+      s->in_eof = true;
+    }
+  }
+  return false;
+}
+
+// Writes what it can of the contiguous used part of the transmit ring.
+// Bytes stay in the ring until they are written, also while a link
+// waits for a new connection.
+static bool drain(struct SerialRing *s) {
+  uint32_t tail = s->tx.tail;
+  uint32_t used = __atomic_load_n(&s->tx.head, __ATOMIC_ACQUIRE) - tail;
+  uint32_t pos = tail % RING_SIZE;
+  if (used > RING_SIZE - pos) {
+    used = RING_SIZE - pos;
+  }
+  ssize_t n;
+  if (s->link && s->link->socket) {
+    n = send(s->fd_out, s->tx.buf + pos, used, MSG_NOSIGNAL);
+  } else {
+    n = write(s->fd_out, s->tx.buf + pos, used);
+  }
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    if (s->link) {
+      disconnect(s);
+      return false;
+    }
+    perror("Serial output");
+    n = used;  // nowhere to go
+  }
+  if (n > 0) {
+    __atomic_store_n(&s->tx.tail, tail + (uint32_t)n, __ATOMIC_RELEASE);
+    return true;
+  }
+  return false;
+}
+
+static void *io_thread(void *arg) {
+  struct SerialRing *s = arg;
+  struct epoll_event events[4];
+  int idle = 0;
+
+  for (;;) {
+    if (s->fd_in < 0 && s->retry) {
+      int fd = s->link->connect(s->link);
+      if (fd >= 0) {
+        attach(s, fd);
+      }
+      s->retry = false;
+    }
+    bool connected = s->fd_in >= 0;
+    bool want_in = connected && !s->in_eof && ring_used(&s->rx) < RING_SIZE;
+    bool want_out = connected && ring_used(&s->tx) > 0;
+    watch(s, want_in, want_out);
+
+    int timeout = 1;
+    if (idle >= LINGER_MS) {
+      __atomic_store_n(&s->asleep, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (want_in == (connected && !s->in_eof && ring_used(&s->rx) < RING_SIZE) &&
+          want_out == (connected && ring_used(&s->tx) > 0)) {
+        timeout = -1;
+      }
+    }
+    if (!connected && s->link->wait_fd < 0) {
+      timeout = RETRY_MS;
+    }
+    if ((want_in && !s->poll_in) || (want_out && !s->poll_out)) {
+      timeout = 0;  // a regular file is waiting
+    }
+    int n = epoll_wait(s->epoll_fd, events, 4, timeout);
+    __atomic_store_n(&s->asleep, 0, __ATOMIC_RELAXED);
+    if (n == 0 && timeout == RETRY_MS) {
+      s->retry = true;
+    }
+
+    bool ready_in = !s->poll_in, ready_out = !s->poll_out;
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == s->wake_fd) {
+        uint64_t count;
+        if (read(s->wake_fd, &count, sizeof(count)) < 0) {
+          // already reset
+        }
+        continue;
+      }
+      if (s->link && fd == s->link->wait_fd) {
+        s->retry = true;
+        continue;
+      }
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        unwatch(s, fd);
+      }
+      if (fd == s->fd_in) {
+        ready_in = true;
+      }
+      if (fd == s->fd_out) {
+        ready_out = true;
+      }
+    }
+
+    bool progress = false;
+    if (ready_in && s->fd_in >= 0 && !s->in_eof && ring_used(&s->rx) < RING_SIZE) {
+      progress |= fill(s);
+    }
+    if (ready_out && s->fd_out >= 0 && ring_used(&s->tx) > 0) {
+      progress |= drain(s);
+    }
+    if (progress || n > 0) {
+      idle = 0;
+    } else if (idle < LINGER_MS) {
+      idle++;
+    }
+  }
+  return NULL;
+}
+
+static struct SerialRing *start(int fd_in, int fd_out, struct SerialLink *link) {
+  struct SerialRing *s = calloc(1, sizeof(*s));
+  if (!s) {
+    return NULL;
+  }
+  s->serial = (struct RISC_Serial){
+    .read_status = &read_status,
+    .read_data = &read_data,
+    .write_data = &write_data,
+    .counts = &counts
+  };
+  s->fd_in = fd_in;
+  s->fd_out = fd_out;
+  s->link = link;
+  s->retry = fd_in < 0;
+  s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  s->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (s->epoll_fd < 0 || s->wake_fd < 0) {
+    goto fail;
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = s->wake_fd };
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &ev) < 0) {
+    goto fail;
+  }
+  if (link && link->wait_fd >= 0 && !add_fd(s->epoll_fd, link->wait_fd)) {
+    goto fail;
+  }
+  if (fd_in >= 0) {
+    s->poll_in = add_fd(s->epoll_fd, fd_in);
+    s->poll_out = fd_out == fd_in ? s->poll_in : add_fd(s->epoll_fd, fd_out);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, io_thread, s) != 0) {
+    goto fail;
+  }
+  pthread_detach(thread);
+  return s;
+
+ fail:
+  if (s->wake_fd >= 0) {
+    close(s->wake_fd);
+  }
+  if (s->epoll_fd >= 0) {
+    close(s->epoll_fd);
+  }
+  free(s);
+  return NULL;
+}
+
+struct RISC_Serial *serial_ring_new(int fd_in, int fd_out) {
+  struct SerialRing *s = start(fd_in, fd_out, NULL);
+  return s ? &s->serial : NULL;
+}
+
+struct RISC_Serial *serial_ring_link(struct SerialLink *link, int fd) {
+  struct SerialRing *s = start(fd, fd, link);
+  return s ? &s->serial : NULL;
+}
+
+#endif  // __linux__
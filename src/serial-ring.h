@@ -0,0 +1,30 @@
+#ifndef SERIAL_RING_H
+#define SERIAL_RING_H
+
+#include "risc-io.h"
+
+// Serial line whose file descriptors are served by an I/O thread.
+// The thread moves bytes between the fds and a receive and a transmit
+// ring, so the guest's status and data accesses never make a system
+// call.  The fds must be non-blocking unless they are regular files;
+// fd_in and fd_out may be the same.  Only available on Linux (NULL
+// elsewhere).
+struct RISC_Serial *serial_ring_new(int fd_in, int fd_out);
+
+// Where the connections of a line come from that outlives them, like a
+// socket.  While there is no connection the guest's output stays in
+// the transmit ring.
+struct SerialLink {
+  // Returns a new non-blocking connection, or -1 if there is none yet.
+  int (*connect)(struct SerialLink *);
+  // Readable when connect() is worth trying again, or -1 to retry
+  // every 100 ms.
+  int wait_fd;
+  // Whether connections are sockets (written with MSG_NOSIGNAL).
+  bool socket;
+};
+
+// Starts out with connection fd, or -1 to ask link for one.
+struct RISC_Serial *serial_ring_link(struct SerialLink *link, int fd);
+
+#endif  // SERIAL_RING_H
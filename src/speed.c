@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include "speed.h"
+
+// Don't trust measurements of very short runs (e.g. when the guest
+// was idle and the frame was cut short), they are mostly timer noise.
+#define MIN_SAMPLE_US 500
+
+// Never go below this, so that a badly measured host still makes progress.
+#define MIN_BUDGET 10000
+
+void speed_init(struct Speed *speed, uint32_t base_hz) {
+  *speed = (struct Speed){
+    .base_hz = base_hz,
+    .target_hz = base_hz,
+    .insts_per_us = 0
+  };
+}
+
+bool speed_parse(struct Speed *speed, const char *arg) {
+  char *end;
+  if (strcmp(arg, "max") == 0) {
+    speed->target_hz = 0;
+    return true;
+  }
+  double x = strtod(arg, &end);
+  if (end == arg || x <= 0) {
+    return false;
+  }
+  if (strcmp(end, "x") == 0) {
+    x *= speed->base_hz;
+  } else if (*end == 0 || strcmp(end, "MHz") == 0 || strcmp(end, "mhz") == 0) {
+    x *= 1000000;
+  } else {
+    return false;
+  }
+  if (x >= 4e9) {
+    speed->target_hz = 0;
+  } else {
+    speed->target_hz = (uint32_t)x;
+  }
+  return true;
+}
+
+uint32_t speed_budget(const struct Speed *speed, uint32_t fps, uint32_t avail_us) {
+  double budget;
+  if (speed->target_hz != 0) {
+    budget = (double)speed->target_hz / fps;
+  } else if (speed->insts_per_us > 0) {
+    budget = speed->insts_per_us * avail_us;
+  } else {
+    budget = (double)speed->base_hz / fps;
+  }
+  // Even with a fixed target, don't schedule more than the host can
+  // run in time; the guest slows down instead of the frame rate.
+  if (speed->insts_per_us > 0 && budget > speed->insts_per_us * avail_us) {
+    budget = speed->insts_per_us * avail_us;
+  }
+  if (budget < MIN_BUDGET) {
+    budget = MIN_BUDGET;
+  }
+  if (budget > UINT32_MAX) {
+    budget = UINT32_MAX;
+  }
+  return (uint32_t)budget;
+}
+
+void speed_measure(struct Speed *speed, uint64_t insts, uint64_t us) {
+  if (us < MIN_SAMPLE_US) {
+    return;
+  }
+  double rate = (double)insts / (double)us;
+  if (speed->insts_per_us == 0) {
+    speed->insts_per_us = rate;
+  } else {
+    // Smooth over a few frames, but react quickly to slowdowns.
+    double weight = rate < speed->insts_per_us ? 0.5 : 0.2;
+    speed->insts_per_us += weight * (rate - speed->insts_per_us);
+  }
+}
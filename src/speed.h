@@ -0,0 +1,30 @@
+#ifndef SPEED_H
+#define SPEED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Emulation speed control.  The emulated clock is either a fixed
+// target (some multiple of the nominal clock) or unthrottled, in which
+// case the per-frame instruction budget is sized from the measured host
+// throughput so that frames are still presented on time.
+struct Speed {
+  uint32_t base_hz;     // nominal clock of the emulated machine
+  uint32_t target_hz;   // requested clock, 0 = as fast as the host allows
+  double insts_per_us;  // measured host throughput, 0 = not measured yet
+};
+
+void speed_init(struct Speed *speed, uint32_t base_hz);
+
+// Accepts "max", a clock in MHz ("50", "50MHz") or a multiplier of the
+// nominal clock ("4x").  Returns false if the argument can't be parsed.
+bool speed_parse(struct Speed *speed, const char *arg);
+
+// Number of instructions to run in a frame, given the time (in
+// microseconds) that is available for emulation in that frame.
+uint32_t speed_budget(const struct Speed *speed, uint32_t fps, uint32_t avail_us);
+
+// Feed back how many instructions were run in how much host time.
+void speed_measure(struct Speed *speed, uint64_t insts, uint64_t us);
+
+#endif  // SPEED_H
@@ -0,0 +1,552 @@
+// Reads and writes the Oberon file system of a disk image without
+// booting the emulator. Don't use it on an image the emulator has open.
+//
+//   dskfs ls IMAGE                   list the files
+//   dskfs get IMAGE [-d DIR] [NAME...]
+//                                    extract the named files (default: all)
+//                                    into DIR (default: current directory)
+//   dskfs put IMAGE FILE...          add or replace files, named after the
+//                                    last component of their host path
+//   dskfs rm IMAGE NAME...           delete files
+//   dskfs compact IMAGE [OUTPUT]     rewrite the image with every file
+//                                    contiguous, in directory order, and
+//                                    without the free space at the end
+//
+// Both full SD card images and filesystem-only images (which start
+// with the root directory page, see disk_new) are understood.
+//
+// Disk addresses are sector numbers times 29. Sectors 0 to 63 are
+// reserved, as in Kernel.InitSecMap: sector 1 is the directory root and
+// 2 to 63 hold the boot file.
+// Every file starts with a header sector holding the first 64 sector
+// addresses of the file and up to 12 index sectors with 256 more each.
+// The directory is a B-tree of 24-entry pages rooted at address 29.
+// Free space isn't recorded anywhere (the kernel finds it at boot by
+// walking the directory), so changes only need to write sectors no
+// file uses and then the directory. The directory is rebuilt densely
+// with the new pages elsewhere and the root page written last.
+
+use std::collections::BTreeMap;
+use std::env;
+use std::fs::{self, File, OpenOptions};
+use std::io::*;
+use std::path::{Path, PathBuf};
+use std::process::exit;
+use std::time::UNIX_EPOCH;
+
+const SECTOR: usize = 1024;
+const DIR_ROOT: u32 = 29;
+const DIR_MARK: u32 = 0x9B1EA38D;
+const HEADER_MARK: u32 = 0x9BA71D86;
+const NAME_LEN: usize = 32;
+const HEADER_SIZE: usize = 352;
+const SEC_TAB: usize = 64;
+const EX_TAB: usize = 12;
+const INDEX_SIZE: usize = SECTOR / 4;
+const PAGE_SIZE: usize = 24;  // entries per directory page
+const MAP_SIZE: usize = 0x10000;  // sectors the kernel's sector map covers
+const RESERVED: usize = 64;  // sectors before the first one files may use
+// The file system starts at 256 MB on an SD card image.
+const FS_OFFSET: i64 = 0x80000 * 512;
+
+type Sector = [u8; SECTOR];
+
+fn invalid(msg: &str) -> Error {
+    Error::new(ErrorKind::InvalidData, msg.to_string())
+}
+
+fn u32_at(buf: &[u8], i: usize) -> u32 {
+    (buf[i] as u32) | (buf[i + 1] as u32) << 8 | (buf[i + 2] as u32) << 16 | (buf[i + 3] as u32) << 24
+}
+
+fn put_u32(buf: &mut [u8], i: usize, v: u32) {
+    buf[i] = v as u8;
+    buf[i + 1] = (v >> 8) as u8;
+    buf[i + 2] = (v >> 16) as u8;
+    buf[i + 3] = (v >> 24) as u8;
+}
+
+struct Image {
+    file: File,
+    base: i64,  // byte offset of sector 0
+}
+
+impl Image {
+    fn open(path: &str, write: bool) -> Result<Image> {
+        let file = OpenOptions::new().read(true).write(write).open(path)?;
+        let mut img = Image { file: file, base: -(SECTOR as i64) };
+        if u32_at(&img.read(DIR_ROOT)?, 0) != DIR_MARK {
+            img.base = FS_OFFSET;
+            if u32_at(&img.read(DIR_ROOT)?, 0) != DIR_MARK {
+                return Err(invalid("no Oberon file system found"));
+            }
+        }
+        Ok(img)
+    }
+
+    fn offset(&self, adr: u32) -> Result<u64> {
+        if adr == 0 || adr % 29 != 0 || adr / 29 >= MAP_SIZE as u32 {
+            return Err(invalid(&format!("bad disk address {}", adr)));
+        }
+        Ok(((adr / 29) as i64 * SECTOR as i64 + self.base) as u64)
+    }
+
+    // Sectors past the end of the file read as zeros.
+    fn read(&mut self, adr: u32) -> Result<Sector> {
+        let mut sec = [0u8; SECTOR];
+        let offset = self.offset(adr)?;
+        self.file.seek(SeekFrom::Start(offset))?;
+        let mut filled = 0;
+        while filled < SECTOR {
+            match self.file.read(&mut sec[filled..])? {
+                0 => break,
+                n => filled += n,
+            }
+        }
+        Ok(sec)
+    }
+
+    fn write(&mut self, adr: u32, sec: &Sector) -> Result<()> {
+        if adr != DIR_ROOT && ((adr / 29) as usize) < RESERVED {
+            return Err(invalid(&format!("refusing to overwrite reserved sector {}", adr / 29)));
+        }
+        let offset = self.offset(adr)?;
+        self.file.seek(SeekFrom::Start(offset))?;
+        self.file.write_all(sec)
+    }
+}
+
+struct Entry {
+    name: String,
+    adr: u32,  // file header
+}
+
+fn name_at(buf: &[u8], i: usize) -> String {
+    let raw = &buf[i..i + NAME_LEN];
+    let len = raw.iter().position(|&c| c == 0).unwrap_or(NAME_LEN);
+    String::from_utf8_lossy(&raw[..len]).into_owned()
+}
+
+fn put_name(buf: &mut [u8], i: usize, name: &str) {
+    for b in &mut buf[i..i + NAME_LEN] {
+        *b = 0;
+    }
+    buf[i..i + name.len()].copy_from_slice(name.as_bytes());
+}
+
+fn valid_name(name: &str) -> bool {
+    let b = name.as_bytes();
+    b.len() > 0 && b.len() < NAME_LEN && b[0].is_ascii_alphabetic()
+        && b.iter().all(|c| c.is_ascii_alphanumeric() || *c == b'.')
+}
+
+// In-order walk of the directory B-tree, collecting the file entries
+// and the addresses of the pages.
+fn walk_dir(img: &mut Image, adr: u32, depth: u32, entries: &mut Vec<Entry>, pages: &mut Vec<u32>) -> Result<()> {
+    if depth > 16 {
+        return Err(invalid("directory too deep"));
+    }
+    let page = img.read(adr)?;
+    if u32_at(&page, 0) != DIR_MARK {
+        return Err(invalid(&format!("bad directory page at {}", adr)));
+    }
+    pages.push(adr);
+    let m = (u32_at(&page, 4) as usize).min(PAGE_SIZE);
+    let p0 = u32_at(&page, 8);
+    if p0 != 0 {
+        walk_dir(img, p0, depth + 1, entries, pages)?;
+    }
+    for i in 0..m {
+        let e = 64 + i * 40;
+        entries.push(Entry { name: name_at(&page, e), adr: u32_at(&page, e + 32) });
+        let p = u32_at(&page, e + 36);
+        if p != 0 {
+            walk_dir(img, p, depth + 1, entries, pages)?;
+        }
+    }
+    Ok(())
+}
+
+fn read_dir(img: &mut Image) -> Result<(Vec<Entry>, Vec<u32>)> {
+    let mut entries = Vec::new();
+    let mut pages = Vec::new();
+    walk_dir(img, DIR_ROOT, 0, &mut entries, &mut pages)?;
+    Ok((entries, pages))
+}
+
+struct FileInfo {
+    length: usize,
+    date: u32,
+    sectors: Vec<u32>,  // data sectors, the header first
+    index: Vec<u32>,    // index sectors
+}
+
+fn file_info(img: &mut Image, adr: u32) -> Result<(FileInfo, Sector)> {
+    let hd = img.read(adr)?;
+    if u32_at(&hd, 0) != HEADER_MARK {
+        return Err(invalid(&format!("bad file header at {}", adr)));
+    }
+    let aleng = u32_at(&hd, 36) as usize;
+    let bleng = u32_at(&hd, 40) as usize;
+    if aleng >= SEC_TAB + EX_TAB * INDEX_SIZE || bleng > SECTOR || aleng * SECTOR + bleng < HEADER_SIZE {
+        return Err(invalid(&format!("bad file length in header at {}", adr)));
+    }
+    let mut info = FileInfo { length: aleng * SECTOR + bleng - HEADER_SIZE, date: u32_at(&hd, 44),
+                              sectors: Vec::new(), index: Vec::new() };
+    for i in 0..(aleng + 1).min(SEC_TAB) {
+        info.sectors.push(u32_at(&hd, 48 + EX_TAB * 4 + i * 4));
+    }
+    let mut i = SEC_TAB;
+    while i <= aleng {
+        let ix_adr = u32_at(&hd, 48 + (i - SEC_TAB) / INDEX_SIZE * 4);
+        let ix = img.read(ix_adr)?;
+        info.index.push(ix_adr);
+        let mut j = 0;
+        while j < INDEX_SIZE && i <= aleng {
+            info.sectors.push(u32_at(&ix, j * 4));
+            j += 1;
+            i += 1;
+        }
+    }
+    Ok((info, hd))
+}
+
+fn read_file(img: &mut Image, adr: u32) -> Result<(Vec<u8>, u32)> {
+    let (info, hd) = file_info(img, adr)?;
+    let mut data = Vec::with_capacity(info.sectors.len() * SECTOR);
+    data.extend_from_slice(&hd);
+    for &sec in &info.sectors[1..] {
+        if sec == 0 {
+            data.extend_from_slice(&[0u8; SECTOR]);
+        } else {
+            data.extend_from_slice(&img.read(sec)?);
+        }
+    }
+    data.truncate(HEADER_SIZE + info.length);
+    Ok((data.split_off(HEADER_SIZE), info.date))
+}
+
+// Free sectors, handed out lowest first so that files end up contiguous.
+struct Alloc {
+    used: Vec<bool>,
+    next: usize,
+}
+
+impl Alloc {
+    fn new() -> Alloc {
+        let mut used = vec![false; MAP_SIZE];
+        for u in &mut used[..RESERVED] {
+            *u = true;
+        }
+        Alloc { used: used, next: RESERVED }
+    }
+
+    fn mark(&mut self, adr: u32) {
+        if adr != 0 && adr % 29 == 0 && ((adr / 29) as usize) < MAP_SIZE {
+            self.used[(adr / 29) as usize] = true;
+        }
+    }
+
+    fn alloc(&mut self) -> Result<u32> {
+        while self.next < MAP_SIZE && self.used[self.next] {
+            self.next += 1;
+        }
+        if self.next == MAP_SIZE {
+            return Err(invalid("disk full"));
+        }
+        self.used[self.next] = true;
+        Ok(self.next as u32 * 29)
+    }
+}
+
+// Marks everything the current files and directory pages occupy.
+fn used_sectors(img: &mut Image, entries: &[Entry], pages: &[u32]) -> Result<Alloc> {
+    let mut alloc = Alloc::new();
+    for &page in pages {
+        alloc.mark(page);
+    }
+    for e in entries {
+        let (info, _) = file_info(img, e.adr)?;
+        for &sec in info.sectors.iter().chain(info.index.iter()) {
+            alloc.mark(sec);
+        }
+    }
+    Ok(alloc)
+}
+
+fn write_file(img: &mut Image, alloc: &mut Alloc, name: &str, data: &[u8], date: u32) -> Result<u32> {
+    // The last sector may be full, the kernel does the same
+    let q = data.len() + HEADER_SIZE;
+    let aleng = (q - 1) / SECTOR;
+    if aleng >= SEC_TAB + EX_TAB * INDEX_SIZE {
+        return Err(invalid(&format!("{} is too large", name)));
+    }
+    let mut sectors = Vec::with_capacity(aleng + 1);
+    for _ in 0..aleng + 1 {
+        sectors.push(alloc.alloc()?);
+    }
+    let mut buf = vec![0u8; (aleng + 1) * SECTOR];
+    put_u32(&mut buf, 0, HEADER_MARK);
+    put_name(&mut buf, 4, name);
+    put_u32(&mut buf, 36, aleng as u32);
+    put_u32(&mut buf, 40, (q - aleng * SECTOR) as u32);
+    put_u32(&mut buf, 44, date);
+    for (i, &sec) in sectors.iter().take(SEC_TAB).enumerate() {
+        put_u32(&mut buf, 48 + EX_TAB * 4 + i * 4, sec);
+    }
+    for (k, chunk) in sectors[sectors.len().min(SEC_TAB)..].chunks(INDEX_SIZE).enumerate() {
+        let ix_adr = alloc.alloc()?;
+        let mut ix = [0u8; SECTOR];
+        for (j, &sec) in chunk.iter().enumerate() {
+            put_u32(&mut ix, j * 4, sec);
+        }
+        img.write(ix_adr, &ix)?;
+        put_u32(&mut buf, 48 + k * 4, ix_adr);
+    }
+    buf[HEADER_SIZE..q].copy_from_slice(data);
+    // Data first, header last
+    let mut sec = [0u8; SECTOR];
+    for (i, &adr) in sectors.iter().enumerate().rev() {
+        sec.copy_from_slice(&buf[i * SECTOR..(i + 1) * SECTOR]);
+        img.write(adr, &sec)?;
+    }
+    Ok(sectors[0])
+}
+
+fn write_page(img: &mut Image, adr: u32, p0: u32, entries: &[(String, u32, u32)]) -> Result<()> {
+    let mut page = [0u8; SECTOR];
+    put_u32(&mut page, 0, DIR_MARK);
+    put_u32(&mut page, 4, entries.len() as u32);
+    put_u32(&mut page, 8, p0);
+    for (i, e) in entries.iter().enumerate() {
+        put_name(&mut page, 64 + i * 40, &e.0);
+        put_u32(&mut page, 64 + i * 40 + 32, e.1);
+        put_u32(&mut page, 64 + i * 40 + 36, e.2);
+    }
+    img.write(adr, &page)
+}
+
+// Builds the B-tree bottom up: each level is cut into pages of between
+// PAGE_SIZE / 2 and PAGE_SIZE entries, and the entries between the pages
+// move up a level, until they fit into the root.
+fn write_dir(img: &mut Image, alloc: &mut Alloc, files: &BTreeMap<String, u32>) -> Result<()> {
+    // (name, header, right subtree) and the leftmost subtree
+    let mut level: Vec<(String, u32, u32)> = files.iter().map(|(n, &a)| (n.clone(), a, 0)).collect();
+    let mut p0 = 0;
+    while level.len() > PAGE_SIZE {
+        let pages = (level.len() + 1 + PAGE_SIZE) / (PAGE_SIZE + 1);
+        let per_page = level.len() - (pages - 1);
+        let mut up = Vec::with_capacity(pages - 1);
+        let mut up_p0 = 0;
+        let mut i = 0;
+        for k in 0..pages {
+            let n = per_page / pages + if k < per_page % pages { 1 } else { 0 };
+            let adr = alloc.alloc()?;
+            let left = if k == 0 { p0 } else { level[i - 1].2 };
+            write_page(img, adr, left, &level[i..i + n])?;
+            i += n;
+            if k == 0 {
+                up_p0 = adr;
+            } else {
+                up.last_mut().map(|e: &mut (String, u32, u32)| e.2 = adr);
+            }
+            if k < pages - 1 {
+                up.push(level[i].clone());
+                i += 1;
+            }
+        }
+        level = up;
+        p0 = up_p0;
+    }
+    write_page(img, DIR_ROOT, p0, &level)
+}
+
+fn dir_map(entries: &[Entry]) -> BTreeMap<String, u32> {
+    entries.iter().map(|e| (e.name.clone(), e.adr)).collect()
+}
+
+// Oberon's clock: year (mod 100), month, day, hour, minute, second in
+// bit fields of 6, 4, 5, 5, 6 and 6 bits.
+fn oberon_date(secs: u64) -> u32 {
+    let days = (secs / 86400) as i64;
+    let rem = secs % 86400;
+    // Civil date from days since 1970-01-01
+    let z = days + 719468;
+    let era = z / 146097;
+    let doe = z - era * 146097;
+    let yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    let doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    let mp = (5 * doy + 2) / 153;
+    let day = doy - (153 * mp + 2) / 5 + 1;
+    let month = if mp < 10 { mp + 3 } else { mp - 9 };
+    let year = yoe + era * 400 + if month <= 2 { 1 } else { 0 };
+    ((((((year % 100) as u32 * 16 + month as u32) * 32 + day as u32) * 32 + (rem / 3600) as u32) * 64
+      + (rem / 60 % 60) as u32) * 64) + (rem % 60) as u32
+}
+
+fn format_date(d: u32) -> String {
+    format!("{:02}.{:02}.{:02} {:02}:{:02}:{:02}", d >> 17 & 31, d >> 22 & 15, d >> 26 & 63,
+            d >> 12 & 31, d >> 6 & 63, d & 63)
+}
+
+fn ls(image: &str) -> Result<()> {
+    let mut img = Image::open(image, false)?;
+    let (entries, _) = read_dir(&mut img)?;
+    let mut total = 0;
+    for e in &entries {
+        let (info, _) = file_info(&mut img, e.adr)?;
+        println!("{:<32} {} {:>9}", e.name, format_date(info.date), info.length);
+        total += info.length;
+    }
+    println!("{} files, {} bytes", entries.len(), total);
+    Ok(())
+}
+
+fn get(image: &str, args: &[String]) -> Result<()> {
+    let mut dir = Path::new(".");
+    let mut names = &args[..];
+    if names.len() >= 2 && names[0] == "-d" {
+        dir = Path::new(&names[1]);
+        names = &names[2..];
+    }
+    let mut img = Image::open(image, false)?;
+    let (entries, _) = read_dir(&mut img)?;
+    let files = dir_map(&entries);
+    let wanted: Vec<String> = if names.is_empty() { files.keys().cloned().collect() } else { names.to_vec() };
+    // The names come from the image; don't let one like "../x" escape dir
+    if let Some(name) = wanted.iter().find(|n| !valid_name(n)) {
+        return Err(invalid(&format!("{} is not a valid Oberon file name", name)));
+    }
+    for name in &wanted {
+        let adr = *files.get(name).ok_or(invalid(&format!("{} not found", name)))?;
+        let (data, _) = read_file(&mut img, adr)?;
+        File::create(dir.join(name))?.write_all(&data)?;
+    }
+    Ok(())
+}
+
+fn put(image: &str, paths: &[String]) -> Result<()> {
+    let mut img = Image::open(image, true)?;
+    let (entries, pages) = read_dir(&mut img)?;
+    let mut alloc = used_sectors(&mut img, &entries, &pages)?;
+    let mut files = dir_map(&entries);
+    for path in paths {
+        let name = Path::new(path).file_name().and_then(|n| n.to_str()).unwrap_or("");
+        if !valid_name(name) {
+            return Err(invalid(&format!("{} is not a valid Oberon file name", name)));
+        }
+        let mut data = Vec::new();
+        File::open(path)?.read_to_end(&mut data)?;
+        let mtime = fs::metadata(path)?.modified()?;
+        let secs = mtime.duration_since(UNIX_EPOCH).map(|d| d.as_secs()).unwrap_or(0);
+        let adr = write_file(&mut img, &mut alloc, name, &data, oberon_date(secs))?;
+        files.insert(name.to_string(), adr);
+    }
+    write_dir(&mut img, &mut alloc, &files)?;
+    img.file.sync_all()
+}
+
+fn rm(image: &str, names: &[String]) -> Result<()> {
+    let mut img = Image::open(image, true)?;
+    let (entries, pages) = read_dir(&mut img)?;
+    let mut alloc = used_sectors(&mut img, &entries, &pages)?;
+    let mut files = dir_map(&entries);
+    for name in names {
+        files.remove(name).ok_or(invalid(&format!("{} not found", name)))?;
+    }
+    write_dir(&mut img, &mut alloc, &files)?;
+    img.file.sync_all()
+}
+
+// Copies the first len bytes, leaving holes where the input is zero.
+fn copy_sparse(input: &mut File, output: &mut File, len: u64) -> Result<()> {
+    let mut buf = vec![0u8; 65536];
+    input.seek(SeekFrom::Start(0))?;
+    let mut pos = 0;
+    while pos < len {
+        let n = (len - pos).min(buf.len() as u64) as usize;
+        let got = input.read(&mut buf[..n])?;
+        if got == 0 {
+            break;
+        }
+        if buf[..got].iter().any(|&b| b != 0) {
+            output.seek(SeekFrom::Start(pos))?;
+            output.write_all(&buf[..got])?;
+        }
+        pos += got as u64;
+    }
+    output.set_len(len)
+}
+
+// Reads every file into memory and writes them out again one after the
+// other from sector 64 on, as if onto an empty disk, followed by the
+// directory pages. The boot file is copied as it is.
+// Without an output the image is replaced once the copy is complete.
+fn compact(image: &str, output: Option<&String>) -> Result<()> {
+    let mut img = Image::open(image, false)?;
+    let (entries, pages) = read_dir(&mut img)?;
+    let before = used_sectors(&mut img, &entries, &pages)?.used.iter().filter(|&&u| u).count();
+    let mut fragmented = 0;
+    let mut files = Vec::with_capacity(entries.len());
+    for e in &entries {
+        let (info, _) = file_info(&mut img, e.adr)?;
+        if info.sectors.windows(2).any(|w| w[1] != w[0] + 29) {
+            fragmented += 1;
+        }
+        let (data, date) = read_file(&mut img, e.adr)?;
+        files.push((e.name.clone(), data, date));
+    }
+
+    let path = match output {
+        Some(o) => PathBuf::from(o),
+        None => PathBuf::from(format!("{}.tmp", image)),
+    };
+    let file = OpenOptions::new().read(true).write(true).create(true).truncate(true).open(&path)?;
+    let mut out = Image { file: file, base: img.base };
+    // Keep the boot file as it is, and whatever precedes the file system
+    // on an SD card image; the root page is written anew below
+    copy_sparse(&mut img.file, &mut out.file, (img.base + (RESERVED * SECTOR) as i64) as u64)?;
+    let mut alloc = Alloc::new();
+    let mut dir = BTreeMap::new();
+    for &(ref name, ref data, date) in &files {
+        let adr = write_file(&mut out, &mut alloc, name, data, date)?;
+        dir.insert(name.clone(), adr);
+    }
+    write_dir(&mut out, &mut alloc, &dir)?;
+    let after = alloc.used.iter().filter(|&&u| u).count();
+    let end = alloc.used.iter().rposition(|&u| u).unwrap_or(0) + 1;
+    out.file.set_len((end as i64 * SECTOR as i64 + out.base) as u64)?;
+    out.file.sync_all()?;
+    if output.is_none() {
+        fs::set_permissions(&path, fs::metadata(image)?.permissions())?;
+        fs::rename(&path, image)?;
+    }
+    println!("{} files ({} fragmented), {} sectors in use before, {} after",
+             files.len(), fragmented, before, after);
+    Ok(())
+}
+
+fn usage() -> ! {
+    writeln!(&mut stderr(), "Usage: dskfs ls IMAGE | get IMAGE [-d DIR] [NAME...] | put IMAGE FILE...").unwrap();
+    writeln!(&mut stderr(), "             | rm IMAGE NAME... | compact IMAGE [OUTPUT]").unwrap();
+    exit(1);
+}
+
+fn main() {
+    let args: Vec<String> = env::args().collect();
+    if args.len() < 3 {
+        usage();
+    }
+    let res = match (args[1].as_str(), args.len()) {
+        ("ls", 3) => ls(&args[2]),
+        ("get", _) => get(&args[2], &args[3..]),
+        ("put", n) if n > 3 => put(&args[2], &args[3..]),
+        ("rm", n) if n > 3 => rm(&args[2], &args[3..]),
+        ("compact", 3) | ("compact", 4) => compact(&args[2], args.get(3)),
+        _ => usage(),
+    };
+    if let Err(e) = res {
+        writeln!(&mut stderr(), "dskfs: {}", e).unwrap();
+        exit(1);
+    }
+}
@@ -0,0 +1,283 @@
+// Creates copy-on-write overlays of disk images and commits them back
+// into their base image. See disk-backend.h for the format.
+//
+//   dskoverlay create OVERLAY BASE [SECTORS]
+//                                    new, empty overlay on top of BASE,
+//                                    covering SECTORS 512-byte sectors
+//                                    (default: BASE plus GROWTH)
+//   dskoverlay commit OVERLAY        write the overlay's sectors into its
+//                                    base and empty the overlay
+//   dskoverlay info OVERLAY          show base and number of sectors stored
+
+use std::env;
+use std::fs::{self, File, OpenOptions};
+use std::io::*;
+use std::path::{Path, PathBuf};
+use std::process::exit;
+
+const MAGIC: &'static [u8; 8] = b"RISCOVL3";
+const SECTOR: u64 = 512;
+const HEADER: u64 = 56;
+// Oberon doesn't know where the image ends, so leave room for the
+// 64 MB its sector map can address.
+const GROWTH: u64 = 131072;
+
+struct Overlay {
+    sectors: u32,
+    stored: u32,
+    base: PathBuf,
+    base_size: u64,
+    base_hash: u64,
+    committing: bool,
+    new_size: u64,  // what the base becomes when the commit is done
+    new_hash: u64,
+    table_offset: u64,
+    data_offset: u64,
+    table: Vec<u32>,
+}
+
+fn round_up(n: u64) -> u64 {
+    (n + SECTOR - 1) / SECTOR * SECTOR
+}
+
+fn u32_at(buf: &[u8], i: usize) -> u32 {
+    (buf[i] as u32) | (buf[i + 1] as u32) << 8 | (buf[i + 2] as u32) << 16 | (buf[i + 3] as u32) << 24
+}
+
+fn u64_at(buf: &[u8], i: usize) -> u64 {
+    u32_at(buf, i) as u64 | (u32_at(buf, i + 4) as u64) << 32
+}
+
+fn u32_bytes(v: u32) -> [u8; 4] {
+    [v as u8, (v >> 8) as u8, (v >> 16) as u8, (v >> 24) as u8]
+}
+
+fn u64_bytes(v: u64) -> [u8; 8] {
+    let mut b = [0u8; 8];
+    b[..4].copy_from_slice(&u32_bytes(v as u32));
+    b[4..].copy_from_slice(&u32_bytes((v >> 32) as u32));
+    b
+}
+
+const FNV_BASIS: u64 = 0xcbf29ce484222325;
+
+fn fnv(mut hash: u64, buf: &[u8]) -> u64 {
+    for &b in buf {
+        hash = (hash ^ b as u64).wrapping_mul(0x100000001b3);
+    }
+    hash
+}
+
+// Size and FNV-1a hash of a base image, which the overlay records so
+// that it is never used on top of a different one.
+fn identify(path: &Path) -> Result<(u64, u64)> {
+    let mut file = BufReader::new(File::open(path)?);
+    let mut hash = FNV_BASIS;
+    let mut size = 0u64;
+    loop {
+        let n = {
+            let buf = file.fill_buf()?;
+            hash = fnv(hash, buf);
+            buf.len()
+        };
+        if n == 0 {
+            return Ok((size, hash));
+        }
+        size += n as u64;
+        file.consume(n);
+    }
+}
+
+fn check_base(ovl: &Overlay) -> Result<()> {
+    if identify(&ovl.base)? != (ovl.base_size, ovl.base_hash) {
+        return Err(invalid("base image has changed since the overlay was made"));
+    }
+    Ok(())
+}
+
+fn invalid(msg: &str) -> Error {
+    Error::new(ErrorKind::InvalidData, msg.to_string())
+}
+
+fn read_overlay(file: &mut File, path: &Path) -> Result<Overlay> {
+    let mut header = [0u8; HEADER as usize];
+    file.read_exact(&mut header)?;
+    if &header[..8] != &MAGIC[..] {
+        return Err(invalid("not an overlay"));
+    }
+    let sectors = u32_at(&header, 8);
+    let stored = u32_at(&header, 12);
+    let name_len = u32_at(&header, 16) as u64;
+    let base_size = u64_at(&header, 20);
+    let base_hash = u64_at(&header, 28);
+    let committing = u32_at(&header, 36) != 0;
+    let new_size = u64_at(&header, 40);
+    let new_hash = u64_at(&header, 48);
+    let mut name = vec![0u8; name_len as usize];
+    file.read_exact(&mut name)?;
+    let name = String::from_utf8(name).map_err(|_| invalid("bad base image name"))?;
+    let mut base = PathBuf::from(&name);
+    if base.is_relative() {
+        base = path.parent().unwrap_or(Path::new("")).join(base);
+    }
+    let table_offset = round_up(HEADER + name_len);
+    let data_offset = round_up(table_offset + sectors as u64 * 4);
+    let mut raw = vec![0u8; sectors as usize * 4];
+    file.seek(SeekFrom::Start(table_offset))?;
+    file.read_exact(&mut raw)?;
+    let table = (0..sectors as usize)
+        .map(|i| u32_at(&raw, i * 4))
+        .map(|slot| if slot > stored { 0 } else { slot })
+        .collect();
+    Ok(Overlay { sectors: sectors, stored: stored, base: base,
+                 base_size: base_size, base_hash: base_hash,
+                 committing: committing, new_size: new_size, new_hash: new_hash, table_offset: table_offset, data_offset: data_offset, table: table })
+}
+
+fn create(overlay: &str, base: &str, sectors: Option<&String>) -> Result<()> {
+    let base = fs::canonicalize(base)?;
+    let sectors = match sectors {
+        Some(s) => s.parse::<u64>().map_err(|_| invalid("bad sector count"))?,
+        None => (fs::metadata(&base)?.len() + SECTOR - 1) / SECTOR + GROWTH,
+    };
+    if sectors > 1 << 28 {
+        return Err(invalid("base image too large"));
+    }
+    let name = base.to_str().ok_or(invalid("base image path isn't UTF-8"))?.as_bytes();
+    let (base_size, base_hash) = identify(&base)?;
+    let table_offset = round_up(HEADER + name.len() as u64);
+    let data_offset = round_up(table_offset + sectors * 4);
+
+    let mut out = OpenOptions::new().write(true).create_new(true).open(overlay)?;
+    let mut buf = Vec::with_capacity(data_offset as usize);
+    buf.extend_from_slice(MAGIC);
+    buf.extend_from_slice(&u32_bytes(sectors as u32));
+    buf.extend_from_slice(&u32_bytes(0));
+    buf.extend_from_slice(&u32_bytes(name.len() as u32));
+    buf.extend_from_slice(&u64_bytes(base_size));
+    buf.extend_from_slice(&u64_bytes(base_hash));
+    buf.resize(HEADER as usize, 0);
+    buf.extend_from_slice(name);
+    buf.resize(data_offset as usize, 0);
+    out.write_all(&buf)?;
+    out.sync_all()
+}
+
+// Size and hash the base will have once the overlay's sectors are
+// written into it.
+fn committed_identity(ovl: &Overlay, file: &mut File) -> Result<(u64, u64)> {
+    let mut base = BufReader::new(File::open(&ovl.base)?);
+    let last = ovl.table.iter().rposition(|&slot| slot != 0);
+    let size = ovl.base_size.max(last.map_or(0, |s| (s as u64 + 1) * SECTOR));
+    let mut hash = FNV_BASIS;
+    let mut pos = 0;
+    while pos < size {
+        let n = SECTOR.min(size - pos) as usize;
+        let from_base = SECTOR.min(ovl.base_size.saturating_sub(pos)) as usize;
+        let mut sector = [0u8; SECTOR as usize];
+        base.read_exact(&mut sector[..from_base])?;
+        let slot = ovl.table.get((pos / SECTOR) as usize).cloned().unwrap_or(0);
+        if slot != 0 {
+            file.seek(SeekFrom::Start(ovl.data_offset + (slot as u64 - 1) * SECTOR))?;
+            file.read_exact(&mut sector)?;
+        }
+        hash = fnv(hash, &sector[..n]);
+        pos += n as u64;
+    }
+    Ok((size, hash))
+}
+
+// Writes the commit record (from 20 on): base identity, committing
+// flag, identity after the commit.
+fn write_record(file: &mut File, base: (u64, u64), committing: bool, new: (u64, u64)) -> Result<()> {
+    let mut buf = Vec::with_capacity(36);
+    buf.extend_from_slice(&u64_bytes(base.0));
+    buf.extend_from_slice(&u64_bytes(base.1));
+    buf.extend_from_slice(&u32_bytes(committing as u32));
+    buf.extend_from_slice(&u64_bytes(new.0));
+    buf.extend_from_slice(&u64_bytes(new.1));
+    file.seek(SeekFrom::Start(20))?;
+    file.write_all(&buf)
+}
+
+fn commit(overlay: &str) -> Result<()> {
+    let path = Path::new(overlay);
+    let mut file = OpenOptions::new().read(true).write(true).open(path)?;
+    let ovl = read_overlay(&mut file, path)?;
+    let old = (ovl.base_size, ovl.base_hash);
+    let mut new = (ovl.new_size, ovl.new_hash);
+    // Record what the base is going to become before touching it, so
+    // that an interrupted commit leaves an overlay that says so. Rerun,
+    // it writes the same sectors again into the partly updated base
+    if !ovl.committing || identify(&ovl.base)? == old {
+        check_base(&ovl)?;
+        new = committed_identity(&ovl, &mut file)?;
+        write_record(&mut file, old, true, new)?;
+        file.sync_all()?;
+    }
+
+    let mut base = OpenOptions::new().write(true).open(&ovl.base)?;
+    let mut sector = [0u8; SECTOR as usize];
+    let mut count = 0;
+    for (secnum, &slot) in ovl.table.iter().enumerate() {
+        if slot != 0 {
+            file.seek(SeekFrom::Start(ovl.data_offset + (slot as u64 - 1) * SECTOR))?;
+            file.read_exact(&mut sector)?;
+            base.seek(SeekFrom::Start(secnum as u64 * SECTOR))?;
+            base.write_all(&sector)?;
+            count += 1;
+        }
+    }
+    base.sync_all()?;
+    if identify(&ovl.base)? != new {
+        return Err(invalid("base image doesn't match the commit recorded in the overlay"));
+    }
+
+    // Only empty the overlay once the base is safely written; it now
+    // sits on top of the updated base
+    file.seek(SeekFrom::Start(12))?;
+    file.write_all(&u32_bytes(0))?;
+    write_record(&mut file, new, false, (0, 0))?;
+    file.seek(SeekFrom::Start(ovl.table_offset))?;
+    file.write_all(&vec![0u8; ovl.sectors as usize * 4])?;
+    file.set_len(ovl.data_offset)?;
+    file.sync_all()?;
+    println!("{} sectors committed to {}", count, ovl.base.display());
+    Ok(())
+}
+
+fn info(overlay: &str) -> Result<()> {
+    let path = Path::new(overlay);
+    let mut file = File::open(path)?;
+    let ovl = read_overlay(&mut file, path)?;
+    let used = ovl.table.iter().filter(|&&slot| slot != 0).count();
+    let state = match identify(&ovl.base) {
+        _ if ovl.committing => " (commit interrupted, run dskoverlay commit again)",
+        Ok(id) if id == (ovl.base_size, ovl.base_hash) => "",
+        Ok(_) => " (changed since the overlay was made)",
+        Err(_) => " (missing)",
+    };
+    println!("base:    {}{}", ovl.base.display(), state);
+    println!("covers:  {} sectors", ovl.sectors);
+    println!("stored:  {} sectors ({} KB)", used, ovl.stored as u64 * SECTOR / 1024);
+    Ok(())
+}
+
+fn usage() -> ! {
+    writeln!(&mut stderr(), "Usage: dskoverlay create OVERLAY BASE [SECTORS] | commit OVERLAY | info OVERLAY").unwrap();
+    exit(1);
+}
+
+fn main() {
+    let args: Vec<String> = env::args().collect();
+    let res = match (args.get(1).map(|s| s.as_str()), args.len()) {
+        (Some("create"), 4) | (Some("create"), 5) => create(&args[2], &args[3], args.get(4)),
+        (Some("commit"), 3) => commit(&args[2]),
+        (Some("info"), 3) => info(&args[2]),
+        _ => usage(),
+    };
+    if let Err(e) = res {
+        writeln!(&mut stderr(), "dskoverlay: {}", e).unwrap();
+        exit(1);
+    }
+}
@@ -0,0 +1,124 @@
+// Converts disk images to and from the compressed format understood
+// by the emulator (see src/disk-backend.h).
+//
+//   dskpack pack IMAGE PACKED [SECTORS]
+//   dskpack unpack PACKED IMAGE
+//
+// pack also accepts a compressed image as input, which rewrites it
+// without the space left behind by chunks that grew.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/disk-backend.h"
+
+#define GROWTH 131072  // 64 MB
+#define BATCH DISK_LZ_CHUNK_SECTORS
+
+static uint32_t words[BATCH * 128];
+static uint8_t bytes[BATCH * 512];
+
+static uint32_t image_sectors(const char *filename) {
+  uint8_t header[20];
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return 0;
+  }
+  uint32_t n = 0;
+  if (fread(header, sizeof(header), 1, f) == 1) {
+    n = (uint32_t)header[16] | (uint32_t)header[17] << 8 | (uint32_t)header[18] << 16 | (uint32_t)header[19] << 24;
+  }
+  fclose(f);
+  return n;
+}
+
+static struct DiskBackend *open_input(const char *filename, uint32_t *sectors) {
+  if (disk_lz_probe(filename)) {
+    *sectors = image_sectors(filename);
+    return disk_lz_open(filename);
+  }
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+    perror(filename);
+    exit(1);
+  }
+  *sectors = (uint32_t)((ftell(f) + 511) / 512);
+  fclose(f);
+  return disk_stdio_open(filename);
+}
+
+static void copy(struct DiskBackend *in, struct DiskBackend *out, uint32_t sectors) {
+  for (uint32_t s = 0; s < sectors; s += BATCH) {
+    uint32_t n = sectors - s < BATCH ? sectors - s : BATCH;
+    in->read(in, s, words, n);
+    out->write(out, s, words, n);
+  }
+}
+
+static int pack(const char *input, const char *output, uint32_t size) {
+  uint32_t sectors;
+  struct DiskBackend *in = open_input(input, &sectors);
+  if (in == NULL) {
+    perror(input);
+    return 1;
+  }
+  if (size == 0) {
+    size = sectors + GROWTH;
+  } else if (size < sectors) {
+    fprintf(stderr, "%s has %u sectors, more than %u\n", input, sectors, size);
+    return 1;
+  }
+  if (!disk_lz_create(output, sectors, size)) {
+    perror(output);
+    return 1;
+  }
+  struct DiskBackend *out = disk_lz_open(output);
+  if (out == NULL) {
+    return 1;
+  }
+  copy(in, out, sectors);
+  in->close(in);
+  out->close(out);
+  return 0;
+}
+
+static int unpack(const char *input, const char *output) {
+  uint32_t sectors = image_sectors(input);
+  struct DiskBackend *in = disk_lz_probe(input) ? disk_lz_open(input) : NULL;
+  if (in == NULL) {
+    fprintf(stderr, "%s is not a compressed image\n", input);
+    return 1;
+  }
+  FILE *out = fopen(output, "wb");
+  if (out == NULL) {
+    perror(output);
+    return 1;
+  }
+  for (uint32_t s = 0; s < sectors; s += BATCH) {
+    uint32_t n = sectors - s < BATCH ? sectors - s : BATCH;
+    in->read(in, s, words, n);
+    disk_words_to_bytes(words, bytes, n * 128);
+    if (fwrite(bytes, 512, n, out) != n) {
+      perror(output);
+      return 1;
+    }
+  }
+  in->close(in);
+  if (fclose(out) != 0) {
+    perror(output);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 4 && argc <= 5 && strcmp(argv[1], "pack") == 0) {
+    return pack(argv[2], argv[3], argc == 5 ? (uint32_t)strtoul(argv[4], NULL, 0) : 0);
+  }
+  if (argc == 4 && strcmp(argv[1], "unpack") == 0) {
+    return unpack(argv[2], argv[3]);
+  }
+  fprintf(stderr, "Usage: %s pack IMAGE PACKED [SECTORS]\n"
+                  "       %s unpack PACKED IMAGE\n", argv[0], argv[0]);
+  return 1;
+}